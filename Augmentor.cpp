@@ -1,6 +1,13 @@
 #include "Augmentor.h"
 #include <filesystem>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <thread>
 namespace fs = std::filesystem;
 typedef std::chrono::high_resolution_clock  clocking;
 
@@ -9,6 +16,7 @@ namespace augmentorLib {
         //this->img = Image(filename);
         this->dir_path = in_path;
         this->out_path = out_path;
+        this->sink = std::make_unique<DirectorySink>(out_path);
         Augmentor::pipeline();
     }
 
@@ -16,6 +24,85 @@ namespace augmentorLib {
         image->save(fileName, quality);
     }
 
+    void Augmentor::save(const std::string& fileName, Image* image, const encode_options& options) {
+        image->save(fileName, options);
+    }
+
+    Augmentor& Augmentor::encoder(const encode_options& options) {
+        encoder_options = options;
+        return *this;
+    }
+
+    Augmentor& Augmentor::workers(size_t count) {
+        worker_count = count;
+        return *this;
+    }
+
+    Augmentor& Augmentor::tiles(size_t min_pixels) {
+        tile_pixels = min_pixels;
+        return *this;
+    }
+
+    Augmentor& Augmentor::passthrough(passthrough_mode mode) {
+        passthrough_outputs = mode;
+        return *this;
+    }
+
+    Augmentor& Augmentor::lossless(bool enabled) {
+        lossless_transforms = enabled;
+        return *this;
+    }
+
+    Augmentor& Augmentor::output(std::unique_ptr<OutputSink> output_sink) {
+        sink = std::move(output_sink);
+        return *this;
+    }
+
+    Augmentor& Augmentor::directory(const directory_options& options) {
+        sink = std::make_unique<DirectorySink>(out_path, options);
+        return *this;
+    }
+
+    Augmentor& Augmentor::shards(const std::string& directory, const shard_options& options) {
+        sink = std::make_unique<ShardSink>(directory, options);
+        return *this;
+    }
+
+    Augmentor& Augmentor::tensors(const std::string& directory, const tensor_options& options) {
+        sink = std::make_unique<TensorSink>(directory, options);
+        return *this;
+    }
+
+    Augmentor::lossless_result Augmentor::transform_losslessly(sample_record& record, const chain_type& chain,
+                                                               const std::vector<bool>& fires,
+                                                               std::vector<uint8_t>& bytes) {
+        Transcoder transcoder(record.source);
+        orientation o;
+        for (size_t i = 0; i < chain.size(); ++i) {
+            if (!fires[i]) {
+                continue;
+            }
+            auto width = o.transpose ? transcoder.getHeight() : transcoder.getWidth();
+            auto height = o.transpose ? transcoder.getWidth() : transcoder.getHeight();
+            if (!chain[i]->orient(o, width, height)) {
+                record.operations.clear();
+                return lossless_result::NONE;
+            }
+            record.operations.push_back(chain[i]->describe());
+        }
+        if (o.identity() && passthrough_outputs != passthrough_mode::DISABLED) {
+            record.operations.clear();
+            return lossless_result::SOURCE;
+        }
+        // partial edge MCUs cannot be mirrored, those go through the pixels
+        if (!transcoder.exact(o)) {
+            record.operations.clear();
+            return lossless_result::NONE;
+        }
+        bytes = transcoder.encode(o);
+        return lossless_result::ENCODED;
+    }
+
     Augmentor& Augmentor::pipeline() {
         //auto operation = std::make_unique<SaveOperation<Image>>(directory_path);
         for (const auto & entry : fs::directory_iterator(this->dir_path))
@@ -61,6 +148,12 @@ namespace augmentorLib {
         return *this;;
     }
 
+    Augmentor &Augmentor::resize(size_t height, size_t width, resize_filter filter, double prob) {
+        operations.push_back(std::make_unique<ResizeOperation<Image>>(
+                image_size{height, width}, image_size{height, width}, filter, prob));
+        return *this;
+    }
+
     Augmentor &Augmentor::crop(int height, int width, bool center, double prob) {
         auto operation = std::make_unique<CropOperation<Image>>(
                 image_size{static_cast<size_t>(height), static_cast<size_t>(width)}, center, prob
@@ -77,6 +170,11 @@ namespace augmentorLib {
         return *this;;
     }
 
+    Augmentor &Augmentor::zoom(double min_factor, double max_factor, resize_filter filter, double prob) {
+        operations.push_back(std::make_unique<ZoomOperation<Image>>(zoom_factor{min_factor, max_factor}, filter, prob));
+        return *this;
+    }
+
     Augmentor &Augmentor::rotate(int min_degree, int max_degree, double prob) {
         auto operation = std::make_unique<RotateOperation<Image>>(
                 rotate_range{min_degree, max_degree}, prob
@@ -85,6 +183,11 @@ namespace augmentorLib {
         return *this;;
     }
 
+    Augmentor &Augmentor::rotate(int min_degree, int max_degree, interpolation mode, double prob) {
+        operations.push_back(std::make_unique<RotateOperation<Image>>(rotate_range{min_degree, max_degree}, mode, prob));
+        return *this;
+    }
+
     Augmentor& Augmentor::invert(double prob) {
         auto operation = std::make_unique<InvertOperation<Image>>(prob);
         operations.push_back(std::move(operation));
@@ -110,22 +213,436 @@ namespace augmentorLib {
 //            //std::cout<<"output[" << i << "]=" << output_array[i] << std::endl;
 //        }
 
-        int j=0;
-        for(const std::string& item:output_array) {
-            Image img = Image(item);//creating a temp img object
-            auto image = &img;
-            clocking::time_point start = clocking::now();
-            for (auto &operation : operations) {
-                image = operation->perform(image);
+        // the head of the pipeline may let the decoder skip work, e.g. decode directly at a reduced scale
+        decode_options options;
+        if (!operations.empty()) {
+            operations.front()->hint_decode(options);
+        }
+
+        if (!sink) {
+            sink = std::make_unique<DirectorySink>(out_path);
+        }
+        if (staging) {
+            sample_staged(options);
+            return;
+        }
+        size_t workers = worker_count ? worker_count : std::max(1u, std::thread::hardware_concurrency());
+        if (!tile_pixels) {
+            // with tiles on, the spare workers take tiles of the few images there are
+            workers = std::max<size_t>(1, std::min(workers, output_array.size()));
+        }
+        if (workers == 1) {
+            BufferPool::scoped_use use_pool(pool);
+            std::vector<bool> fires(operations.size());
+            for (size_t j = 0; j < output_array.size(); ++j) {
+                sample_one(j, operations, options, fires);
             }
-            clocking::time_point end = clocking::now();
-            clocking::duration dur = end - start;
-            int timetaken = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
-            std::cout << "Time taken in mseconds is = " << timetaken << std::endl;
-            //std::cout<<this->out_path + "output_" + std::to_string(j) + ".jpg"<<"\n";
-            this->save(this->out_path +  "output_" + std::to_string(j) + ".jpg", image);
-            j++;
+            sink->flush();
+            return;
         }
+
+        // operations keep their random state, so every worker draws from its own reseeded copy of the chain
+        unsigned run_seed = std::random_device{}();
+        std::vector<chain_type> chains;
+        for (size_t worker = 0; worker < workers; ++worker) {
+            chains.push_back(clone_chain(run_seed, worker));
+        }
+        std::vector<std::vector<bool>> fires(workers, std::vector<bool>(operations.size()));
+        std::atomic<bool> failed{false};
+        // one task per output; idle workers steal the backlog of one held up by a large image, and with tiles on,
+        // the operations of a large image split into row ranges other workers take as well
+        Scheduler scheduler(workers, tile_pixels);
+        task_group group;
+        for (size_t j = 0; j < output_array.size(); ++j) {
+            scheduler.spawn(group, [&, j]() {
+                if (failed) {
+                    return;
+                }
+                BufferPool::scoped_use use_pool(pool);
+                auto worker = Scheduler::current_worker();
+                try {
+                    sample_one(j, chains[worker], options, fires[worker]);
+                } catch (...) {
+                    failed = true;
+                    throw;
+                }
+            });
+        }
+        scheduler.wait(group);
+        sink->flush();
+    }
+
+    void Augmentor::sample_one(size_t j, chain_type& chain, const decode_options& options, std::vector<bool>& fires) {
+        // a sink that takes pixels gets every sample decoded, copying or transcoding the source would not save work
+        bool passthrough = passthrough_outputs != passthrough_mode::DISABLED && sink->keeps_jpeg();
+        bool lossless = lossless_transforms && sink->keeps_jpeg();
+        sample_record record;
+        record.index = j;
+        record.source = output_array[j];
+
+        // every operation decides up front, so a sample nothing happens to is never decoded
+        bool operates = false;
+        for (size_t i = 0; i < chain.size(); ++i) {
+            fires[i] = chain[i]->roll();
+            operates = fires[i] || operates;
+        }
+        if (!operates && passthrough) {
+            write_source(record);
+            return;
+        }
+        if (operates && lossless) {
+            std::vector<uint8_t> bytes;
+            switch (transform_losslessly(record, chain, fires, bytes)) {
+                case lossless_result::SOURCE:
+                    write_source(record);
+                    return;
+                case lossless_result::ENCODED:
+                    write(record, bytes);
+                    return;
+                case lossless_result::NONE:
+                    break;
+            }
+        }
+
+        Image img = load(record.source, options);//creating a temp img object
+        auto image = &img;
+        clocking::time_point start = clocking::now();
+        // a reduced or cropped decode already differs from the source
+        bool changed = options.scaled() || options.cropped();
+        for (auto &operation : chain) {
+            image = operation->perform(image);
+            if (operation->changed()) {
+                changed = true;
+                record.operations.push_back(operation->describe());
+            }
+        }
+        clocking::time_point end = clocking::now();
+        clocking::duration dur = end - start;
+        int timetaken = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
+        // one insertion per line, so lines of concurrent workers do not interleave
+        std::cout << "Time taken in mseconds is = " + std::to_string(timetaken) + "\n";
+        if (!changed && passthrough) {
+            write_source(record);
+            return;
+        }
+        if (!sink->keeps_jpeg()) {
+            std::lock_guard<std::mutex> lock(sink_mutex);
+            sink->write_image(record, *image, encoder_options);
+            return;
+        }
+        write(record, image->encode(encoder_options));
+    }
+
+    void Augmentor::write(const sample_record& record, const std::vector<uint8_t>& bytes) {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        sink->write(record, bytes);
+    }
+
+    void Augmentor::write_source(const sample_record& record) {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        sink->write_source(record, passthrough_outputs);
+    }
+
+    namespace {
+        /// One sample on its way through the stages of a staged sample()
+        struct staged_sample {
+            enum class content { SOURCE, PIXELS, ENCODED, PASSTHROUGH };
+            sample_record record;
+            std::vector<bool> fires;
+            content what = content::SOURCE;
+            // the source file after the reader, unless a store holds it; the output stream once ENCODED
+            std::vector<uint8_t> bytes;
+            std::optional<Image> image;
+        };
+        typedef std::unique_ptr<staged_sample> staged_ptr;
+
+        /// Threads of one stage, and what they did
+        struct stage {
+            const char* name;
+            size_t threads;
+            BoundedQueue<staged_ptr>* in;
+            BoundedQueue<staged_ptr>* out;
+            std::atomic<size_t> items{0};
+            std::atomic<int64_t> busy_ns{0};
+            // threads still running; the last one to finish closes out
+            std::atomic<size_t> running{0};
+        };
+
+        std::vector<uint8_t> read_source(const std::string& path) {
+            std::ifstream file(path, std::ios::binary);
+            if (!file) {
+                throw std::runtime_error("Could not open " + path);
+            }
+            std::vector<uint8_t> bytes(fs::file_size(path));
+            file.read(reinterpret_cast<char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+            return bytes;
+        }
+    }
+
+    Augmentor::chain_type Augmentor::clone_chain(unsigned run_seed, size_t index) const {
+        chain_type chain;
+        for (size_t i = 0; i < operations.size(); ++i) {
+            chain.push_back(operations[i]->clone());
+            unsigned own = operations[i]->seed();
+            // mixes the base seed with the copy and the position, so no two copies or operations share a sequence
+            std::seed_seq sequence{own != NULL_SEED ? own : run_seed, static_cast<unsigned>(index),
+                                   static_cast<unsigned>(i)};
+            unsigned seed = NULL_SEED;
+            sequence.generate(&seed, &seed + 1);
+            chain.back()->reseed(seed != NULL_SEED ? seed : 1);
+        }
+        return chain;
+    }
+
+    void Augmentor::sample_staged(const decode_options& options) {
+        const auto& threads_of = *staging;
+        bool keeps_jpeg = sink->keeps_jpeg();
+        bool passthrough = passthrough_outputs != passthrough_mode::DISABLED && keeps_jpeg;
+        bool lossless = lossless_transforms && keeps_jpeg;
+
+        BoundedQueue<staged_ptr> to_decode(threads_of.queue_capacity);
+        BoundedQueue<staged_ptr> to_transform(threads_of.queue_capacity);
+        BoundedQueue<staged_ptr> to_encode(threads_of.queue_capacity);
+        stage stages[] = {
+                {"read", std::max<size_t>(1, threads_of.readers), nullptr, &to_decode},
+                {"decode", std::max<size_t>(1, threads_of.decoders), &to_decode, &to_transform},
+                {"transform", std::max<size_t>(1, threads_of.transformers), &to_transform, &to_encode},
+                {"encode", std::max<size_t>(1, threads_of.encoders), &to_encode, nullptr},
+        };
+        auto& readers = stages[0];
+        auto& decoders = stages[1];
+        auto& transformers = stages[2];
+        auto& encoders = stages[3];
+
+        std::atomic<size_t> next{0};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+        std::mutex error_mutex;
+
+        // one timed unit of work of a stage
+        auto timed = [](stage& st, auto&& work) {
+            auto start = clocking::now();
+            work();
+            st.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clocking::now() - start).count();
+            ++st.items;
+        };
+        // readers roll the operations, decoders ask them for lossless transforms, transformers perform them
+        auto run = [&](stage& st, chain_type chain, auto&& body) {
+            return std::thread([&, chain = std::move(chain), body]() mutable {
+                BufferPool::scoped_use use_pool(pool);
+                try {
+                    body(chain);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    failed = true;
+                    to_decode.close();
+                    to_transform.close();
+                    to_encode.close();
+                }
+                if (--st.running == 0 && st.out) {
+                    st.out->close();
+                }
+            });
+        };
+
+        auto read = [&](chain_type& chain) {
+            for (size_t j = next++; j < output_array.size() && !failed; j = next++) {
+                auto sample = std::make_unique<staged_sample>();
+                auto* out = readers.out;
+                timed(readers, [&]() {
+                    sample->record.index = j;
+                    sample->record.source = output_array[j];
+                    sample->fires.resize(chain.size());
+                    // every operation decides up front, so a sample nothing happens to is never read or decoded
+                    bool operates = false;
+                    for (size_t i = 0; i < chain.size(); ++i) {
+                        sample->fires[i] = chain[i]->roll();
+                        operates = sample->fires[i] || operates;
+                    }
+                    if (!operates && passthrough) {
+                        sample->what = staged_sample::content::PASSTHROUGH;
+                        out = &to_encode;
+                    } else if (!dataset_store || !dataset_store->find(sample->record.source)) {
+                        sample->bytes = read_source(sample->record.source);
+                    }
+                });
+                out->push(sample);
+            }
+        };
+        auto decode = [&](chain_type& chain) {
+            staged_ptr sample;
+            while (decoders.in->pop(sample) && !failed) {
+                auto* out = decoders.out;
+                timed(decoders, [&]() {
+                    bool operates = std::find(sample->fires.begin(), sample->fires.end(), true) != sample->fires.end();
+                    auto result = operates && lossless ?
+                            transform_losslessly(sample->record, chain, sample->fires, sample->bytes) :
+                            lossless_result::NONE;
+                    if (result != lossless_result::NONE) {
+                        sample->what = result == lossless_result::SOURCE ? staged_sample::content::PASSTHROUGH :
+                                       staged_sample::content::ENCODED;
+                        out = &to_encode;
+                        return;
+                    }
+                    sample->image = load(sample->record.source, options, sample->bytes.empty() ? nullptr : &sample->bytes);
+                    sample->bytes = std::vector<uint8_t>();
+                    sample->what = staged_sample::content::PIXELS;
+                });
+                out->push(sample);
+            }
+        };
+        auto transform = [&](chain_type& chain) {
+            staged_ptr sample;
+            while (transformers.in->pop(sample) && !failed) {
+                timed(transformers, [&]() {
+                    auto image = &*sample->image;
+                    // a reduced or cropped decode already differs from the source
+                    bool changed = options.scaled() || options.cropped();
+                    for (size_t i = 0; i < chain.size(); ++i) {
+                        chain[i]->follow(sample->fires[i]);
+                        image = chain[i]->perform(image);
+                        if (chain[i]->changed()) {
+                            changed = true;
+                            sample->record.operations.push_back(chain[i]->describe());
+                        }
+                    }
+                    if (!changed && passthrough) {
+                        sample->what = staged_sample::content::PASSTHROUGH;
+                        sample->image.reset();
+                    }
+                });
+                transformers.out->push(sample);
+            }
+        };
+        auto encode = [&](chain_type&) {
+            staged_ptr sample;
+            while (encoders.in->pop(sample) && !failed) {
+                timed(encoders, [&]() {
+                    switch (sample->what) {
+                        case staged_sample::content::PASSTHROUGH:
+                            write_source(sample->record);
+                            break;
+                        case staged_sample::content::ENCODED:
+                            write(sample->record, sample->bytes);
+                            break;
+                        default:
+                            if (keeps_jpeg) {
+                                write(sample->record, sample->image->encode(encoder_options));
+                            } else {
+                                std::lock_guard<std::mutex> lock(sink_mutex);
+                                sink->write_image(sample->record, *sample->image, encoder_options);
+                            }
+                    }
+                });
+            }
+        };
+
+        auto start = clocking::now();
+        std::vector<std::thread> threads;
+        for (auto& st : stages) {
+            st.running = st.threads;
+        }
+        // every thread with a chain gets its own copy, seeded like the workers of sample()
+        unsigned run_seed = std::random_device{}();
+        size_t copies = 0;
+        for (size_t i = 0; i < readers.threads; ++i) {
+            threads.push_back(run(readers, clone_chain(run_seed, copies++), read));
+        }
+        for (size_t i = 0; i < decoders.threads; ++i) {
+            threads.push_back(run(decoders, clone_chain(run_seed, copies++), decode));
+        }
+        for (size_t i = 0; i < transformers.threads; ++i) {
+            threads.push_back(run(transformers, clone_chain(run_seed, copies++), transform));
+        }
+        for (size_t i = 0; i < encoders.threads; ++i) {
+            threads.push_back(run(encoders, chain_type(), encode));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        double wall = std::chrono::duration<double>(clocking::now() - start).count();
+
+        stage_report_stats.clear();
+        for (auto& st : stages) {
+            stage_stats stats;
+            stats.name = st.name;
+            stats.threads = st.threads;
+            stats.items = st.items;
+            stats.busy_seconds = st.busy_ns * 1e-9;
+            stats.wall_seconds = wall;
+            if (st.in) {
+                stats.queue_capacity = st.in->capacity();
+                stats.mean_queue = st.in->mean_occupancy();
+                stats.peak_queue = st.in->peak_occupancy();
+            }
+            stage_report_stats.push_back(stats);
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        sink->flush();
+    }
+
+    Augmentor& Augmentor::stages(const stage_options& options) {
+        staging = options;
+        return *this;
+    }
+
+    const std::vector<stage_stats>& Augmentor::stage_report() const {
+        return stage_report_stats;
+    }
+
+    Image Augmentor::load(const std::string& path, const decode_options& options, const std::vector<uint8_t>* bytes) {
+        if (dataset_store) {
+            if (auto image = dataset_store->find(path)) {
+                return *image;
+            }
+        }
+        auto decode = [&path, &options, bytes]() {
+            return bytes ? Image(bytes->data(), bytes->size(), options) : Image(path, options);
+        };
+        if (!image_cache) {
+            return decode();
+        }
+        // a reduced or cropped decode is a different image than the full one
+        auto key = path;
+        if (options.scaled()) {
+            key += "@" + std::to_string(options.min_width) + "x" + std::to_string(options.min_height);
+        }
+        if (options.cropped()) {
+            key += "#" + std::to_string(options.crop_width) + "x" + std::to_string(options.crop_height);
+        }
+        return image_cache->get(key, decode);
+    }
+
+    Augmentor &Augmentor::cache(size_t byte_budget) {
+        if (byte_budget == 0) {
+            image_cache.reset();
+        } else {
+            image_cache = std::make_unique<ImageCache>(byte_budget);
+        }
+        return *this;
+    }
+
+    image_cache_stats Augmentor::cache_stats() const {
+        return image_cache ? image_cache->stats() : image_cache_stats{};
+    }
+
+    Augmentor &Augmentor::store(const std::string& path) {
+        dataset_store = DatasetStore::open(path, image_paths);
+        return *this;
+    }
+
+    Augmentor &Augmentor::buffer_pool(const buffer_pool_options& options) {
+        pool = BufferPool::create(options);
+        return *this;
+    }
+
+    buffer_pool_stats Augmentor::pool_stats() const {
+        return pool->stats();
     }
 
     Augmentor &Augmentor::blur(double sigma, size_t kernel_size, double prob) {
@@ -134,6 +651,11 @@ namespace augmentorLib {
         return *this;
     }
 
+    Augmentor& Augmentor::blur(double sigma, blur_backend backend, double prob) {
+        operations.push_back(std::make_unique<BlurOperation<Image>>(sigma, backend, prob));
+        return *this;
+    }
+
     Augmentor& Augmentor::rapid_blur(const double sigma, const unsigned int passes, double prob) {
         auto operation = std::make_unique<FastGaussianBlurOperation<Image>>(sigma, passes, prob);
         operations.push_back(std::move(operation));
@@ -141,6 +663,11 @@ namespace augmentorLib {
         return *this;
     }
 
+    Augmentor& Augmentor::rapid_blur(double sigma, box_blur_mode mode, unsigned int passes, double prob) {
+        operations.push_back(std::make_unique<FastGaussianBlurOperation<Image>>(sigma, passes, mode, prob));
+        return *this;
+    }
+
     Augmentor &Augmentor::random_erase(image_size lower_mask_size, image_size upper_mask_size, double prob) {
         auto operation = std::make_unique<RandomEraseOperation<Image>>(lower_mask_size, upper_mask_size, prob);
         operations.push_back(std::move(operation));
@@ -2,12 +2,21 @@
 #define LIB_AUGMENTOR_H
 
 #include "jpeg.h"
+#include "BufferPool.h"
+#include "ImageCache.h"
+#include "DatasetStore.h"
+#include "OutputSink.h"
+#include "Pipeline.h"
+#include "Scheduler.h"
 #include "Operation.h"
 #include <iostream>
 #include <string>
 #include <stdexcept>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
 
 using namespace jpegimageSTL::jpeg;
 
@@ -24,6 +33,72 @@ namespace augmentorLib {
         std::vector<std::string> output_array;
         // unique points for base classes
         std::vector<std::unique_ptr< Operation<Image> >> operations;
+        // decoded frames and operation scratch buffers of sample() are drawn from here
+        std::shared_ptr<BufferPool> pool = BufferPool::global();
+        // decoded sources, so repeated draws of the same file are not decoded again; disabled when null
+        std::unique_ptr<ImageCache> image_cache;
+        // pre-decoded sources from an earlier run; disabled when null
+        std::shared_ptr<DatasetStore> dataset_store;
+        // applied to every output of sample()
+        encode_options encoder_options;
+        // outputs no operation changed are copies of their source
+        passthrough_mode passthrough_outputs = passthrough_mode::COPY;
+        // samples whose firing operations are all flips and quarter turns skip decoding
+        bool lossless_transforms = true;
+        // receives every output of sample(); one file per sample in out_path unless replaced
+        std::unique_ptr<OutputSink> sink;
+        // serialises the workers' calls into the sink
+        std::mutex sink_mutex;
+        // threads of sample(); 0 uses one per hardware thread
+        size_t worker_count = 1;
+        // operations on images of at least this many pixels split into tasks across workers; 0 never
+        size_t tile_pixels = 0;
+
+        // threads per stage when sample() runs as a staged pipeline; workers() applies otherwise
+        std::optional<stage_options> staging;
+        // what each stage of the last staged sample() did
+        std::vector<stage_stats> stage_report_stats;
+
+        typedef std::vector<std::unique_ptr< Operation<Image> >> chain_type;
+
+        /// How a sample left the DCT-domain path
+        enum class lossless_result {
+            /// it needs the pixel path
+            NONE,
+            /// its transforms cancel out, the source bytes are the output
+            SOURCE,
+            /// transformed, the output stream is ready
+            ENCODED
+        };
+
+        /// Decodes the source at path, unless the store already holds it, through the cache when one is configured
+        /// \param bytes the file's contents when already read, otherwise it is read from path
+        Image load(const std::string& path, const decode_options& options, const std::vector<uint8_t>* bytes = nullptr);
+
+        /// Copies of the operations for one worker or stage thread, each reseeded for it: from the operation's own seed when it was
+        /// given one, so runs stay reproducible, otherwise from run_seed
+        /// \param run_seed seed of this sample() run, drawn from std::random_device
+        /// \param index which copy this is; copies with different indices draw different sequences
+        chain_type clone_chain(unsigned run_seed, size_t index) const;
+
+        /// Produces output j of sample() through chain, which only the calling worker uses
+        /// \param fires scratch space for the chain's decisions
+        void sample_one(size_t j, chain_type& chain, const decode_options& options, std::vector<bool>& fires);
+
+        /// Transforms the record's source in the DCT domain, when every operation of chain in fires is a flip or a
+        /// rotation by a multiple of 90° and the transform is exact for the source
+        /// \param bytes receives the output stream when ENCODED
+        lossless_result transform_losslessly(sample_record& record, const chain_type& chain,
+                                             const std::vector<bool>& fires, std::vector<uint8_t>& bytes);
+
+        /// sample() as a pipeline of reader, decoder, transformer and encoder threads connected by bounded queues
+        void sample_staged(const decode_options& options);
+
+        /// Hands encoded bytes to the sink; encoding happens before, outside the sink's lock
+        void write(const sample_record& record, const std::vector<uint8_t>& bytes);
+
+        /// Hands a passthrough sample to the sink
+        void write_source(const sample_record& record);
     public:
         /// Default Constructor.
         Augmentor() = default;
@@ -42,6 +117,108 @@ namespace augmentorLib {
         /// @returns A reference to the Augmentor object
         static void save(const std::string& fileName, Image* image, int quality = 95);
 
+        /// Save current version of image into a file specified, with the given encoder settings
+        /// @param fileName - Name of the augmented output file
+        /// @param image - an image of type Image
+        /// @param options - encoder settings
+        static void save(const std::string& fileName, Image* image, const encode_options& options);
+
+        /// Encoder
+        ///
+        /// Sets how every output of sample() is encoded: quality, DCT method, Huffman optimisation,
+        /// chroma subsampling and progressive mode. See encode_options::fast() and encode_options::compact().
+        /// \param options encoder settings
+        /// \return A reference to the Augmentor object
+        Augmentor& encoder(const encode_options& options);
+
+        /// Workers
+        ///
+        /// Sets how many threads sample() runs. Each decodes, transforms and encodes whole samples with its own
+        /// copy of the operations (see Operation::clone()), drawing from the buffer pool; only the sink calls
+        /// are serialised. Samples are scheduled by work stealing, so workers that finish early take over the
+        /// backlog of one busy with a large image. Outputs keep their indices but may reach the sink in any order.
+        /// \param count number of threads, 1 (the default) to sample serially, 0 for one per hardware thread
+        /// \return A reference to the Augmentor object
+        Augmentor& workers(size_t count);
+
+        /// Tiles
+        ///
+        /// With several workers(), splits the row or column loops of operations on large images (invert, flip,
+        /// gaussian, box and rapid blur, rotate, resize and zoom) into tasks the other workers take, so one large
+        /// image does not keep a single core busy while the others are idle, even when sample() has fewer outputs
+        /// than workers. Results are the same as without tiling.
+        /// \param min_pixels images of at least this many pixels are split; 0 (the default) never splits
+        /// \return A reference to the Augmentor object
+        Augmentor& tiles(size_t min_pixels);
+
+        /// Stages
+        ///
+        /// Runs sample() as a pipeline of four stages, each with its own threads: readers load source files,
+        /// decoders decode them (or transform them in the DCT domain), transformers run the operations, encoders
+        /// encode and write the outputs. Bounded lock-free queues connect the stages, so disk reads and writes overlap
+        /// with decoding and transforming, and at most queue_capacity samples wait between two stages. See
+        /// stage_report() to find the bottleneck. Replaces workers().
+        /// \param options threads per stage and queue size
+        /// \return A reference to the Augmentor object
+        Augmentor& stages(const stage_options& options);
+
+        /// Throughput, busy time and input queue occupancy of every stage of the last staged sample(), in order
+        [[nodiscard]] const std::vector<stage_stats>& stage_report() const;
+
+        /// Passthrough
+        ///
+        /// Sets how sample() writes a source none of the operations changed. Unless disabled, such a sample skips
+        /// decoding and encoding altogether and the output holds the original bytes, without generation loss.
+        /// \param mode COPY (the default), HARDLINK, or DISABLED to always re-encode
+        /// \return A reference to the Augmentor object
+        Augmentor& passthrough(passthrough_mode mode);
+
+        /// Lossless
+        ///
+        /// When every operation that fires for a sample is a flip or a fixed rotation by a multiple of 90°, the
+        /// source's DCT coefficients are rearranged directly, like jpegtran does, instead of decoding and re-encoding
+        /// it. Such outputs keep the source's quality and are unaffected by encoder(). The pixels match what the
+        /// decoding path gives, up to its re-encode: both turn about the centre of the pixel grid. On by default.
+        /// \param enabled whether to take the DCT-domain path when it applies
+        /// \return A reference to the Augmentor object
+        Augmentor& lossless(bool enabled);
+
+        /// Output
+        ///
+        /// Replaces where sample() writes its outputs, by default one `output_<j>.jpg` per sample in the output
+        /// directory (a DirectorySink)
+        /// \param output_sink the sink to write to
+        /// \return A reference to the Augmentor object
+        Augmentor& output(std::unique_ptr<OutputSink> output_sink);
+
+        /// Directory
+        ///
+        /// Keeps one file per sample in the output directory, spread over hex named subdirectories so no directory
+        /// grows to millions of entries, optionally written under a temporary name then renamed (atomic, off by
+        /// default since it costs a rename per file), and synced to disk in batches. See directory_options.
+        /// \param options subdirectory layout and durability
+        /// \return A reference to the Augmentor object
+        Augmentor& directory(const directory_options& options);
+
+        /// Shards
+        ///
+        /// Packs the outputs of sample() into shard files of at most a fixed size, each record holding the encoded
+        /// bytes with the source path and the operations applied, next to a seekable index. See ShardSink.
+        /// \param directory directory to write the shards to
+        /// \param options shard size and write buffering
+        /// \return A reference to the Augmentor object
+        Augmentor& shards(const std::string& directory, const shard_options& options = shard_options{});
+
+        /// Tensors
+        ///
+        /// Writes the outputs of sample() as batches of raw pixels instead of JPEG files, in NHWC or NCHW order, as
+        /// uint8 or as normalised float32, so a trainer maps them straight into tensors. Every sample must have the
+        /// shape given in options; passthrough() and lossless() do not apply. See TensorSink.
+        /// \param directory directory to write the batches to
+        /// \param options shape, layout, element type and normalisation
+        /// \return A reference to the Augmentor object
+        Augmentor& tensors(const std::string& directory, const tensor_options& options);
+
         /// Resize the image
         ///
         /// expand or shrink based on a size selected in random from the range specified
@@ -79,6 +256,14 @@ namespace augmentorLib {
         /// @returns A reference to the Augmentor object
         Augmentor& resize(size_t height, size_t width, double prob=1);
 
+        /// Resize the image with a chosen filter; AREA averages every covered pixel and suits large downscales
+        /// \param height new height of the augmented image
+        /// \param width new width of the augmented image
+        /// \param filter how the source pixels under each output pixel are weighed
+        /// \param prob probability of performing the resize operation
+        /// \return A reference to the Augmentor object
+        Augmentor& resize(size_t height, size_t width, resize_filter filter, double prob=1);
+
         /// Crop the image
         ///
         /// Crop based on current width and height
@@ -98,6 +283,14 @@ namespace augmentorLib {
         /// @returns A reference to the Augmentor object
         Augmentor& zoom(double min_factor=1.0, double max_factor=1.0, double prob=1);
 
+        /// Zoom the image, resizing with a chosen filter
+        /// \param min_factor minimum zoom factor of range
+        /// \param max_factor maximum zoom factor of range
+        /// \param filter how the source pixels under each output pixel are weighed
+        /// \param prob probability of performing the zoom operation
+        /// \return A reference to the Augmentor object
+        Augmentor& zoom(double min_factor, double max_factor, resize_filter filter, double prob=1);
+
         /// Rotate the image
         ///
         /// Rotate based on current width and height based on a angle selected in random from the range specified
@@ -107,6 +300,14 @@ namespace augmentorLib {
         /// @returns A reference to the Augmentor object
         Augmentor& rotate(int min_degree, int max_degree, double prob=1);
 
+        /// Rotate the image, sampling the source as mode says; BILINEAR blends the pixels around each position
+        /// \param min_degree minimum angle of the range
+        /// \param max_degree maximum angle of the range
+        /// \param mode nearest pixel or bilinear interpolation
+        /// \param prob probability of performing the rotate operation
+        /// \return A reference to the Augmentor object
+        Augmentor& rotate(int min_degree, int max_degree, interpolation mode, double prob=1);
+
         /// Invert the image
         /// Inverts the colors in the image
         /// \param prob probability of performing the resize operation
@@ -136,8 +337,30 @@ namespace augmentorLib {
         /// \return A reference to the Augmentor object
         Augmentor& blur(double sigma, size_t kernel_size, double prob=1);
 
+        /// Blur
+        ///
+        /// Blurs the image with a gaussian of standard deviation sigma, computed by a kernel, box blurs or recursive
+        /// filters. AUTO picks per image, by sigma and image size, whichever was measured to be fastest; the
+        /// recursive filters cost the same for any sigma.
+        /// \param sigma standard deviation in pixels
+        /// \param backend how the gaussian is computed
+        /// \param prob probability of performing the blur operation
+        /// \return A reference to the Augmentor object
+        Augmentor& blur(double sigma, blur_backend backend, double prob=1);
+
         Augmentor& rapid_blur(const double sigma, const unsigned int passes=3, double prob=1);
 
+        /// Rapid blur
+        ///
+        /// Approximates a gaussian by box blurs, each computed by running sums (SLIDING) or from a summed-area
+        /// table the passes share (INTEGRAL). Running sums were the faster of the two in the "box" benchmark section.
+        /// \param sigma standard deviation in pixels
+        /// \param mode how each box pass runs
+        /// \param passes number of box blurs
+        /// \param prob probability of performing the blur operation
+        /// \return A reference to the Augmentor object
+        Augmentor& rapid_blur(double sigma, box_blur_mode mode, unsigned int passes=3, double prob=1);
+
         /// Pipeline
         /// Creates an input image array to operate on
         /// \return A reference to the Augmentor object
@@ -170,6 +393,35 @@ namespace augmentorLib {
         /// \return A reference to the Augmentor object
         Augmentor& flip(const std::string& type, double prob=1);
 
+        /// Buffer pool
+        ///
+        /// Gives this augmentor its own pool of pixel buffers, shared by the decoder and every operation in sample()
+        /// \param options size limit and huge page backing of the pool
+        /// \return A reference to the Augmentor object
+        Augmentor& buffer_pool(const buffer_pool_options& options);
+
+        /// Reuse rate and memory held by the buffer pool sample() draws from
+        [[nodiscard]] buffer_pool_stats pool_stats() const;
+
+        /// Cache
+        ///
+        /// Keeps decoded sources in memory, so each file is decoded at most once while it stays in the cache
+        /// \param byte_budget most bytes of decoded pixels to keep; 0 disables the cache
+        /// \return A reference to the Augmentor object
+        Augmentor& cache(size_t byte_budget);
+
+        /// Hit and miss counters of the decoded image cache. All zero when no cache is configured.
+        [[nodiscard]] image_cache_stats cache_stats() const;
+
+        /// Store
+        ///
+        /// Reads sources from a memory mapped store of pre-decoded pixels at path instead of decoding them.
+        /// The store is built from the input directory when it does not exist yet, and rebuilt when a source's
+        /// mtime or size changed since.
+        /// \param path path of the store's blob; its index is written next to it
+        /// \return A reference to the Augmentor object
+        Augmentor& store(const std::string& path);
+
         /// Sample
         ///
         /// creates the specifed number of augmented images
@@ -0,0 +1,146 @@
+#include "BufferPool.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+namespace jpegimageSTL::jpeg {
+
+    namespace {
+        thread_local std::shared_ptr<BufferPool> thread_pool;
+    }
+
+    BufferPool::scoped_use::scoped_use(std::shared_ptr<BufferPool> pool): previous{std::move(thread_pool)} {
+        thread_pool = std::move(pool);
+    }
+
+    BufferPool::scoped_use::~scoped_use() {
+        thread_pool = std::move(previous);
+    }
+
+    BufferPool::BufferPool(const buffer_pool_options& options): m_options{options} {}
+
+    BufferPool::~BufferPool() {
+        trim();
+    }
+
+    std::shared_ptr<BufferPool> BufferPool::create(const buffer_pool_options& options) {
+        // the constructor is private, so make_shared cannot be used here
+        return std::shared_ptr<BufferPool>(new BufferPool(options));
+    }
+
+    std::shared_ptr<BufferPool> BufferPool::global() {
+        static std::shared_ptr<BufferPool> pool = create();
+        return pool;
+    }
+
+    std::shared_ptr<BufferPool> BufferPool::current() {
+        return thread_pool ? thread_pool : global();
+    }
+
+    size_t BufferPool::size_class(size_t bytes) const {
+        size_t size = 4096;
+        if (bytes > size) {
+            // four classes per power of two keeps the rounding waste under 25%
+            size_t msb = 63 - __builtin_clzll(bytes - 1);
+            size_t step = size_t{1} << (msb - 2);
+            size = (bytes + step - 1) & ~(step - 1);
+        }
+        if (is_mapped(size)) {
+            size = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+        }
+        return size;
+    }
+
+    bool BufferPool::is_mapped(size_t size) const {
+        return m_options.huge_pages && size >= huge_page_size;
+    }
+
+    uint8_t* BufferPool::allocate_block(size_t size) {
+        if (is_mapped(size)) {
+            void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p == MAP_FAILED) {
+                // no reserved huge pages, ask for transparent ones instead
+                p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED) {
+                    throw std::bad_alloc();
+                }
+                ::madvise(p, size, MADV_HUGEPAGE);
+            }
+            return static_cast<uint8_t*>(p);
+        }
+        void* p = std::aligned_alloc(alignment, size);
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<uint8_t*>(p);
+    }
+
+    void BufferPool::free_block(uint8_t* block, size_t size) {
+        if (is_mapped(size)) {
+            ::munmap(block, size);
+        } else {
+            std::free(block);
+        }
+    }
+
+    std::shared_ptr<uint8_t> BufferPool::acquire(size_t bytes) {
+        size_t size = size_class(bytes);
+        uint8_t* block = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_stats.requests;
+            auto it = m_free.find(size);
+            if (it != m_free.end() && !it->second.empty()) {
+                block = it->second.back();
+                it->second.pop_back();
+                ++m_stats.reuses;
+                m_stats.bytes_cached -= size;
+            }
+        }
+        if (block == nullptr) {
+            block = allocate_block(size);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.bytes_held += size;
+            m_stats.peak_bytes_held = std::max(m_stats.peak_bytes_held, m_stats.bytes_held);
+        }
+        // the deleter keeps the pool alive for as long as one of its buffers is
+        auto self = shared_from_this();
+        return std::shared_ptr<uint8_t>(block, [self, size](uint8_t* p) { self->release(p, size); });
+    }
+
+    void BufferPool::release(uint8_t* block, size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_stats.bytes_cached + size <= m_options.max_bytes_cached) {
+                m_free[size].push_back(block);
+                m_stats.bytes_cached += size;
+                return;
+            }
+            m_stats.bytes_held -= size;
+        }
+        free_block(block, size);
+    }
+
+    buffer_pool_stats BufferPool::stats() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+    void BufferPool::trim() {
+        std::unordered_map<size_t, std::vector<uint8_t*>> idle;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            idle.swap(m_free);
+            m_stats.bytes_held -= m_stats.bytes_cached;
+            m_stats.bytes_cached = 0;
+        }
+        for (auto& [size, blocks] : idle) {
+            for (auto block : blocks) {
+                free_block(block, size);
+            }
+        }
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef LIB_BUFFERPOOL_H
+#define LIB_BUFFERPOOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace jpegimageSTL::jpeg {
+
+    /// Options of a BufferPool
+    struct buffer_pool_options {
+        /// Most bytes the pool keeps idle for reuse. Buffers released beyond this go straight back to the OS,
+        /// 0 disables reuse altogether.
+        size_t max_bytes_cached = size_t{1} << 30;
+        /// Back buffers of huge_page_size or more with huge pages (MAP_HUGETLB when the system has reserved
+        /// pages, transparent huge pages otherwise)
+        bool huge_pages = false;
+    };
+
+    /// Counters of a BufferPool
+    struct buffer_pool_stats {
+        /// Number of acquire() calls
+        size_t requests = 0;
+        /// Number of acquire() calls served from an idle buffer
+        size_t reuses = 0;
+        /// Bytes currently allocated from the OS, handed out or idle
+        size_t bytes_held = 0;
+        /// Bytes currently idle in the pool
+        size_t bytes_cached = 0;
+        /// Largest value bytes_held has reached
+        size_t peak_bytes_held = 0;
+
+        [[nodiscard]] double reuse_rate() const {
+            return requests ? static_cast<double>(reuses) / requests : 0.0;
+        }
+    };
+
+    /// A size-bucketed pool of 64-byte aligned pixel buffers
+    ///
+    /// Requests are rounded up to a size class (four classes per power of two) and served from that class's free
+    /// list when possible. Buffers go back to their pool when the last shared_ptr to them is released, so frames
+    /// that are created and dropped for every sample stop hitting malloc/mmap once the pool is warm.
+    /// A pool is thread safe; each thread draws from BufferPool::current(), which a worker can point at its own pool
+    /// with BufferPool::scoped_use.
+    class BufferPool : public std::enable_shared_from_this<BufferPool> {
+    public:
+        static constexpr size_t alignment = 64;
+        static constexpr size_t huge_page_size = size_t{2} << 20;
+
+        /// Installs a pool as BufferPool::current() for the calling thread until it goes out of scope
+        class scoped_use {
+            std::shared_ptr<BufferPool> previous;
+        public:
+            explicit scoped_use(std::shared_ptr<BufferPool> pool);
+            ~scoped_use();
+            scoped_use(const scoped_use&) = delete;
+            scoped_use& operator=(const scoped_use&) = delete;
+        };
+
+        static std::shared_ptr<BufferPool> create(const buffer_pool_options& options = buffer_pool_options{});
+
+        /// The pool shared by every thread that has not installed its own
+        static std::shared_ptr<BufferPool> global();
+
+        /// The pool the calling thread allocates image buffers from
+        static std::shared_ptr<BufferPool> current();
+
+        ~BufferPool();
+
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        /// Acquire
+        ///
+        /// \param bytes minimum size of the buffer
+        /// \return An uninitialised buffer of at least bytes bytes that returns to this pool when released
+        std::shared_ptr<uint8_t> acquire(size_t bytes);
+
+        [[nodiscard]] buffer_pool_stats stats() const;
+
+        /// Returns every idle buffer to the OS
+        void trim();
+
+        [[nodiscard]] const buffer_pool_options& options() const { return m_options; }
+
+    private:
+        explicit BufferPool(const buffer_pool_options& options);
+
+        [[nodiscard]] size_t size_class(size_t bytes) const;
+        [[nodiscard]] bool is_mapped(size_t size) const;
+        uint8_t* allocate_block(size_t size);
+        void free_block(uint8_t* block, size_t size);
+        void release(uint8_t* block, size_t size);
+
+        buffer_pool_options m_options;
+        mutable std::mutex m_mutex;
+        std::unordered_map<size_t, std::vector<uint8_t*>> m_free;
+        buffer_pool_stats m_stats;
+    };
+}
+
+#endif //LIB_BUFFERPOOL_H
@@ -0,0 +1,483 @@
+#include "Convolution.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace augmentorLib {
+
+    namespace {
+        constexpr int32_t one = 1 << separable_kernel::fraction_bits;
+        constexpr int32_t half = one / 2;
+        // strips of the vertical pass keep about this many bytes of the rows under the kernel in cache
+        constexpr size_t strip_budget = 128 * 1024;
+
+        /// out[i] = sum over k of weights[k] * taps[k][i], rounded, for i in [0, n)
+        void accumulate(const uint8_t* const* taps, const int16_t* weights, const int32_t* pairs, size_t count,
+                        uint8_t* out, size_t n) {
+            size_t i = 0;
+#if defined(__SSE2__)
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i rounding = _mm_set1_epi32(half);
+            for (; i + 16 <= n; i += 16) {
+                __m128i acc0 = rounding, acc1 = rounding, acc2 = rounding, acc3 = rounding;
+                for (size_t k = 0; k < count; k += 2) {
+                    // an odd last tap pairs with zeros
+                    __m128i w = _mm_set1_epi32(pairs[k / 2]);
+                    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(taps[k] + i));
+                    __m128i b = k + 1 < count ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(taps[k + 1] + i))
+                                              : zero;
+                    __m128i a_lo = _mm_unpacklo_epi8(a, zero), a_hi = _mm_unpackhi_epi8(a, zero);
+                    __m128i b_lo = _mm_unpacklo_epi8(b, zero), b_hi = _mm_unpackhi_epi8(b, zero);
+                    acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a_lo, b_lo), w));
+                    acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a_lo, b_lo), w));
+                    acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(a_hi, b_hi), w));
+                    acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(a_hi, b_hi), w));
+                }
+                const int shift = separable_kernel::fraction_bits;
+                __m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc0, shift), _mm_srai_epi32(acc1, shift));
+                __m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc2, shift), _mm_srai_epi32(acc3, shift));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(lo, hi));
+            }
+#else
+            (void) pairs;
+#endif
+            for (; i < n; ++i) {
+                int32_t acc = half;
+                for (size_t k = 0; k < count; ++k) {
+                    acc += weights[k] * taps[k][i];
+                }
+                out[i] = static_cast<uint8_t>(acc >> separable_kernel::fraction_bits);
+            }
+        }
+
+        inline uint8_t to_sample(float value) {
+            return static_cast<uint8_t>(std::clamp(value + 0.5f, 0.0f, 255.0f));
+        }
+
+        struct recursion {
+            float gain;
+            float a1, a2, a3;
+        };
+
+        /// w[i] = gain * w[i] + a1 * w1[i] + a2 * w2[i] + a3 * w3[i] for independent lanes i < n, rounding in the
+        /// same order with and without SSE2
+        inline void recurse(const recursion& r, float* w, const float* w1, const float* w2, const float* w3, size_t n) {
+            size_t i = 0;
+#if defined(__SSE2__)
+            const __m128 gain = _mm_set1_ps(r.gain);
+            const __m128 a1 = _mm_set1_ps(r.a1), a2 = _mm_set1_ps(r.a2), a3 = _mm_set1_ps(r.a3);
+            for (; i + 4 <= n; i += 4) {
+                __m128 v = _mm_mul_ps(gain, _mm_loadu_ps(w + i));
+                v = _mm_add_ps(v, _mm_mul_ps(a1, _mm_loadu_ps(w1 + i)));
+                v = _mm_add_ps(v, _mm_mul_ps(a2, _mm_loadu_ps(w2 + i)));
+                v = _mm_add_ps(v, _mm_mul_ps(a3, _mm_loadu_ps(w3 + i)));
+                _mm_storeu_ps(w + i, v);
+            }
+#endif
+            for (; i < n; ++i) {
+                w[i] = r.gain * w[i] + r.a1 * w1[i] + r.a2 * w2[i] + r.a3 * w3[i];
+            }
+        }
+
+        /// Rounds and clamps n values to samples
+        void narrow(const float* in, uint8_t* out, size_t n) {
+            size_t i = 0;
+#if defined(__SSE2__)
+            const __m128 rounding = _mm_set1_ps(0.5f), low = _mm_setzero_ps(), high = _mm_set1_ps(255.0f);
+            auto convert = [&](const float* v) {
+                return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_loadu_ps(v), rounding), low), high));
+            };
+            for (; i + 16 <= n; i += 16) {
+                __m128i lo = _mm_packs_epi32(convert(in + i), convert(in + i + 4));
+                __m128i hi = _mm_packs_epi32(convert(in + i + 8), convert(in + i + 12));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(lo, hi));
+            }
+#endif
+            for (; i < n; ++i) {
+                out[i] = to_sample(in[i]);
+            }
+        }
+
+        /// out[i] = sums[i] / divisor, rounded; the divisor is odd, so there are no ties, and the sums below 2^31
+        void scale(const uint32_t* sums, uint8_t* out, size_t n, uint32_t divisor) {
+            size_t i = 0;
+#if defined(__SSE2__)
+            // a quotient is at least 1 / (2 * divisor) from a tie: single precision, off by less than 4e-5 here, is
+            // exact up to 4095, double precision for any divisor
+            const __m128 inverse = _mm_set1_ps(1.0f / static_cast<float>(divisor)), rounding = _mm_set1_ps(0.5f);
+            const __m128d inverse_wide = _mm_set1_pd(1.0 / divisor), rounding_wide = _mm_set1_pd(0.5);
+            auto quotient = [&](size_t j) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sums + j));
+                if (divisor <= 4095) {
+                    return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), inverse), rounding));
+                }
+                auto half_quotient = [&](__m128i pair) {
+                    return _mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(pair), inverse_wide), rounding_wide));
+                };
+                return _mm_unpacklo_epi64(half_quotient(v), half_quotient(_mm_srli_si128(v, 8)));
+            };
+            for (; i + 16 <= n; i += 16) {
+                __m128i lo = _mm_packs_epi32(quotient(i), quotient(i + 4));
+                __m128i hi = _mm_packs_epi32(quotient(i + 8), quotient(i + 12));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(lo, hi));
+            }
+#endif
+            for (; i < n; ++i) {
+                out[i] = static_cast<uint8_t>((2 * uint64_t{sums[i]} + divisor) / (2 * uint64_t{divisor}));
+            }
+        }
+
+        /// out[i] = a[i] - b[i], wrapping around
+        void subtract(const uint32_t* a, const uint32_t* b, uint32_t* out, size_t n) {
+            size_t i = 0;
+#if defined(__SSE2__)
+            for (; i + 4 <= n; i += 4) {
+                __m128i v = _mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+                                          _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v);
+            }
+#endif
+            for (; i < n; ++i) {
+                out[i] = a[i] - b[i];
+            }
+        }
+
+        /// sums[i] += addend[i], wrapping around
+        void add(uint32_t* sums, const uint32_t* addend, size_t n) {
+            size_t i = 0;
+#if defined(__SSE2__)
+            for (; i + 4 <= n; i += 4) {
+                auto* v = reinterpret_cast<__m128i*>(sums + i);
+                _mm_storeu_si128(v, _mm_add_epi32(_mm_loadu_si128(v),
+                                                  _mm_loadu_si128(reinterpret_cast<const __m128i*>(addend + i))));
+            }
+#endif
+            for (; i < n; ++i) {
+                sums[i] += addend[i];
+            }
+        }
+
+        /// sums[i] += entering[i] - leaving[i]
+        void slide(uint32_t* sums, const uint8_t* entering, const uint8_t* leaving, size_t n) {
+            size_t i = 0;
+#if defined(__SSE2__)
+            const __m128i zero = _mm_setzero_si128();
+            auto add = [sums](size_t j, __m128i difference) {
+                // sign extend the 16 bit differences to 32
+                __m128i sign = _mm_srai_epi16(difference, 15);
+                auto* lo = reinterpret_cast<__m128i*>(sums + j);
+                auto* hi = reinterpret_cast<__m128i*>(sums + j + 4);
+                _mm_storeu_si128(lo, _mm_add_epi32(_mm_loadu_si128(lo), _mm_unpacklo_epi16(difference, sign)));
+                _mm_storeu_si128(hi, _mm_add_epi32(_mm_loadu_si128(hi), _mm_unpackhi_epi16(difference, sign)));
+            };
+            for (; i + 16 <= n; i += 16) {
+                __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(entering + i));
+                __m128i out = _mm_loadu_si128(reinterpret_cast<const __m128i*>(leaving + i));
+                add(i, _mm_sub_epi16(_mm_unpacklo_epi8(in, zero), _mm_unpacklo_epi8(out, zero)));
+                add(i + 8, _mm_sub_epi16(_mm_unpackhi_epi8(in, zero), _mm_unpackhi_epi8(out, zero)));
+            }
+#endif
+            for (; i < n; ++i) {
+                sums[i] += entering[i];
+                sums[i] -= leaving[i];
+            }
+        }
+
+        /// Copies row into padded with margin samples of its edge pixels on either side
+        void pad(const uint8_t* row, size_t n, size_t pixel_size, size_t margin, uint8_t* padded) {
+            for (size_t x = 0; x < margin; x += pixel_size) {
+                std::memcpy(padded + x, row, pixel_size);
+                std::memcpy(padded + margin + n + x, row + n - pixel_size, pixel_size);
+            }
+            std::memcpy(padded + margin, row, n);
+        }
+
+        /// prefix[j + pixel_size] = prefix[j] + samples[j] for the n samples, after pixel_size zeros
+        void prefix_sums(const uint8_t* samples, size_t n, size_t pixel_size, uint32_t* prefix) {
+            std::fill(prefix, prefix + pixel_size, 0);
+            for (size_t j = 0; j < n; ++j) {
+                prefix[j + pixel_size] = prefix[j] + samples[j];
+            }
+        }
+    }
+
+    separable_kernel::separable_kernel(const std::vector<double>& values) {
+        if (values.size() % 2 == 0) {
+            throw std::invalid_argument("separable_kernel: the kernel size must be odd");
+        }
+        weights.resize(values.size());
+        for (size_t k = 0; k < values.size(); ++k) {
+            weights[k] = static_cast<int16_t>(std::lround(values[k] * one));
+        }
+        // rounding may leave the sum a little off one, the centre tap takes up the difference
+        auto sum = std::accumulate(weights.begin(), weights.end(), int32_t{0});
+        weights[weights.size() / 2] = static_cast<int16_t>(weights[weights.size() / 2] + one - sum);
+        if (std::any_of(weights.begin(), weights.end(), [](int16_t w) { return w < 0; })) {
+            throw std::invalid_argument("separable_kernel: weights must not be negative");
+        }
+
+        for (size_t k = 0; k < weights.size(); k += 2) {
+            auto high = k + 1 < weights.size() ? weights[k + 1] : 0;
+            pairs.push_back(static_cast<int32_t>(static_cast<uint32_t>(static_cast<uint16_t>(weights[k])) |
+                                                 (static_cast<uint32_t>(static_cast<uint16_t>(high)) << 16)));
+        }
+    }
+
+    void separable_kernel::convolve_rows(const sample_plane& source, const sample_plane& target, size_t pixel_size,
+                                         size_t first, size_t last) const {
+        if (source.width == 0) {
+            return;
+        }
+        size_t radius = weights.size() / 2;
+        size_t margin = radius * pixel_size;
+        std::vector<uint8_t> padded(source.width + 2 * margin);
+        std::vector<const uint8_t*> taps(weights.size());
+        for (size_t k = 0; k < taps.size(); ++k) {
+            taps[k] = padded.data() + k * pixel_size;
+        }
+
+        for (size_t y = first; y < last; ++y) {
+            pad(source.row(y), source.width, pixel_size, margin, padded.data());
+            accumulate(taps.data(), weights.data(), pairs.data(), taps.size(), target.row(y), source.width);
+        }
+    }
+
+    void separable_kernel::convolve_columns(const sample_plane& source, const sample_plane& target,
+                                            size_t first, size_t last) const {
+        if (source.height == 0) {
+            return;
+        }
+        long radius = static_cast<long>(weights.size() / 2);
+        long bottom = static_cast<long>(source.height) - 1;
+        size_t strip = std::max<size_t>(64, strip_budget / weights.size() / 64 * 64);
+        std::vector<const uint8_t*> taps(weights.size());
+
+        for (size_t left = 0; left < source.width; left += strip) {
+            size_t width = std::min(strip, source.width - left);
+            for (size_t y = first; y < last; ++y) {
+                for (size_t k = 0; k < taps.size(); ++k) {
+                    long row = std::clamp(static_cast<long>(y) - radius + static_cast<long>(k), 0l, bottom);
+                    taps[k] = source.row(row) + left;
+                }
+                accumulate(taps.data(), weights.data(), pairs.data(), taps.size(), target.row(y) + left, width);
+            }
+        }
+    }
+
+    recursive_gaussian::recursive_gaussian(double sigma) {
+        if (!(sigma >= 0.5)) {
+            throw std::invalid_argument("recursive_gaussian: sigma must be at least 0.5");
+        }
+        // I. T. Young, L. J. van Vliet, Recursive implementation of the Gaussian filter, Signal Processing 44 (1995)
+        double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * std::sqrt(1 - 0.26891 * sigma);
+        double q2 = q * q, q3 = q2 * q;
+        double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+        double b1 = 2.44413 * q + 2.85619 * q2 + 1.26661 * q3;
+        double b2 = -(1.4281 * q2 + 1.26661 * q3);
+        double b3 = 0.422205 * q3;
+        feedback[0] = static_cast<float>(b1 / b0);
+        feedback[1] = static_cast<float>(b2 / b0);
+        feedback[2] = static_cast<float>(b3 / b0);
+        // the gains add up to one, so a flat line stays flat
+        gain = 1.0f - feedback[0] - feedback[1] - feedback[2];
+    }
+
+    void recursive_gaussian::filter_rows(const sample_plane& source, const sample_plane& target, size_t pixel_size,
+                                         size_t first, size_t last) const {
+        size_t n = source.width;
+        if (n == 0 || first >= last) {
+            return;
+        }
+        const recursion r{gain, feedback[0], feedback[1], feedback[2]};
+        // four rows run side by side, sample i of row k at 4 * i + k, so every step of the recursion is one vector
+        // operation; three pixels of edge value on either side carry the steady state in and out
+        constexpr size_t lanes = 4;
+        size_t margin = 3 * pixel_size;
+        size_t step = lanes * pixel_size;
+        std::vector<float> line((n + 2 * margin) * lanes);
+        std::vector<uint8_t> samples(n * lanes);
+        float* w = line.data() + margin * lanes;
+
+        for (size_t y = first; y < last; y += lanes) {
+            // a short last group repeats its last row
+            const uint8_t* in[lanes];
+            for (size_t k = 0; k < lanes; ++k) {
+                in[k] = source.row(std::min(y + k, last - 1));
+            }
+            for (size_t i = 0; i < margin; ++i) {
+                for (size_t k = 0; k < lanes; ++k) {
+                    line[i * lanes + k] = in[k][i % pixel_size];
+                }
+            }
+            for (size_t i = 0; i < n; ++i) {
+                for (size_t k = 0; k < lanes; ++k) {
+                    w[i * lanes + k] = in[k][i];
+                }
+            }
+            for (size_t i = 0; i < n; ++i) {
+                float* v = w + i * lanes;
+                recurse(r, v, v - step, v - 2 * step, v - 3 * step, lanes);
+            }
+            std::copy(w + (n - pixel_size) * lanes, w + n * lanes, w + n * lanes);
+            std::copy(w + (n - pixel_size) * lanes, w + n * lanes, w + (n + pixel_size) * lanes);
+            std::copy(w + (n - pixel_size) * lanes, w + n * lanes, w + (n + 2 * pixel_size) * lanes);
+            for (size_t i = n; i-- > 0;) {
+                float* v = w + i * lanes;
+                recurse(r, v, v + step, v + 2 * step, v + 3 * step, lanes);
+            }
+            narrow(w, samples.data(), n * lanes);
+            for (size_t k = 0; k < lanes && y + k < last; ++k) {
+                uint8_t* out = target.row(y + k);
+                for (size_t i = 0; i < n; ++i) {
+                    out[i] = samples[i * lanes + k];
+                }
+            }
+        }
+    }
+
+    void recursive_gaussian::filter_columns(const sample_plane& source, const sample_plane& target,
+                                            size_t first, size_t last) const {
+        size_t h = source.height;
+        if (h == 0) {
+            return;
+        }
+        const recursion r{gain, feedback[0], feedback[1], feedback[2]};
+        // rows of the strip, with three rows of edge value above and below
+        std::vector<float> plane((h + 6) * strip_width);
+        auto line = [&plane](size_t y) { return plane.data() + (y + 3) * strip_width; };
+
+        for (size_t strip = first; strip < last; ++strip) {
+            size_t left = strip * strip_width;
+            size_t width = std::min(strip_width, source.width - left);
+            // the recursion runs down the rows, each step across all the strip's independent columns at once
+            for (size_t y = 0; y < h; ++y) {
+                const uint8_t* in = source.row(y) + left;
+                std::copy(in, in + width, line(y));
+                if (y == 0) {
+                    for (size_t e = 1; e <= 3; ++e) {
+                        std::copy(line(0), line(0) + width, line(0) - e * strip_width);
+                    }
+                }
+                recurse(r, line(y), line(y) - strip_width, line(y) - 2 * strip_width, line(y) - 3 * strip_width, width);
+            }
+            for (size_t y = h; y < h + 3; ++y) {
+                std::copy(line(h - 1), line(h - 1) + width, line(y));
+            }
+            for (size_t y = h; y-- > 0;) {
+                recurse(r, line(y), line(y) + strip_width, line(y) + 2 * strip_width, line(y) + 3 * strip_width, width);
+                narrow(line(y), target.row(y) + left, width);
+            }
+        }
+    }
+
+    box_filter::box_filter(size_t length): length{length} {
+        if (length % 2 == 0) {
+            throw std::invalid_argument("box_filter: the length must be odd");
+        }
+    }
+
+    void box_filter::filter_rows(const sample_plane& source, const sample_plane& target, size_t pixel_size,
+                                 size_t first, size_t last) const {
+        size_t n = source.width;
+        if (n == 0) {
+            return;
+        }
+        size_t margin = length / 2 * pixel_size;
+        std::vector<uint8_t> padded(n + 2 * margin);
+        std::vector<uint32_t> prefix(padded.size() + pixel_size);
+        std::vector<uint32_t> sums(n);
+        for (size_t y = first; y < last; ++y) {
+            pad(source.row(y), n, pixel_size, margin, padded.data());
+            prefix_sums(padded.data(), padded.size(), pixel_size, prefix.data());
+            subtract(prefix.data() + length * pixel_size, prefix.data(), sums.data(), n);
+            scale(sums.data(), target.row(y), n, length);
+        }
+    }
+
+    void box_filter::filter_columns(const sample_plane& source, const sample_plane& target,
+                                    size_t first, size_t last) const {
+        if (source.height == 0 || first >= last) {
+            return;
+        }
+        long radius = static_cast<long>(length / 2);
+        long bottom = static_cast<long>(source.height) - 1;
+        auto clamped = [&](long y) { return source.row(std::clamp(y, 0l, bottom)); };
+
+        std::vector<uint32_t> sums(source.width);
+        for (long k = -radius; k <= radius; ++k) {
+            const uint8_t* row = clamped(static_cast<long>(first) + k);
+            for (size_t i = 0; i < source.width; ++i) {
+                sums[i] += row[i];
+            }
+        }
+        for (size_t y = first; y < last; ++y) {
+            scale(sums.data(), target.row(y), source.width, length);
+            if (y + 1 < last) {
+                auto next = static_cast<long>(y) + 1;
+                slide(sums.data(), clamped(next + radius), clamped(next - radius - 1), source.width);
+            }
+        }
+    }
+
+    void integral_image::reset(const sample_plane& plane, size_t components, size_t padding) {
+        source = plane;
+        pixel_size = components;
+        margin = padding;
+        height = plane.height;
+        row_size = plane.width + (2 * margin + 1) * pixel_size;
+        size_t size = (rows() + 1) * row_size;
+        if (table.size() < size) {
+            table.resize(size);
+        }
+        std::fill(table.begin(), table.begin() + static_cast<std::ptrdiff_t>(row_size), 0);
+    }
+
+    void integral_image::sum_rows(size_t first, size_t last) {
+        if (source.width == 0) {
+            return;
+        }
+        std::vector<uint8_t> padded(row_size - pixel_size);
+        long bottom = static_cast<long>(height) - 1;
+        for (size_t y = first; y < last; ++y) {
+            long source_row = std::clamp(static_cast<long>(y) - static_cast<long>(margin), 0l, bottom);
+            pad(source.row(source_row), source.width, pixel_size, margin * pixel_size, padded.data());
+            prefix_sums(padded.data(), padded.size(), pixel_size, row(y + 1));
+        }
+    }
+
+    void integral_image::sum_columns(size_t first, size_t last) {
+        for (size_t strip = first; strip < last; ++strip) {
+            size_t left = strip * strip_width;
+            size_t width = std::min(strip_width, row_size - left);
+            for (size_t y = 1; y <= rows(); ++y) {
+                add(row(y) + left, row(y - 1) + left, width);
+            }
+        }
+    }
+
+    void integral_image::box(const sample_plane& target, size_t length, size_t first, size_t last) const {
+        if (length % 2 == 0 || length > 2 * margin + 1) {
+            throw std::invalid_argument("integral_image: the box must be odd and fit in the margin");
+        }
+        size_t radius = length / 2;
+        size_t n = source.width;
+        size_t left = (margin - radius) * pixel_size;
+        std::vector<uint32_t> columns(n + length * pixel_size);
+        std::vector<uint32_t> sums(n);
+        auto area = static_cast<uint32_t>(length * length);
+        for (size_t y = first; y < last; ++y) {
+            // the sums of each column over the box's rows, then of the box's columns along them
+            subtract(row(y + margin + radius + 1) + left, row(y + margin - radius) + left, columns.data(), columns.size());
+            subtract(columns.data() + length * pixel_size, columns.data(), sums.data(), n);
+            scale(sums.data(), target.row(y), n, area);
+        }
+    }
+}
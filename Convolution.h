@@ -0,0 +1,161 @@
+#ifndef LIB_CONVOLUTION_H
+#define LIB_CONVOLUTION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace augmentorLib {
+
+    /// Rows of 8 bit samples, e.g. the interleaved components of an image's pixels
+    struct sample_plane {
+        uint8_t* data;
+        /// Bytes between the starts of two consecutive rows
+        size_t stride;
+        /// Samples per row, i.e. pixels times components
+        size_t width;
+        size_t height;
+
+        [[nodiscard]] uint8_t* row(size_t y) const { return data + y * stride; }
+    };
+
+    /// A symmetric 1D kernel in fixed point, convolved separably over a sample_plane
+    ///
+    /// Weights are rounded to fraction_bits fractional bits and corrected to sum to exactly one, so an output is
+    /// the rounded weighted sum of its taps and never overflows 32 bits. Both passes walk the rows in memory order:
+    /// the horizontal one over a copy of each row padded with its edge pixels, the vertical one over strips of
+    /// columns narrow enough for the rows under the kernel to stay in cache from one output row to the next. With
+    /// SSE2, 16 samples go through two taps per multiply-add. Outputs are the same with and without SSE2 and however
+    /// the rows are split, and edges repeat the outermost pixel.
+    class separable_kernel {
+    public:
+        static constexpr int fraction_bits = 14;
+
+        /// \param weights an odd number of weights summing to one
+        explicit separable_kernel(const std::vector<double>& weights);
+
+        /// \param filter e.g. a gaussian_blur_filter_1D
+        template<typename Filter>
+        static separable_kernel of(const Filter& filter) {
+            std::vector<double> weights(filter.size());
+            for (size_t k = 0; k < weights.size(); ++k) {
+                weights[k] = filter[k];
+            }
+            return separable_kernel(weights);
+        }
+
+        [[nodiscard]] size_t size() const { return weights.size(); }
+
+        /// Convolves rows [first, last) of source along x into the same rows of target
+        /// \param pixel_size components per pixel; the kernel steps a pixel at a time
+        void convolve_rows(const sample_plane& source, const sample_plane& target, size_t pixel_size,
+                           size_t first, size_t last) const;
+
+        /// Convolves along y into rows [first, last) of target, reading rows of source up to the kernel's radius
+        /// beyond them. Source and target must not overlap.
+        void convolve_columns(const sample_plane& source, const sample_plane& target, size_t first, size_t last) const;
+
+    private:
+        std::vector<int16_t> weights;
+        // two consecutive weights in the low and high half, the operand of one multiply-add
+        std::vector<int32_t> pairs;
+    };
+
+    /// A gaussian as a pair of third order recursive filters, after Young and van Vliet
+    ///
+    /// Each pass runs a causal filter forwards and an anti-causal one backwards over a line, in single precision,
+    /// three feedback taps each whatever sigma is, so the cost per pixel stays the same for any blur radius. Lines
+    /// start and end in the steady state of their edge pixel. The horizontal pass works a row at a time, the
+    /// vertical one on strips of strip_width samples, running down and back up all rows of the strip at once.
+    class recursive_gaussian {
+    public:
+        /// Samples per strip of the vertical pass; strips are independent of each other
+        static constexpr size_t strip_width = 256;
+
+        /// \param sigma standard deviation in pixels, at least 0.5
+        explicit recursive_gaussian(double sigma);
+
+        /// Filters rows [first, last) of source along x into the same rows of target
+        /// \param pixel_size components per pixel
+        void filter_rows(const sample_plane& source, const sample_plane& target, size_t pixel_size,
+                         size_t first, size_t last) const;
+
+        /// Filters strips [first, last) of strip_width samples along y from source into target, over all rows
+        void filter_columns(const sample_plane& source, const sample_plane& target, size_t first, size_t last) const;
+
+        /// Number of strips filter_columns() splits a plane into
+        [[nodiscard]] static size_t strips(const sample_plane& plane) {
+            return (plane.width + strip_width - 1) / strip_width;
+        }
+
+    private:
+        // input gain and feedback of the previous three outputs, normalised by b0
+        float gain;
+        float feedback[3];
+    };
+
+    /// A box filter of odd length by running sums, with edge pixels repeated
+    ///
+    /// Along x, each row is summed up once and every output is the difference of two of its prefix sums; along y,
+    /// a sum per column moves down the rows, adding the row entering the window and subtracting the one leaving
+    /// it, all columns at once with SSE2. Outputs are the window mean rounded to the nearest integer, exactly.
+    class box_filter {
+    public:
+        explicit box_filter(size_t length);
+
+        /// Filters rows [first, last) of source along x into the same rows of target
+        /// \param pixel_size components per pixel
+        void filter_rows(const sample_plane& source, const sample_plane& target, size_t pixel_size,
+                         size_t first, size_t last) const;
+
+        /// Filters along y into rows [first, last) of target. Source and target must not overlap.
+        void filter_columns(const sample_plane& source, const sample_plane& target, size_t first, size_t last) const;
+
+    private:
+        size_t length;
+    };
+
+    /// A summed-area table of a sample_plane padded with its edge pixels, for square boxes of any odd length up to
+    /// twice the padding plus one
+    ///
+    /// A box then costs one pass over the image, reading two rows of the table per output row, whatever its size,
+    /// and the table's memory serves every box pass over the same size of image, e.g. the passes of a rapid blur.
+    /// Sums wrap around in 32 bits, which keeps the difference of any box below 2^32 exact.
+    class integral_image {
+    public:
+        /// Sizes the table for source padded by margin pixels on every side; keeps the memory if it is large enough
+        /// \param pixel_size components per pixel
+        void reset(const sample_plane& source, size_t pixel_size, size_t margin);
+
+        /// First step of building the table: prefix sums of padded rows [first, last), of rows() in all
+        void sum_rows(size_t first, size_t last);
+
+        /// Second step: adds up the rows within strips [first, last) of columns, of strips() in all
+        void sum_columns(size_t first, size_t last);
+
+        /// Writes the mean of the length x length box around every pixel of rows [first, last) into target
+        /// \param length odd, at most 2 * margin + 1
+        void box(const sample_plane& target, size_t length, size_t first, size_t last) const;
+
+        [[nodiscard]] size_t rows() const { return height + 2 * margin; }
+
+        [[nodiscard]] size_t strips() const { return (row_size + strip_width - 1) / strip_width; }
+
+    private:
+        static constexpr size_t strip_width = 1024;
+
+        [[nodiscard]] uint32_t* row(size_t y) { return table.data() + y * row_size; }
+        [[nodiscard]] const uint32_t* row(size_t y) const { return table.data() + y * row_size; }
+
+        sample_plane source{};
+        size_t pixel_size = 0;
+        size_t margin = 0;
+        size_t height = 0;
+        // entries per row of the table: the padded row's samples after a leading pixel of zeros
+        size_t row_size = 0;
+        // a row of zeros, then the running sums of the padded rows
+        std::vector<uint32_t> table;
+    };
+}
+
+#endif //LIB_CONVOLUTION_H
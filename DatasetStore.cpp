@@ -0,0 +1,166 @@
+#include "DatasetStore.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace augmentorLib {
+
+    namespace {
+        const char* const STORE_MAGIC = "augmentor-store";
+        const int STORE_VERSION = 2;
+        // entries start on page boundaries, which keeps every mapped row 64-byte aligned
+        const uint64_t STORE_ALIGNMENT = 4096;
+
+        std::string index_path(const std::string& path) {
+            return path + ".index";
+        }
+
+        int64_t modification_time(const std::string& source) {
+            return fs::last_write_time(source).time_since_epoch().count();
+        }
+    }
+
+    void DatasetStore::build(const std::string& path, const std::vector<std::string>& sources) {
+        auto blob_tmp = path + ".tmp";
+        auto index_tmp = index_path(path) + ".tmp";
+        std::ofstream blob(blob_tmp, std::ios::binary | std::ios::trunc);
+        std::ofstream index_file(index_tmp, std::ios::trunc);
+        if (!blob || !index_file) {
+            throw std::runtime_error("Could not open " + path + " for writing");
+        }
+
+        // entries are buffered so the header can carry the final blob size
+        std::ostringstream entries;
+        const std::vector<char> padding(STORE_ALIGNMENT, 0);
+        uint64_t offset = 0;
+        for (const auto& source : sources) {
+            // stat before decoding, so a file rewritten meanwhile is caught by the next open
+            auto mtime = modification_time(source);
+            auto file_size = fs::file_size(source);
+            const Image image(source);
+
+            auto aligned = (offset + STORE_ALIGNMENT - 1) / STORE_ALIGNMENT * STORE_ALIGNMENT;
+            blob.write(padding.data(), static_cast<std::streamsize>(aligned - offset));
+            blob.write(reinterpret_cast<const char*>(image.getData()), static_cast<std::streamsize>(image.getByteSize()));
+            offset = aligned + image.getByteSize();
+
+            entries << aligned << " " << image.getWidth() << " " << image.getHeight() << " "
+                       << image.getPixelSize() << " " << image.getColorSpace() << " " << image.getStride() << " "
+                       << mtime << " " << file_size << " " << source << "\n";
+        }
+        blob.close();
+        index_file << STORE_MAGIC << " " << STORE_VERSION << " " << offset << "\n" << entries.str();
+        index_file.close();
+        if (!blob || !index_file) {
+            throw std::runtime_error("Could not write " + path);
+        }
+        // the old index goes before the new blob and the new index after it, so a crash in
+        // between never pairs an index with a blob it does not describe; the blob size in
+        // the header catches any pairing that slips through anyway
+        fs::remove(index_path(path));
+        fs::rename(blob_tmp, path);
+        fs::rename(index_tmp, index_path(path));
+    }
+
+    DatasetStore::DatasetStore(const std::string& path) {
+        std::ifstream index_file(index_path(path));
+        std::string magic;
+        int version = 0;
+        uint64_t blob_size = 0;
+        if (!(index_file >> magic >> version >> blob_size) || magic != STORE_MAGIC || version != STORE_VERSION) {
+            throw std::runtime_error(path + " is not a dataset store");
+        }
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path);
+        }
+        struct stat st{};
+        ::fstat(fd, &st);
+        mapping_size = static_cast<size_t>(st.st_size);
+        if (mapping_size != blob_size) {
+            ::close(fd);
+            throw std::runtime_error(path + " does not match its index");
+        }
+        if (mapping_size > 0) {
+            // private and writable, so even a stray write can never reach the file
+            void* p = ::mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Could not map " + path);
+            }
+            auto size = mapping_size;
+            mapping = std::shared_ptr<uint8_t>(static_cast<uint8_t*>(p), [size](uint8_t* m) { ::munmap(m, size); });
+        }
+        ::close(fd);
+
+        entry e{};
+        std::string source;
+        while (index_file >> e.offset >> e.width >> e.height >> e.pixel_size >> e.colour_space >> e.stride
+                          >> e.mtime >> e.file_size) {
+            index_file.get();
+            std::getline(index_file, source);
+            if (e.offset % STORE_ALIGNMENT != 0 || e.offset + e.stride * e.height > mapping_size) {
+                throw std::runtime_error(path + " is corrupt at " + source);
+            }
+            // sources changed since the store was built are left out
+            if (is_current(source, e)) {
+                index[source] = e;
+            }
+        }
+    }
+
+    bool DatasetStore::is_current(const std::string& source, const entry& e) const {
+        std::error_code ec;
+        auto file_size = fs::file_size(source, ec);
+        if (ec || file_size != e.file_size) {
+            return false;
+        }
+        auto mtime = fs::last_write_time(source, ec);
+        return !ec && mtime.time_since_epoch().count() == e.mtime;
+    }
+
+    std::shared_ptr<DatasetStore> DatasetStore::open(const std::string& path, const std::vector<std::string>& sources) {
+        if (fs::exists(path) && fs::exists(index_path(path))) {
+            try {
+                auto store = std::make_shared<DatasetStore>(path);
+                if (store->covers(sources)) {
+                    return store;
+                }
+            } catch (const std::runtime_error&) {
+                // unreadable, rebuild below
+            }
+        }
+        build(path, sources);
+        return std::make_shared<DatasetStore>(path);
+    }
+
+    std::optional<Image> DatasetStore::find(const std::string& source) const {
+        auto it = index.find(source);
+        if (it == index.end()) {
+            return std::nullopt;
+        }
+        const auto& e = it->second;
+        // aliasing constructor: the image shares ownership of the whole mapping
+        std::shared_ptr<uint8_t> pixels(mapping, mapping.get() + e.offset);
+        return Image(pixels, e.width, e.height, e.pixel_size, e.colour_space, e.stride);
+    }
+
+    bool DatasetStore::covers(const std::vector<std::string>& sources) const {
+        for (const auto& source : sources) {
+            if (index.find(source) == index.end()) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
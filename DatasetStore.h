@@ -0,0 +1,79 @@
+#ifndef LIB_DATASETSTORE_H
+#define LIB_DATASETSTORE_H
+
+#include "jpeg.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace augmentorLib {
+
+    using jpegimageSTL::jpeg::Image;
+
+    /// A persistent store of pre-decoded images
+    ///
+    /// The store is two files: a blob of raw pixel rows at `path`, and a text index at `path + ".index"` recording
+    /// for every source its offset in the blob, dimensions, colour space, and the mtime and size of the source file
+    /// when it was decoded. The blob is memory mapped, and images are handed out as views of the mapping, so a
+    /// store built once lets later runs skip decoding entirely. Entries whose source file changed are ignored, and
+    /// an index whose recorded blob size does not match the blob is rejected as a whole.
+    class DatasetStore {
+    public:
+        /// Index entry of one source
+        struct entry {
+            uint64_t offset;
+            size_t width;
+            size_t height;
+            size_t pixel_size;
+            int colour_space;
+            size_t stride;
+            int64_t mtime;
+            uintmax_t file_size;
+        };
+
+        DatasetStore() = delete;
+
+        /// Maps the store at path. Will throw if it cannot be opened or is malformed.
+        explicit DatasetStore(const std::string& path);
+
+        DatasetStore(const DatasetStore&) = delete;
+        DatasetStore& operator=(const DatasetStore&) = delete;
+
+        /// Build
+        ///
+        /// Decodes every source and writes the blob and index at path, replacing any previous store.
+        /// \param path path of the blob; the index goes next to it
+        /// \param sources JPEG files to decode
+        static void build(const std::string& path, const std::vector<std::string>& sources);
+
+        /// Open or build
+        ///
+        /// Maps the store at path, rebuilding it first when it is missing, unreadable, does not cover every source,
+        /// or any source's mtime or size changed since it was built.
+        static std::shared_ptr<DatasetStore> open(const std::string& path, const std::vector<std::string>& sources);
+
+        /// Find
+        ///
+        /// \param source path of the source file, as given to build()
+        /// \return A view of the stored pixels, or nothing if the source is not stored or changed on disk
+        [[nodiscard]] std::optional<Image> find(const std::string& source) const;
+
+        /// Whether the store has an up to date entry for every one of sources
+        [[nodiscard]] bool covers(const std::vector<std::string>& sources) const;
+
+        [[nodiscard]] size_t size() const { return index.size(); }
+
+    private:
+        [[nodiscard]] bool is_current(const std::string& source, const entry& e) const;
+
+        std::shared_ptr<uint8_t> mapping;
+        size_t mapping_size = 0;
+        std::unordered_map<std::string, entry> index;
+    };
+}
+
+#endif //LIB_DATASETSTORE_H
@@ -0,0 +1,686 @@
+#include "Geometry.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// AVX2 code is compiled through target attributes and picked at run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AUGMENTOR_AVX2
+#include <immintrin.h>
+#endif
+
+namespace augmentorLib {
+
+    namespace {
+        constexpr int fraction_bits = 16;
+        constexpr int64_t unit = int64_t{1} << fraction_bits;
+        constexpr int64_t half_unit = unit / 2;
+        // output rows and columns per tile
+        constexpr size_t tile_size = 64;
+
+        int64_t floor_div(int64_t a, int64_t b) {
+            return a >= 0 ? a / b : -((-a + b - 1) / b);
+        }
+
+        /// The columns x in [0, n) for which lo <= start + x * step <= hi, as [begin, end)
+        std::pair<size_t, size_t> solve(int64_t start, int64_t step, int64_t lo, int64_t hi, size_t n) {
+            if (step == 0) {
+                return lo <= start && start <= hi ? std::make_pair(size_t{0}, n) : std::make_pair(size_t{0}, size_t{0});
+            }
+            if (step < 0) {
+                // the same inequality, negated
+                start = -start;
+                step = -step;
+                std::swap(lo, hi);
+                lo = -lo;
+                hi = -hi;
+            }
+            int64_t first = std::max<int64_t>(0, -floor_div(start - lo, step));
+            int64_t last = std::min<int64_t>(static_cast<int64_t>(n) - 1, floor_div(hi - start, step));
+            if (first > last) {
+                return {0, 0};
+            }
+            return {static_cast<size_t>(first), static_cast<size_t>(last) + 1};
+        }
+
+        /// Copies count pixels of N components along a line of source positions, rounding each to a pixel
+        template<size_t N>
+        void nearest(const sample_plane& source, size_t pixel_size, uint8_t* out, int64_t x, int64_t y,
+                     int64_t step_x, int64_t step_y, size_t count) {
+            size_t size = N ? N : pixel_size;
+            for (size_t i = 0; i < count; ++i, x += step_x, y += step_y, out += size) {
+                auto column = static_cast<size_t>((x + half_unit) >> fraction_bits);
+                auto row = static_cast<size_t>((y + half_unit) >> fraction_bits);
+                std::memcpy(out, source.row(row) + column * size, size);
+            }
+        }
+
+        // bilinear weights have 7 bits, so that both blends multiply-add in 16 bit lanes
+        constexpr int weight_bits = 7;
+        constexpr uint32_t weight_one = 1u << weight_bits;
+
+        /// Where and how much of the four pixels around a source position a bilinear sample takes
+        struct neighbourhood {
+            const uint8_t* top;
+            const uint8_t* bottom;
+            // 0 on the last column, whose right neighbour has no weight
+            size_t right;
+            // whether the 8 bytes from the left pixels lie within their rows, i.e. the pixel isn't one of the last
+            bool wide;
+            uint32_t fx;
+            uint32_t fy;
+        };
+
+        inline neighbourhood around(const sample_plane& source, size_t size, int64_t x, int64_t y) {
+            // positions round to the nearest 1/128 of a pixel
+            constexpr int shift = fraction_bits - weight_bits;
+            constexpr int64_t rounding = int64_t{1} << (shift - 1);
+            int64_t u = x + rounding, v = y + rounding;
+            auto column = static_cast<size_t>(u >> fraction_bits);
+            auto row = static_cast<size_t>(v >> fraction_bits);
+            const uint8_t* top = source.row(row) + column * size;
+            // likewise the last row
+            const uint8_t* bottom = row + 1 < source.height ? top + source.stride : top;
+            return {top, bottom, (column + 1) * size < source.width ? size : 0, column * size + 8 <= source.width,
+                    static_cast<uint32_t>((u >> shift) & (weight_one - 1)),
+                    static_cast<uint32_t>((v >> shift) & (weight_one - 1))};
+        }
+
+        /// The weighted sum of the four pixels, rounded: along x, then along y
+        inline void blend(const neighbourhood& n, size_t size, uint8_t* out) {
+            for (size_t c = 0; c < size; ++c) {
+                uint32_t upper = n.top[c] * (weight_one - n.fx) + n.top[c + n.right] * n.fx;
+                uint32_t lower = n.bottom[c] * (weight_one - n.fx) + n.bottom[c + n.right] * n.fx;
+                out[c] = static_cast<uint8_t>((upper * (weight_one - n.fy) + lower * n.fy +
+                                               (1u << (2 * weight_bits - 1))) >> (2 * weight_bits));
+            }
+        }
+
+#if defined(__SSE2__)
+        /// blend() of a pixel of N <= 4 components, a component per 32 bit lane: each component's pair of
+        /// neighbours and pair of weights in a lane, so a blend is one multiply-add. Reads 8 bytes from the top
+        /// and bottom left pixels, which must lie within their rows.
+        template<size_t N>
+        inline void blend_pixel(const neighbourhood& n, uint8_t* out) {
+            const __m128i zero = _mm_setzero_si128();
+            auto pairs = [&](const uint8_t* p) {
+                __m128i both = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+                return _mm_unpacklo_epi8(_mm_unpacklo_epi8(both, _mm_srli_si128(both, N)), zero);
+            };
+            __m128i wx = _mm_set1_epi32(static_cast<int32_t>((weight_one - n.fx) | n.fx << 16));
+            __m128i wy = _mm_set1_epi32(static_cast<int32_t>((weight_one - n.fy) | n.fy << 16));
+            // upper and lower sums are below 2^15, so they pack back into 16 bit pairs
+            __m128i sums = _mm_packs_epi32(_mm_madd_epi16(pairs(n.top), wx), _mm_madd_epi16(pairs(n.bottom), wx));
+            __m128i blended = _mm_madd_epi16(_mm_unpacklo_epi16(sums, _mm_srli_si128(sums, 8)), wy);
+            blended = _mm_srli_epi32(_mm_add_epi32(blended, _mm_set1_epi32(1 << (2 * weight_bits - 1))),
+                                     2 * weight_bits);
+            __m128i packed = _mm_packs_epi32(blended, blended);
+            auto pixel = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(packed, packed)));
+            if constexpr (N == 4) {
+                std::memcpy(out, &pixel, 4);
+            } else {
+                out[0] = static_cast<uint8_t>(pixel);
+                out[1] = static_cast<uint8_t>(pixel >> 8);
+                out[2] = static_cast<uint8_t>(pixel >> 16);
+            }
+        }
+#endif
+
+        /// Blends the four pixels around each of count source positions, with 7 bit weights
+        template<size_t N>
+        void bilinear(const sample_plane& source, size_t pixel_size, uint8_t* out, int64_t x, int64_t y,
+                      int64_t step_x, int64_t step_y, size_t count) {
+            size_t size = N ? N : pixel_size;
+            size_t i = 0;
+#if defined(__SSE2__)
+            if constexpr (N >= 3) {
+                for (; i < count; ++i, x += step_x, y += step_y, out += N) {
+                    auto n = around(source, N, x, y);
+                    if (n.wide) {
+                        blend_pixel<N>(n, out);
+                    } else {
+                        blend(n, N, out);
+                    }
+                }
+            }
+#endif
+            for (; i < count; ++i, x += step_x, y += step_y, out += size) {
+                blend(around(source, size, x, y), size, out);
+            }
+        }
+
+#if defined(AUGMENTOR_AVX2)
+        // built for AVX2 whatever the compiler flags, and only called once cpu_has_avx2() says the CPU has it
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+        bool cpu_has_avx2() {
+            static const bool supported = __builtin_cpu_supports("avx2");
+            return supported;
+        }
+
+        /// Writes 8 pixels of N = 3 or 4 components, each in the low bytes of a 32 bit lane
+        template<size_t N>
+        AVX2_TARGET inline void store_pixels(__m256i pixels, uint8_t* out) {
+            if constexpr (N == 4) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), pixels);
+            } else {
+                // drops the fourth byte of every lane, leaving 12 bytes at the bottom of each half
+                const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                                      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+                __m256i packed = _mm256_shuffle_epi8(pixels, pack);
+                __m128i high = _mm256_extracti128_si256(packed, 1);
+                // exactly 24 bytes: the upper half overwrites the 4 spare bytes of the lower one
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(packed));
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 12), high);
+                auto last = static_cast<uint32_t>(_mm_extract_epi32(high, 2));
+                std::memcpy(out + 20, &last, 4);
+            }
+        }
+
+        /// Byte offsets in source of the pixels at columns and rows
+        template<size_t N>
+        AVX2_TARGET inline __m256i offsets(__m256i columns, __m256i rows, __m256i stride) {
+            __m256i across = N == 4 ? _mm256_slli_epi32(columns, 2)
+                                    : _mm256_add_epi32(columns, _mm256_slli_epi32(columns, 1));
+            return _mm256_add_epi32(_mm256_mullo_epi32(rows, stride), across);
+        }
+
+        /// nearest() for N = 3 or 4, 8 pixels at a time: each pixel is one 32 bit lane of a gather. A gather reads
+        /// a byte past a 3 byte pixel, so near the end of the buffer, where that would run past it, nearest() takes
+        /// over.
+        template<size_t N>
+        AVX2_TARGET void nearest_gather(const sample_plane& source, size_t pixel_size, uint8_t* out, int64_t x,
+                                        int64_t y, int64_t step_x, int64_t step_y, size_t count) {
+            const auto* base = reinterpret_cast<const int*>(source.data);
+            const __m256i ramp = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            const __m256i dx = _mm256_mullo_epi32(ramp, _mm256_set1_epi32(static_cast<int32_t>(step_x)));
+            const __m256i dy = _mm256_mullo_epi32(ramp, _mm256_set1_epi32(static_cast<int32_t>(step_y)));
+            const __m256i stride = _mm256_set1_epi32(static_cast<int32_t>(source.stride));
+            const __m256i last = _mm256_set1_epi32(static_cast<int32_t>(source.stride * source.height - 4));
+            size_t i = 0;
+            for (; i + 8 <= count; i += 8, x += 8 * step_x, y += 8 * step_y, out += 8 * N) {
+                __m256i u = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int32_t>(x + half_unit)), dx);
+                __m256i v = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int32_t>(y + half_unit)), dy);
+                __m256i at = offsets<N>(_mm256_srai_epi32(u, fraction_bits), _mm256_srai_epi32(v, fraction_bits),
+                                        stride);
+                if (N == 3 && _mm256_movemask_epi8(_mm256_cmpgt_epi32(at, last))) {
+                    break;
+                }
+                store_pixels<N>(_mm256_i32gather_epi32(base, at, 1), out);
+            }
+            nearest<N>(source, pixel_size, out, x, y, step_x, step_y, count - i);
+        }
+
+        /// The horizontal blends of the 4 pixels whose neighbourhoods start at the offsets at, negated: a 64 bit
+        /// gather lane fetches a pixel with its right neighbour, pairs turns them into (left, right) byte pairs per
+        /// component, and one multiply-add with the signed weights of weights_across() blends them all, a
+        /// component per 16 bit lane.
+        AVX2_TARGET inline __m256i blend_across(const long long* base, __m128i at, __m256i pairs, __m256i weights) {
+            return _mm256_maddubs_epi16(_mm256_shuffle_epi8(_mm256_i32gather_epi64(base, at, 1), pairs), weights);
+        }
+
+        /// (f - weight_one, -f) as signed byte pairs, twice per 32 bit lane, for the positions in the lanes of p.
+        /// Negated, a weight of weight_one fits in a signed byte.
+        AVX2_TARGET inline __m256i weights_across(__m256i p) {
+            __m256i f = _mm256_and_si256(_mm256_srai_epi32(p, fraction_bits - weight_bits),
+                                         _mm256_set1_epi32(weight_one - 1));
+            f = _mm256_or_si256(f, _mm256_slli_epi32(f, 16));
+            // 0x80 + f in the low byte, -f in the high one
+            return _mm256_sub_epi16(_mm256_set1_epi16(weight_one), _mm256_sub_epi16(_mm256_slli_epi16(f, 8), f));
+        }
+
+        /// f << 9 in both 16 bit halves of each lane, for the positions in the lanes of p
+        AVX2_TARGET inline __m256i weights_down(__m256i p) {
+            __m256i f = _mm256_and_si256(p, _mm256_set1_epi32((weight_one - 1) << (fraction_bits - weight_bits)));
+            return _mm256_or_si256(f, _mm256_slli_epi32(f, 16));
+        }
+
+        /// The vertical blends of the negated upper and lower sums, rounded to 8 bits as blend() does, in 16 bit
+        /// lanes. With d = lower - upper, blend() takes (upper * weight_one + d * f + 2^13) >> 14, which is
+        /// (upper + (d * f >> 7) + 64) >> 7. d * f >> 7 is the high half of an unsigned multiply by f << 9 once
+        /// d is biased by 2^15, which adds f << 8 to it.
+        AVX2_TARGET inline __m256i blend_down(__m256i upper, __m256i lower, __m256i weights) {
+            __m256i d = _mm256_xor_si256(_mm256_sub_epi16(upper, lower), _mm256_set1_epi16(-0x8000));
+            __m256i scaled = _mm256_mulhi_epu16(d, weights);
+            __m256i rounding = _mm256_sub_epi16(_mm256_set1_epi16(1 << (weight_bits - 1)),
+                                                _mm256_srli_epi16(weights, 1));
+            return _mm256_srli_epi16(_mm256_add_epi16(_mm256_sub_epi16(scaled, upper), rounding), weight_bits);
+        }
+
+        /// The positions of pixels a to h of a group, relative to its pixel 0, in that order across the lanes
+        AVX2_TARGET inline __m256i steps(int64_t step, int a, int b, int c, int d, int e, int f, int g, int h) {
+            return _mm256_mullo_epi32(_mm256_set1_epi32(static_cast<int32_t>(step)),
+                                      _mm256_setr_epi32(a, b, c, d, e, f, g, h));
+        }
+
+        /// bilinear() for N = 3 or 4, 8 pixels at a time, with the same result; see blend_across() and blend_down().
+        /// Pixels 0, 1, 4, 5 are blended in one set of vectors and 2, 3, 6, 7 in another, which the pack at the end
+        /// puts back in order. The weights of each set are computed from its positions rather than shuffled into
+        /// place, since shuffles and gathers compete for the same execution port.
+        /// At the last column and row the right or lower weight is 0, so the pixel standing in for the missing
+        /// neighbour only has to be readable: the right one is whatever follows in the row, the lower one is the
+        /// row itself. Near the end of the buffer, where the reads would run past it, bilinear() takes over.
+        template<size_t N>
+        AVX2_TARGET void bilinear_gather(const sample_plane& source, size_t pixel_size, uint8_t* out, int64_t x,
+                                         int64_t y, int64_t step_x, int64_t step_y, size_t count) {
+            constexpr int64_t rounding = int64_t{1} << (fraction_bits - weight_bits - 1);
+            // (left, right) byte pairs of components 0 to 3, for the two pixels of each 128 bit half
+            const __m256i pairs = N == 4
+                    ? _mm256_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15,
+                                       0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15)
+                    : _mm256_setr_epi8(0, 3, 1, 4, 2, 5, 6, 7, 8, 11, 9, 12, 10, 13, 14, 15,
+                                       0, 3, 1, 4, 2, 5, 6, 7, 8, 11, 9, 12, 10, 13, 14, 15);
+            const auto* base = reinterpret_cast<const long long*>(source.data);
+            const __m256i dx = steps(step_x, 0, 1, 4, 5, 2, 3, 6, 7);
+            const __m256i dy = steps(step_y, 0, 1, 4, 5, 2, 3, 6, 7);
+            const __m256i dx_first = steps(step_x, 0, 0, 1, 1, 4, 4, 5, 5);
+            const __m256i dx_second = steps(step_x, 2, 2, 3, 3, 6, 6, 7, 7);
+            const __m256i dy_first = steps(step_y, 0, 0, 1, 1, 4, 4, 5, 5);
+            const __m256i dy_second = steps(step_y, 2, 2, 3, 3, 6, 6, 7, 7);
+            const __m256i stride = _mm256_set1_epi32(static_cast<int32_t>(source.stride));
+            const __m256i last_row = _mm256_set1_epi32(static_cast<int32_t>(source.height - 1));
+            const __m256i last = _mm256_set1_epi32(static_cast<int32_t>(source.stride * source.height - 8));
+            size_t i = 0;
+            for (; i + 8 <= count; i += 8, x += 8 * step_x, y += 8 * step_y, out += 8 * N) {
+                __m256i u = _mm256_set1_epi32(static_cast<int32_t>(x + rounding));
+                __m256i v = _mm256_set1_epi32(static_cast<int32_t>(y + rounding));
+                __m256i rows = _mm256_srai_epi32(_mm256_add_epi32(v, dy), fraction_bits);
+                __m256i top = offsets<N>(_mm256_srai_epi32(_mm256_add_epi32(u, dx), fraction_bits), rows, stride);
+                __m256i bottom = _mm256_add_epi32(top, _mm256_and_si256(_mm256_cmpgt_epi32(last_row, rows), stride));
+                // leaving the loop rather than calling bilinear() here keeps the constants above in registers
+                if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(bottom, last))) {
+                    break;
+                }
+
+                __m256i wx_first = weights_across(_mm256_add_epi32(u, dx_first));
+                __m256i wx_second = weights_across(_mm256_add_epi32(u, dx_second));
+                __m256i first = blend_down(blend_across(base, _mm256_castsi256_si128(top), pairs, wx_first),
+                                           blend_across(base, _mm256_castsi256_si128(bottom), pairs, wx_first),
+                                           weights_down(_mm256_add_epi32(v, dy_first)));
+                __m256i second = blend_down(blend_across(base, _mm256_extracti128_si256(top, 1), pairs, wx_second),
+                                            blend_across(base, _mm256_extracti128_si256(bottom, 1), pairs, wx_second),
+                                            weights_down(_mm256_add_epi32(v, dy_second)));
+                store_pixels<N>(_mm256_packus_epi16(first, second), out);
+            }
+            bilinear<N>(source, pixel_size, out, x, y, step_x, step_y, count - i);
+        }
+#undef AVX2_TARGET
+#endif
+
+        typedef void (*sampler)(const sample_plane&, size_t, uint8_t*, int64_t, int64_t, int64_t, int64_t, size_t);
+
+        /// The sampler for mode, unrolled for the usual pixel sizes
+        /// \param gathers whether source positions and byte offsets fit the 32 bit lanes of the AVX2 samplers
+        sampler sampler_for(interpolation mode, size_t pixel_size, bool gathers) {
+#if defined(AUGMENTOR_AVX2)
+            if (gathers && cpu_has_avx2() && (pixel_size == 3 || pixel_size == 4)) {
+                if (pixel_size == 3) {
+                    return mode == interpolation::NEAREST ? nearest_gather<3> : bilinear_gather<3>;
+                }
+                return mode == interpolation::NEAREST ? nearest_gather<4> : bilinear_gather<4>;
+            }
+#else
+            (void) gathers;
+#endif
+            switch (pixel_size) {
+                case 1:
+                    return mode == interpolation::NEAREST ? nearest<1> : bilinear<1>;
+                case 3:
+                    return mode == interpolation::NEAREST ? nearest<3> : bilinear<3>;
+                case 4:
+                    return mode == interpolation::NEAREST ? nearest<4> : bilinear<4>;
+                default:
+                    return mode == interpolation::NEAREST ? nearest<0> : bilinear<0>;
+            }
+        }
+
+        constexpr int resize_bits = 14;
+        constexpr int32_t resize_one = 1 << resize_bits;
+        constexpr int32_t resize_half = resize_one / 2;
+        // tables kept for reuse; beyond this many sizes they are dropped and built again as needed
+        constexpr size_t max_tables = 256;
+
+        double lanczos3(double x) {
+            if (x == 0) {
+                return 1;
+            }
+            if (std::abs(x) >= 3) {
+                return 0;
+            }
+            double p = M_PI * x;
+            return 3 * std::sin(p) * std::sin(p / 3) / (p * p);
+        }
+
+        /// The source pixels and weights of output pixel i of target, which may name the same pixel twice
+        std::vector<std::pair<size_t, double>> contributions(resize_filter filter, size_t source, size_t target,
+                                                             size_t i) {
+            double scale = static_cast<double>(source) / target;
+            auto last = static_cast<int64_t>(source) - 1;
+            auto clamp = [last](int64_t j) { return static_cast<size_t>(std::clamp<int64_t>(j, 0, last)); };
+            std::vector<std::pair<size_t, double>> taps;
+            switch (filter) {
+                case resize_filter::NEAREST:
+                    taps.emplace_back(i * source / target, 1.0);
+                    break;
+                case resize_filter::BILINEAR: {
+                    double centre = (i + 0.5) * scale - 0.5;
+                    double left = std::floor(centre);
+                    taps.emplace_back(clamp(static_cast<int64_t>(left)), 1 - (centre - left));
+                    taps.emplace_back(clamp(static_cast<int64_t>(left) + 1), centre - left);
+                    break;
+                }
+                case resize_filter::AREA: {
+                    double begin = i * scale, end = (i + 1) * scale;
+                    for (auto j = static_cast<int64_t>(std::floor(begin)); j < end; ++j) {
+                        double covered = std::min<double>(end, j + 1) - std::max<double>(begin, j);
+                        if (covered > 1e-9) {
+                            taps.emplace_back(clamp(j), covered);
+                        }
+                    }
+                    break;
+                }
+                case resize_filter::LANCZOS3: {
+                    double width = std::max(scale, 1.0);
+                    double centre = (i + 0.5) * scale;
+                    auto begin = static_cast<int64_t>(std::floor(centre - 3 * width));
+                    auto end = static_cast<int64_t>(std::ceil(centre + 3 * width));
+                    for (int64_t j = begin; j <= end; ++j) {
+                        double weight = lanczos3((j + 0.5 - centre) / width);
+                        if (weight != 0) {
+                            taps.emplace_back(clamp(j), weight);
+                        }
+                    }
+                    break;
+                }
+            }
+            return taps;
+        }
+
+        /// out[i] = the rounded weighted sum of rows[k][i] over count rows, clamped to a sample, for i in [0, n)
+        void blend_rows(const uint8_t* const* rows, const int16_t* weights, size_t count, uint8_t* out, size_t n) {
+            size_t i = 0;
+#if defined(__SSE2__)
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i rounding = _mm_set1_epi32(resize_half);
+            for (; i + 16 <= n; i += 16) {
+                __m128i acc0 = rounding, acc1 = rounding, acc2 = rounding, acc3 = rounding;
+                for (size_t k = 0; k < count; k += 2) {
+                    // weights are padded to pairs, an odd last row pairs with zeros
+                    int32_t pair;
+                    std::memcpy(&pair, weights + k, sizeof(pair));
+                    __m128i w = _mm_set1_epi32(pair);
+                    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k] + i));
+                    __m128i b = k + 1 < count ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k + 1] + i))
+                                              : zero;
+                    __m128i a_lo = _mm_unpacklo_epi8(a, zero), a_hi = _mm_unpackhi_epi8(a, zero);
+                    __m128i b_lo = _mm_unpacklo_epi8(b, zero), b_hi = _mm_unpackhi_epi8(b, zero);
+                    acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a_lo, b_lo), w));
+                    acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a_lo, b_lo), w));
+                    acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(a_hi, b_hi), w));
+                    acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(a_hi, b_hi), w));
+                }
+                __m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc0, resize_bits), _mm_srai_epi32(acc1, resize_bits));
+                __m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc2, resize_bits), _mm_srai_epi32(acc3, resize_bits));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(lo, hi));
+            }
+#endif
+            for (; i < n; ++i) {
+                int32_t acc = resize_half;
+                for (size_t k = 0; k < count; ++k) {
+                    acc += weights[k] * rows[k][i];
+                }
+                // lanczos lobes can overshoot either way
+                out[i] = static_cast<uint8_t>(std::clamp(acc >> resize_bits, 0, 255));
+            }
+        }
+
+        /// Each of count output pixels of N components (pixel_size when N is 0) as the rounded weighted sum of its
+        /// taps in row, clamped. With SSE2 and 3 or 4 components, reads up to 8 bytes past the last tap.
+        template<size_t N>
+        void blend_pixels(const uint8_t* row, const size_t* first, const int16_t* weights, size_t taps, size_t stride,
+                          size_t pixel_size, uint8_t* out, size_t count) {
+            size_t size = N ? N : pixel_size;
+#if defined(__SSE2__)
+            if constexpr (N >= 3) {
+                const __m128i zero = _mm_setzero_si128();
+                for (size_t x = 0; x < count; ++x, out += N, weights += stride) {
+                    const uint8_t* p = row + first[x] * N;
+                    __m128i acc = _mm_set1_epi32(resize_half);
+                    for (size_t k = 0; k < taps; k += 2, p += 2 * N) {
+                        // both pixels of a pair, a component per 32 bit lane
+                        __m128i both = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+                        __m128i pairs = _mm_unpacklo_epi8(_mm_unpacklo_epi8(both, _mm_srli_si128(both, N)), zero);
+                        int32_t pair;
+                        std::memcpy(&pair, weights + k, sizeof(pair));
+                        acc = _mm_add_epi32(acc, _mm_madd_epi16(pairs, _mm_set1_epi32(pair)));
+                    }
+                    __m128i packed = _mm_packs_epi32(_mm_srai_epi32(acc, resize_bits), zero);
+                    auto pixel = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(packed, packed)));
+                    if constexpr (N == 4) {
+                        std::memcpy(out, &pixel, 4);
+                    } else {
+                        out[0] = static_cast<uint8_t>(pixel);
+                        out[1] = static_cast<uint8_t>(pixel >> 8);
+                        out[2] = static_cast<uint8_t>(pixel >> 16);
+                    }
+                }
+                return;
+            }
+#endif
+            for (size_t x = 0; x < count; ++x, out += size, weights += stride) {
+                const uint8_t* p = row + first[x] * size;
+                for (size_t c = 0; c < size; ++c) {
+                    int32_t acc = resize_half;
+                    for (size_t k = 0; k < taps; ++k) {
+                        acc += weights[k] * p[k * size + c];
+                    }
+                    out[c] = static_cast<uint8_t>(std::clamp(acc >> resize_bits, 0, 255));
+                }
+            }
+        }
+
+        /// blend_pixels() with a single tap of weight one
+        template<size_t N>
+        void copy_pixels(const uint8_t* row, const size_t* first, const int16_t*, size_t, size_t, size_t pixel_size,
+                         uint8_t* out, size_t count) {
+            size_t size = N ? N : pixel_size;
+            for (size_t x = 0; x < count; ++x, out += size) {
+                std::memcpy(out, row + first[x] * size, size);
+            }
+        }
+
+        typedef void (*pixel_blender)(const uint8_t*, const size_t*, const int16_t*, size_t, size_t, size_t, uint8_t*,
+                                      size_t);
+
+        /// The horizontal pass for taps taps of pixels of pixel_size components, unrolled for the usual sizes
+        pixel_blender pixel_blender_for(size_t taps, size_t pixel_size) {
+            switch (pixel_size) {
+                case 1:
+                    return taps == 1 ? copy_pixels<1> : blend_pixels<1>;
+                case 3:
+                    return taps == 1 ? copy_pixels<3> : blend_pixels<3>;
+                case 4:
+                    return taps == 1 ? copy_pixels<4> : blend_pixels<4>;
+                default:
+                    return taps == 1 ? copy_pixels<0> : blend_pixels<0>;
+            }
+        }
+    }
+
+    rotation::rotation(double degrees, size_t width, size_t height, interpolation mode):
+            width{width}, height{height}, mode{mode} {
+        double angle = degrees * M_PI / 180.0;
+        cosine = std::cos(angle);
+        sine = std::sin(angle);
+        step_x = std::llround(cosine * unit);
+        step_y = std::llround(sine * unit);
+    }
+
+    rotation::row_span rotation::span(size_t y) const {
+        // the source position of output (x, y) is (x - cx, y - cy) turned by the angle, shifted back, where
+        // (cx, cy) = ((w - 1) / 2, (h - 1) / 2) is the centre of the pixel grid
+        double centre_x = (static_cast<double>(width) - 1) / 2;
+        double centre_y = (static_cast<double>(height) - 1) / 2;
+        double yt = static_cast<double>(y) - centre_y;
+        row_span s{};
+        s.x = std::llround((cosine * -centre_x - sine * yt + centre_x) * unit);
+        s.y = std::llround((sine * -centre_x + cosine * yt + centre_y) * unit);
+
+        auto w = static_cast<int64_t>(width), h = static_cast<int64_t>(height);
+        std::pair<size_t, size_t> columns, rows;
+        if (mode == interpolation::NEAREST) {
+            // rounds into [0, w) when the position is in [-1/2, w - 1/2)
+            columns = solve(s.x, step_x, -half_unit, w * unit - half_unit - 1, width);
+            rows = solve(s.y, step_y, -half_unit, h * unit - half_unit - 1, width);
+        } else {
+            columns = solve(s.x, step_x, 0, (w - 1) * unit, width);
+            rows = solve(s.y, step_y, 0, (h - 1) * unit, width);
+        }
+        s.begin = std::max(columns.first, rows.first);
+        s.end = std::max(s.begin, std::min(columns.second, rows.second));
+        return s;
+    }
+
+    void rotation::rows(const sample_plane& source, const sample_plane& target, size_t pixel_size,
+                        size_t first, size_t last) const {
+        // positions in 16.16 and byte offsets must fit in 32 bits
+        bool gathers = width < (size_t{1} << 15) && height < (size_t{1} << 15) &&
+                       source.stride * source.height <= static_cast<size_t>(INT32_MAX);
+        auto sample = sampler_for(mode, pixel_size, gathers);
+        std::vector<row_span> spans(tile_size);
+        for (size_t top = first; top < last; top += tile_size) {
+            size_t bottom = std::min(last, top + tile_size);
+            for (size_t y = top; y < bottom; ++y) {
+                auto& s = spans[y - top];
+                s = span(y);
+                uint8_t* out = target.row(y);
+                std::memset(out, 0, s.begin * pixel_size);
+                std::memset(out + s.end * pixel_size, 0, (width - s.end) * pixel_size);
+            }
+            for (size_t left = 0; left < width; left += tile_size) {
+                size_t right = std::min(width, left + tile_size);
+                for (size_t y = top; y < bottom; ++y) {
+                    const auto& s = spans[y - top];
+                    size_t begin = std::max(s.begin, left);
+                    size_t end = std::min(s.end, right);
+                    if (begin < end) {
+                        auto offset = static_cast<int64_t>(begin);
+                        sample(source, pixel_size, target.row(y) + begin * pixel_size, s.x + offset * step_x,
+                               s.y + offset * step_y, step_x, step_y, end - begin);
+                    }
+                }
+            }
+        }
+    }
+
+    resampler::resampler(resize_filter filter, size_t source_width, size_t source_height, size_t width,
+                         size_t height):
+            source_width{source_width},
+            horizontal{table(filter, source_width, width)},
+            vertical{table(filter, source_height, height)} {}
+
+    std::shared_ptr<const resampler::axis> resampler::table(resize_filter filter, size_t source, size_t target) {
+        static std::mutex mutex;
+        static std::map<std::tuple<resize_filter, size_t, size_t>, std::shared_ptr<const axis>> tables;
+        auto key = std::make_tuple(filter, source, target);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = tables.find(key);
+            if (found != tables.end()) {
+                return found->second;
+            }
+        }
+        auto built = std::make_shared<const axis>(build(filter, source, target));
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tables.size() >= max_tables) {
+            tables.clear();
+        }
+        // another thread may have built it meanwhile; theirs and ours are the same
+        return tables.emplace(key, built).first->second;
+    }
+
+    resampler::axis resampler::build(resize_filter filter, size_t source, size_t target) {
+        // each output pixel's weights over consecutive source pixels from its first, normalised
+        std::vector<size_t> firsts(target);
+        std::vector<std::vector<double>> spans(target);
+        size_t taps = 1;
+        for (size_t i = 0; i < target; ++i) {
+            auto contributing = contributions(filter, source, target, i);
+            size_t begin = source, end = 0;
+            double total = 0;
+            for (auto [j, weight] : contributing) {
+                begin = std::min(begin, j);
+                end = std::max(end, j + 1);
+                total += weight;
+            }
+            spans[i].assign(end - begin, 0.0);
+            for (auto [j, weight] : contributing) {
+                spans[i][j - begin] += weight / total;
+            }
+            firsts[i] = begin;
+            taps = std::max(taps, end - begin);
+        }
+
+        axis result;
+        result.taps = taps;
+        result.stride = taps + taps % 2;
+        result.first.resize(target);
+        result.weights.assign(target * result.stride, 0);
+        for (size_t i = 0; i < target; ++i) {
+            // every output pixel gets taps taps, the window moved left where it would run off the source
+            size_t first = std::min(firsts[i], source - taps);
+            int16_t* weights = result.weights.data() + i * result.stride + (firsts[i] - first);
+            int32_t sum = 0;
+            size_t largest = 0;
+            for (size_t k = 0; k < spans[i].size(); ++k) {
+                weights[k] = static_cast<int16_t>(std::lround(spans[i][k] * resize_one));
+                sum += weights[k];
+                largest = std::abs(spans[i][k]) > std::abs(spans[i][largest]) ? k : largest;
+            }
+            // corrected to sum to exactly one, so flat areas stay flat
+            weights[largest] = static_cast<int16_t>(weights[largest] + resize_one - sum);
+            result.first[i] = first;
+        }
+        return result;
+    }
+
+    void resampler::rows(const sample_plane& source, const sample_plane& target, size_t pixel_size,
+                         size_t first, size_t last) const {
+        const axis& h = *horizontal;
+        const axis& v = *vertical;
+        size_t row_samples = source_width * pixel_size;
+        size_t width = h.first.size();
+        auto blend = pixel_blender_for(h.taps, pixel_size);
+        // a blended row, with room for the reads past its end blend_pixels() makes
+        std::vector<uint8_t> buffer(row_samples + 8);
+        std::vector<const uint8_t*> taps(v.taps);
+        for (size_t y = first; y < last; ++y) {
+            const uint8_t* row;
+            if (v.taps == 1) {
+                row = source.row(v.first[y]);
+            } else {
+                for (size_t k = 0; k < v.taps; ++k) {
+                    taps[k] = source.row(v.first[y] + k);
+                }
+                blend_rows(taps.data(), v.weights.data() + y * v.stride, v.taps, buffer.data(), row_samples);
+                row = buffer.data();
+            }
+
+            if (h.taps > 1 && row != buffer.data()) {
+                std::memcpy(buffer.data(), row, row_samples);
+                row = buffer.data();
+            }
+            blend(row, h.first.data(), h.weights.data(), h.taps, h.stride, pixel_size, target.row(y), width);
+        }
+    }
+}
@@ -0,0 +1,123 @@
+#ifndef LIB_GEOMETRY_H
+#define LIB_GEOMETRY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Convolution.h"
+
+namespace augmentorLib {
+
+    /// How a geometric transform samples the source between its pixels
+    enum class interpolation {
+        /// the pixel the position rounds to
+        NEAREST,
+        /// the four pixels around the position, weighted by distance
+        BILINEAR
+    };
+
+    /// A rotation of an image about its centre onto a canvas of the same size
+    ///
+    /// The centre is that of the pixel grid, ((w - 1) / 2, (h - 1) / 2), so a half turn, or a quarter turn of a
+    /// square image, moves every pixel exactly onto another and agrees with the lossless JPEG transforms.
+    /// The sine and cosine are taken once. Along an output row the source position moves by a constant step, so
+    /// it is stepped in 16.16 fixed point, and the span of the row whose position falls inside the source is
+    /// solved for up front: the inner loops neither test bounds nor round. Outside the span the output is black.
+    /// Output is written in tiles of 64 x 64 pixels: along a row at a steep angle every pixel is on another source
+    /// row, and often another page, while the rows of a tile share a few dozen source rows that stay in cache and
+    /// in the TLB. Bilinear weights have 7 bits, and with SSE2 each output pixel of 3 or 4 components blends in two
+    /// multiply-adds, giving the same result as without. On CPUs with AVX2, pixels of 3 or 4 components are
+    /// fetched 8 at a time with gathers, in either mode and again with the same result.
+    class rotation {
+    public:
+        /// \param degrees counterclockwise angle
+        /// \param width width of the source and the output
+        /// \param height height of the source and the output
+        rotation(double degrees, size_t width, size_t height, interpolation mode = interpolation::NEAREST);
+
+        /// Writes rows [first, last) of target from source. Source and target must not overlap.
+        /// \param pixel_size components per pixel
+        void rows(const sample_plane& source, const sample_plane& target, size_t pixel_size,
+                  size_t first, size_t last) const;
+
+    private:
+        /// Source position of the start of row y and the columns [begin, end) of the row that sample inside it
+        struct row_span {
+            int64_t x;
+            int64_t y;
+            size_t begin;
+            size_t end;
+        };
+
+        [[nodiscard]] row_span span(size_t y) const;
+
+        size_t width;
+        size_t height;
+        interpolation mode;
+        double cosine;
+        double sine;
+        // source steps per output pixel along a row, in 16.16 fixed point
+        int64_t step_x;
+        int64_t step_y;
+    };
+
+    /// The filter a resize weighs the source pixels under an output pixel with
+    enum class resize_filter {
+        /// the pixel at the output pixel's top left corner, as resizes always did
+        NEAREST,
+        /// the two pixels either side of the output pixel's centre along each axis
+        BILINEAR,
+        /// every pixel the output pixel covers, by how much of it is covered; for shrinking
+        AREA,
+        /// a windowed sinc over three lobes, widened to the scale when shrinking
+        LANCZOS3
+    };
+
+    /// A separable resize of a sample_plane
+    ///
+    /// Each axis has a table of where each output pixel's taps start and their weights in 14 bit fixed point, the
+    /// same number of taps for every output pixel. Tables are built once per filter, source and target size and
+    /// shared by every resampler that needs them, on any thread. An output row is the weighted sum of its source
+    /// rows, 16 samples a multiply-add with SSE2, and then each output pixel of 3 or 4 components the weighted sum
+    /// of its pixels in that row, two taps a multiply-add. Results are the same with and without SSE2 and however
+    /// the rows are split; single tap axes, e.g. NEAREST, copy instead.
+    class resampler {
+    public:
+        /// \param filter how source pixels are weighed
+        /// \param source_width width of the source
+        /// \param source_height height of the source
+        /// \param width width of the output
+        /// \param height height of the output
+        resampler(resize_filter filter, size_t source_width, size_t source_height, size_t width, size_t height);
+
+        /// Writes rows [first, last) of target from source. Source and target must not overlap.
+        /// \param pixel_size components per pixel
+        void rows(const sample_plane& source, const sample_plane& target, size_t pixel_size,
+                  size_t first, size_t last) const;
+
+    private:
+        /// The taps of every output pixel along one axis
+        struct axis {
+            /// Taps per output pixel
+            size_t taps;
+            /// Weights per output pixel, taps rounded up to even with zeros, so they go in pairs
+            size_t stride;
+            /// Index of the first source pixel of each output pixel
+            std::vector<size_t> first;
+            /// Weights of each output pixel, stride apart, summing to one in 14 bit fixed point
+            std::vector<int16_t> weights;
+        };
+
+        static std::shared_ptr<const axis> table(resize_filter filter, size_t source, size_t target);
+
+        static axis build(resize_filter filter, size_t source, size_t target);
+
+        size_t source_width;
+        std::shared_ptr<const axis> horizontal;
+        std::shared_ptr<const axis> vertical;
+    };
+}
+
+#endif //LIB_GEOMETRY_H
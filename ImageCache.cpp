@@ -0,0 +1,60 @@
+#include "ImageCache.h"
+
+namespace augmentorLib {
+
+    ImageCache::ImageCache(size_t byte_budget): byte_budget{byte_budget} {}
+
+    Image ImageCache::get(const std::string& key, const loader_type& load) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it != index.end()) {
+                ++counters.hits;
+                entries.splice(entries.begin(), entries, it->second);
+                return it->second->second;
+            }
+            ++counters.misses;
+        }
+
+        // decode outside the lock, so other threads keep hitting the cache meanwhile
+        Image image = load();
+        auto bytes = image.getByteSize();
+        if (bytes > byte_budget) {
+            return image;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index.find(key) == index.end()) {
+            evict_to(byte_budget - bytes);
+            entries.emplace_front(key, image);
+            index[key] = entries.begin();
+            counters.bytes += bytes;
+            counters.entries = entries.size();
+        }
+        return image;
+    }
+
+    void ImageCache::evict_to(size_t bytes) {
+        while (counters.bytes > bytes && !entries.empty()) {
+            auto& victim = entries.back();
+            counters.bytes -= victim.second.getByteSize();
+            index.erase(victim.first);
+            entries.pop_back();
+            ++counters.evictions;
+        }
+        counters.entries = entries.size();
+    }
+
+    image_cache_stats ImageCache::stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counters;
+    }
+
+    void ImageCache::clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        index.clear();
+        counters.bytes = 0;
+        counters.entries = 0;
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef LIB_IMAGECACHE_H
+#define LIB_IMAGECACHE_H
+
+#include "jpeg.h"
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace augmentorLib {
+
+    using jpegimageSTL::jpeg::Image;
+
+    /// Counters of an ImageCache
+    struct image_cache_stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        /// Bytes of pixel data currently held
+        size_t bytes = 0;
+        size_t entries = 0;
+
+        [[nodiscard]] double hit_rate() const {
+            return hits + misses ? static_cast<double>(hits) / (hits + misses) : 0.0;
+        }
+    };
+
+    /// A byte-budgeted LRU cache of decoded images
+    ///
+    /// Images are handed out as copy-on-write copies: operations that only read the source (crop, rotate, resize)
+    /// never copy the cached pixels, and the ones that write in place unshare them first. A source stays decoded for
+    /// as long as it is in the cache. The cache is thread safe.
+    class ImageCache {
+    public:
+        typedef std::function<Image()> loader_type;
+
+        ImageCache() = delete;
+
+        /// \param byte_budget most bytes of pixel data kept decoded; least recently used images are evicted beyond it
+        explicit ImageCache(size_t byte_budget);
+
+        /// Get
+        ///
+        /// \param key identifies the decoded image, usually its path
+        /// \param load decodes the image on a miss
+        /// \return A copy-on-write copy of the cached image
+        Image get(const std::string& key, const loader_type& load);
+
+        [[nodiscard]] image_cache_stats stats() const;
+
+        [[nodiscard]] size_t budget() const { return byte_budget; }
+
+        void clear();
+
+    private:
+        typedef std::list<std::pair<std::string, Image>> lru_list;
+
+        void evict_to(size_t bytes);
+
+        size_t byte_budget;
+        mutable std::mutex mutex;
+        // most recently used first
+        lru_list entries;
+        std::unordered_map<std::string, lru_list::iterator> index;
+        image_cache_stats counters;
+    };
+}
+
+#endif //LIB_IMAGECACHE_H
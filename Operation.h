@@ -13,10 +13,17 @@
 #include <utility>
 #include <iostream>
 #include "filters.h"
+#include "Convolution.h"
+#include "Geometry.h"
+#include "Scheduler.h"
 #include <algorithm>
 #include <vector>
 #include <limits>
 #include <type_traits>
+#include <sstream>
+#include <string>
+#include <memory>
+#include <optional>
 
 
 namespace augmentorLib {
@@ -68,6 +75,12 @@ namespace augmentorLib {
         inline DataType operator()() {
             return distribution(generator);
         }
+
+        /// Restarts the sequence from seed; 0 seeds from the current time
+        void seed(unsigned seed) {
+            generator.seed(init_seed(seed));
+            distribution.reset();
+        }
     };
 
     /// A class to generate int numbers
@@ -109,6 +122,12 @@ namespace augmentorLib {
         inline DataType operator()() {
             return distribution(generator);
         }
+
+        /// Restarts the sequence from seed; 0 seeds from the current time
+        void seed(unsigned seed) {
+            generator.seed(init_seed(seed));
+            distribution.reset();
+        }
     };
 
     //TODO: use concept to constrain the value type to images
@@ -119,14 +138,28 @@ namespace augmentorLib {
     class Operation {
     private:
         typedef double _precision_type;
+        enum class decision { NONE, OPERATE, SKIP };
         double probability;
         UniformDistributionGenerator<_precision_type> generator;
+        // the seed given at construction or to the last reseed(), NULL_SEED when drawn from the clock
+        unsigned given_seed;
+        // drawn ahead by roll(), consumed by the next operate_this_time()
+        decision rolled = decision::NONE;
+        bool last_changed = false;
 
     protected:
         /// Used to decide whether an operation is performed or not
         /// \return A boolean value indicating whether the operation must be performed or not based on probability
         inline bool operate_this_time() {
-            return generator() <= probability;
+            bool operate = rolled == decision::NONE ? generator() <= probability : rolled == decision::OPERATE;
+            rolled = decision::NONE;
+            last_changed = operate;
+            return operate;
+        }
+
+        /// Reports that the operation ran but left the image as it was, e.g. a crop to the size it already has
+        inline void unchanged() {
+            last_changed = false;
         }
 
         inline _precision_type uniform_random_number() {
@@ -137,10 +170,15 @@ namespace augmentorLib {
             return (upper - lower) * generator() + lower;
         }
 
+        /// \return Whether the operation is performed on every image
+        inline bool always_operates() const {
+            return probability >= UPPER_BOUND_PROB;
+        }
+
     public:
 
         /// Default constructor
-        Operation(): probability{UPPER_BOUND_PROB}, generator{NULL_SEED} {};
+        Operation(): probability{UPPER_BOUND_PROB}, generator{NULL_SEED}, given_seed{NULL_SEED} {};
 
         /// Destructor for the Operation class
         virtual ~Operation() = default;
@@ -149,11 +187,89 @@ namespace augmentorLib {
         ///
         /// \param prob Proabability of performing an operation
         /// \param seed The random seed for the randomness of the operation
-        explicit Operation(double prob, unsigned seed = NULL_SEED): probability{prob}, generator{seed} {}
+        explicit Operation(double prob, unsigned seed = NULL_SEED): probability{prob}, generator{seed}, given_seed{seed} {}
 
         template <typename Container>
         Container&& perform(Container&&);
 
+        /// Roll
+        ///
+        /// Decides ahead of perform() whether the operation will happen, so a caller can tell before decoding
+        /// that no operation of a pipeline fires. The next perform() follows the decision drawn here.
+        /// \return Whether the next perform() will operate
+        bool roll() {
+            bool operate = generator() <= probability;
+            rolled = operate ? decision::OPERATE : decision::SKIP;
+            return operate;
+        }
+
+        /// Follow
+        ///
+        /// Makes the next perform() follow a decision drawn elsewhere, e.g. by roll() on another copy of the
+        /// operation in an earlier stage of a pipeline
+        /// \param operate whether the next perform() operates
+        void follow(bool operate) {
+            rolled = operate ? decision::OPERATE : decision::SKIP;
+        }
+
+        /// \return Whether the last perform() changed the image
+        [[nodiscard]] bool changed() const {
+            return last_changed;
+        }
+
+        /// Decode hint
+        ///
+        /// Called on the first operation of a pipeline before each source is decoded, so it can ask the decoder to
+        /// skip work it would throw away anyway (e.g. decode at a reduced scale ahead of a downscale).
+        /// \param options decode options to refine
+        /// \return Whether options were changed
+        virtual bool hint_decode(typename Image::decode_options_type& options) const {
+            (void) options;
+            return false;
+        }
+
+        /// Lossless orientation
+        ///
+        /// Lets a pipeline whose operations are all flips and rotations by multiples of 90° transform JPEG sources
+        /// in the DCT domain instead of decoding them. Composes the transform this operation makes into o.
+        /// \param o transform of the operations before this one
+        /// \param width width of the image the operation would get
+        /// \param height height of the image the operation would get
+        /// \return false when the operation is not such a transform for an image of this size
+        virtual bool orient(typename Image::orientation_type& o, size_t width, size_t height) const {
+            (void) o;
+            (void) width;
+            (void) height;
+            return false;
+        }
+
+        /// Describe
+        ///
+        /// What the last perform() did, with the parameters it drew, e.g. "rotate 37.5". Output sinks that keep
+        /// metadata record it with every sample.
+        virtual std::string describe() const {
+            return "operation";
+        }
+
+        /// Clone
+        ///
+        /// A copy of the operation with its parameters and its random state, so each worker of a parallel sample()
+        /// runs its own chain. Reseed a clone, or it draws the same sequence as the original.
+        virtual std::unique_ptr<Operation<Image>> clone() const = 0;
+
+        /// Restarts every random draw of the operation from seed
+        /// \param seed new seed; 0 seeds from the current time
+        virtual void reseed(unsigned seed) {
+            generator.seed(seed);
+            given_seed = seed;
+        }
+
+        /// \return The seed given to the constructor or the last reseed(), NULL_SEED when the operation seeds
+        /// itself from the current time
+        [[nodiscard]] unsigned seed() const {
+            return given_seed;
+        }
+
         // use pointer here, because we can use nullptr to indicate the Operation did not occur.
         /// Perform function that is called to invoke a particular operation
         ///
@@ -175,8 +291,30 @@ namespace augmentorLib {
 
         Image * perform(Image* image) override;
 
+        std::string describe() const override {
+            return "stdout " + str;
+        }
+
+        std::unique_ptr<Operation<Image>> clone() const override {
+            return std::make_unique<StdoutOperation>(*this);
+        }
+
     };
 
+    /// Suffix of describe() for a resize filter, empty for the default
+    inline std::string filter_name(resize_filter filter) {
+        switch (filter) {
+            case resize_filter::BILINEAR:
+                return " bilinear";
+            case resize_filter::AREA:
+                return " area";
+            case resize_filter::LANCZOS3:
+                return " lanczos3";
+            default:
+                return "";
+        }
+    }
+
     struct image_size {
         size_t height;
         size_t width;
@@ -187,6 +325,8 @@ namespace augmentorLib {
     private:
         image_size lower;
         image_size upper;
+        resize_filter filter = resize_filter::NEAREST;
+        image_size last{0, 0};
 
     public:
         ResizeOperation() = delete;
@@ -194,8 +334,24 @@ namespace augmentorLib {
         explicit ResizeOperation(image_size lower, image_size upper, double prob = UPPER_BOUND_PROB,
                                  unsigned seed = NULL_SEED): Operation<Image>{prob, seed}, lower{lower}, upper{upper} {};
 
+        /// \param filter how the source pixels under each output pixel are weighed
+        ResizeOperation(image_size lower, image_size upper, resize_filter filter, double prob = UPPER_BOUND_PROB,
+                        unsigned seed = NULL_SEED):
+                Operation<Image>{prob, seed}, lower{lower}, upper{upper}, filter{filter} {};
+
         Image * perform(Image* image) override;
 
+        /// Decodes straight to the largest size the resize can pick, when the resize always happens
+        bool hint_decode(typename Image::decode_options_type& options) const override;
+
+        std::string describe() const override {
+            return "resize " + std::to_string(last.height) + "x" + std::to_string(last.width) + filter_name(filter);
+        }
+
+        std::unique_ptr<Operation<Image>> clone() const override {
+            return std::make_unique<ResizeOperation>(*this);
+        }
+
     };
 
     template<typename Image>
@@ -212,6 +368,17 @@ namespace augmentorLib {
 
         Image * perform(Image* image) override;
 
+        /// Decodes only the centre window, when the crop always happens around the centre
+        bool hint_decode(typename Image::decode_options_type& options) const override;
+
+        std::string describe() const override {
+            return "crop " + std::to_string(size.height) + "x" + std::to_string(size.width) + (center ? " center" : "");
+        }
+
+        std::unique_ptr<Operation<Image>> clone() const override {
+            return std::make_unique<CropOperation>(*this);
+        }
+
     };
 
     struct rotate_range {
@@ -223,6 +390,8 @@ namespace augmentorLib {
     class RotateOperation: public Operation<Image> {
     private:
         rotate_range range;
+        interpolation mode = interpolation::NEAREST;
+        double last_degree = 0;
 
     public:
         RotateOperation() = delete;
@@ -230,8 +399,29 @@ namespace augmentorLib {
         explicit RotateOperation(rotate_range range, double prob = UPPER_BOUND_PROB,
                                unsigned seed = NULL_SEED): Operation<Image>{prob, seed}, range{range} {};
 
+        /// \param mode how pixels between source pixels are sampled
+        RotateOperation(rotate_range range, interpolation mode, double prob = UPPER_BOUND_PROB,
+                        unsigned seed = NULL_SEED): Operation<Image>{prob, seed}, range{range}, mode{mode} {};
+
         Image * perform(Image* image) override;
 
+        /// A fixed rotation by a multiple of 90°; quarter turns only on square images, which keep their canvas
+        bool orient(typename Image::orientation_type& o, size_t width, size_t height) const override;
+
+        std::string describe() const override {
+            std::ostringstream out;
+            // a fixed angle may have been applied without perform(), see orient()
+            out << "rotate " << (range.min_rotate == range.max_rotate ? range.min_rotate : last_degree);
+            if (mode == interpolation::BILINEAR) {
+                out << " bilinear";
+            }
+            return out.str();
+        }
+
+        std::unique_ptr<Operation<Image>> clone() const override {
+            return std::make_unique<RotateOperation>(*this);
+        }
+
     };
 
     struct zoom_factor {
@@ -243,6 +433,8 @@ namespace augmentorLib {
     class ZoomOperation: public Operation<Image> {
     private:
         zoom_factor factor;
+        resize_filter filter = resize_filter::NEAREST;
+        double last_level = 1;
 //        bool center; //True - use fixed center. False - use random center
 
     public:
@@ -251,8 +443,22 @@ namespace augmentorLib {
         explicit ZoomOperation(zoom_factor factor,  double prob = UPPER_BOUND_PROB,
                                unsigned seed = NULL_SEED): Operation<Image>{prob, seed}, factor{factor} {};
 
+        /// \param filter how the source pixels under each output pixel are weighed
+        ZoomOperation(zoom_factor factor, resize_filter filter, double prob = UPPER_BOUND_PROB,
+                      unsigned seed = NULL_SEED): Operation<Image>{prob, seed}, factor{factor}, filter{filter} {};
+
         Image * perform(Image* image) override;
 
+        std::string describe() const override {
+            std::ostringstream out;
+            out << "zoom " << last_level << filter_name(filter);
+            return out.str();
+        }
+
+        std::unique_ptr<Operation<Image>> clone() const override {
+            return std::make_unique<ZoomOperation>(*this);
+        }
+
     };
 
 
@@ -264,22 +470,42 @@ namespace augmentorLib {
 
         Image * perform(Image* image) override;
 
+        std::string describe() const override {
+            return "invert";
+        }
+
+        std::unique_ptr<Operation<Image>> clone() const override {
+            return std::make_unique<InvertOperation>(*this);
+        }
+
     };
 
     template<typename Image, int Kernel = 0>
     class GaussianBlurOperation: public Operation<Image> {
     private:
         gaussian_blur_filter_1D<Kernel> filter;
+        double sigma;
+        separable_kernel kernel;
     public:
         explicit GaussianBlurOperation(const double sigma, const size_t n,
                 double prob = UPPER_BOUND_PROB, unsigned seed = NULL_SEED): Operation<Image>{prob, seed},
-                filter(sigma, n) {}
+                filter(sigma, n), sigma{sigma}, kernel(separable_kernel::of(filter)) {}
 
         explicit GaussianBlurOperation(const double sigma, double prob = UPPER_BOUND_PROB, unsigned seed = NULL_SEED):
-            Operation<Image>{prob, seed}, filter(sigma) {}
+            Operation<Image>{prob, seed}, filter(sigma), sigma{sigma}, kernel(separable_kernel::of(filter)) {}
 
         Image* perform(Image* image) override;
 
+        std::string describe() const override {
+            std::ostringstream out;
+            out << "gaussian_blur " << sigma << " " << filter.size();
+            return out.str();
+        }
+
+        std::unique_ptr<Operation<Image>> clone() const override {
+            return std::make_unique<GaussianBlurOperation<Image, Kernel>>(*this);
+        }
+
     };
 
 
@@ -296,25 +522,118 @@ namespace augmentorLib {
                 Operation<Image>{prob, seed}, filter{filter} {}
 
         Image* perform(Image* image) override;
+
+        std::string describe() const override {
+            return "box_blur " + std::to_string(filter.length);
+        }
+
+        std::unique_ptr<Operation<Image>> clone() const override {
+            return std::make_unique<BoxBlurOperation>(*this);
+        }
+    };
+
+    /// How a FastGaussianBlurOperation runs its box passes
+    enum class box_blur_mode {
+        /// each pass along y and then x, by running sums
+        SLIDING,
+        /// each pass at once from a summed-area table, whose memory the passes share
+        INTEGRAL
     };
 
     template<typename Image>
     class FastGaussianBlurOperation: public Operation<Image> {
     private:
         std::vector<BoxBlurOperation<Image>> box_blur_operations;
+        std::vector<size_t> lengths;
+        double sigma;
+        box_blur_mode mode;
+        integral_image integral;
     public:
 
         explicit FastGaussianBlurOperation(const double sigma, const unsigned int passes,
                 double prob = UPPER_BOUND_PROB, unsigned seed = NULL_SEED):
-                Operation<Image>{prob, seed} {
+                FastGaussianBlurOperation(sigma, passes, box_blur_mode::SLIDING, prob, seed) {}
+
+        explicit FastGaussianBlurOperation(const double sigma, const unsigned int passes, box_blur_mode mode,
+                double prob = UPPER_BOUND_PROB, unsigned seed = NULL_SEED):
+                Operation<Image>{prob, seed}, sigma{sigma}, mode{mode} {
             auto filters = box_blur_filter_1D::pseudo_gaussian_filter(sigma, passes);
             for (auto filter : filters) {
                 box_blur_operations.push_back(BoxBlurOperation<Image>(filter));
+                lengths.push_back(filter.length);
+            }
+        }
+
+        Image* perform(Image* image) override;
+
+        std::string describe() const override {
+            std::ostringstream out;
+            out << "rapid_blur " << sigma << " " << box_blur_operations.size();
+            if (mode == box_blur_mode::INTEGRAL) {
+                out << " integral";
+            }
+            return out.str();
+        }
+
+        std::unique_ptr<Operation<Image>> clone() const override {
+            return std::make_unique<FastGaussianBlurOperation>(*this);
+        }
+
+    };
+
+    /// How a BlurOperation computes its gaussian
+    enum class blur_backend {
+        /// whichever of the others is fastest for the sigma and image size, see BlurOperation::choose()
+        AUTO,
+        /// a separable kernel over three sigma on either side; its cost grows with sigma
+        FIR,
+        /// three box blurs; constant cost, a coarse approximation at small sigma
+        BOX,
+        /// recursive filters; constant cost, for sigma from 0.5
+        IIR
+    };
+
+    template<typename Image>
+    class BlurOperation: public Operation<Image> {
+    private:
+        double sigma;
+        blur_backend backend;
+        blur_backend last = blur_backend::AUTO;
+        GaussianBlurOperation<Image> fir;
+        FastGaussianBlurOperation<Image> box;
+        std::optional<recursive_gaussian> iir;
+
+    public:
+        /// \param sigma standard deviation of the gaussian in pixels
+        explicit BlurOperation(double sigma, blur_backend backend = blur_backend::AUTO,
+                double prob = UPPER_BOUND_PROB, unsigned seed = NULL_SEED):
+                Operation<Image>{prob, seed}, sigma{sigma}, backend{backend},
+                // the kernel's filter spreads over sigma * sqrt(2)
+                fir(sigma * std::sqrt(2.0), 2 * static_cast<size_t>(std::ceil(3 * sigma)) + 1),
+                box(sigma, 3) {
+            if (sigma >= 0.5 || backend == blur_backend::IIR) {
+                iir.emplace(sigma);
             }
         }
 
         Image* perform(Image* image) override;
 
+        /// The backend AUTO runs
+        ///
+        /// The kernel up to a sigma of about 2 (3 from 2 MP), the recursive filters beyond, where the kernel gets
+        /// long. The box blurs were never the fastest in the "blur" benchmark section, which measured these points.
+        static blur_backend choose(double sigma, size_t width, size_t height);
+
+        std::string describe() const override {
+            static const char* names[] = {"auto", "fir", "box", "iir"};
+            std::ostringstream out;
+            out << "blur " << sigma << " " << names[static_cast<int>(backend == blur_backend::AUTO ? last : backend)];
+            return out.str();
+        }
+
+        std::unique_ptr<Operation<Image>> clone() const override {
+            return std::make_unique<BlurOperation>(*this);
+        }
     };
 
     template<typename Image>
@@ -325,6 +644,10 @@ namespace augmentorLib {
         UniformDistributionGenerator<pixel_value_type> noise_generator;
         image_size lower_mask_size;
         image_size upper_mask_size;
+        // height x width at left, top
+        image_size last_size{0, 0};
+        size_t last_left = 0;
+        size_t last_top = 0;
     public:
         explicit RandomEraseOperation(image_size lower_mask_size, image_size upper_mask_size,
                 double prob = UPPER_BOUND_PROB, unsigned seed = NULL_SEED, unsigned xy_seed = NULL_SEED,
@@ -337,12 +660,27 @@ namespace augmentorLib {
 
         Image * perform(Image* image) override;
 
+        std::string describe() const override {
+            return "random_erase " + std::to_string(last_size.height) + "x" + std::to_string(last_size.width) +
+                   "+" + std::to_string(last_left) + "+" + std::to_string(last_top);
+        }
+
+        std::unique_ptr<Operation<Image>> clone() const override {
+            return std::make_unique<RandomEraseOperation>(*this);
+        }
+
+        void reseed(unsigned seed) override {
+            Operation<Image>::reseed(seed);
+            xy_generator.seed(seed == NULL_SEED ? NULL_SEED : seed + 1);
+            noise_generator.seed(seed == NULL_SEED ? NULL_SEED : seed + 2);
+        }
+
     };
 
     template<typename Image>
     class FlipOperation: public Operation<Image> {
     private:
-        const std::string& type;
+        std::string type;
     public:
         explicit FlipOperation(const std::string& type,
                                double prob = UPPER_BOUND_PROB, unsigned seed = NULL_SEED): Operation<Image>{prob, seed},
@@ -350,6 +688,16 @@ namespace augmentorLib {
 
         Image * perform(Image* image) override;
 
+        bool orient(typename Image::orientation_type& o, size_t width, size_t height) const override;
+
+        std::string describe() const override {
+            return "flip " + type;
+        }
+
+        std::unique_ptr<Operation<Image>> clone() const override {
+            return std::make_unique<FlipOperation>(*this);
+        }
+
     };
 
     template<typename Image>
@@ -358,27 +706,27 @@ namespace augmentorLib {
             return image;
         }
 
+        auto pixel_size = image->getPixelSize();
+        // unshared here once, the rows are then written from several threads
+        (void) image->getData();
         if(type==HORIZONTAL)
         {
-            for(size_t y = 0; y < image->getHeight(); ++y) {
-                for(size_t x = 0; x < image->getWidth()/2; ++x) {
-                    std::vector<uint8_t> left_pixels = image->getPixel(x, y);
-                    std::vector<uint8_t> right_pixels = image->getPixel(image->getWidth() - x - 1, y);
-
-                    image->setPixel(x, y, right_pixels);
-                    image->setPixel(image->getWidth()-x-1, y, left_pixels);
+            Scheduler::parallel_for(image->getHeight(), image->getWidth(), [image, pixel_size](size_t begin, size_t end) {
+                for(size_t y = begin; y < end; ++y) {
+                    auto row = image->row(y);
+                    for(size_t x = 0; x < image->getWidth()/2; ++x) {
+                        auto left = row[x];
+                        std::swap_ranges(left, left + pixel_size, row[image->getWidth() - x - 1]);
+                    }
                 }
-            }
+            });
         } else if(type==VERTICAL){
-            for(size_t y = 0; y < image->getHeight()/2; ++y) {
-                for(size_t x = 0; x < image->getWidth(); ++x) {
-                    std::vector<uint8_t> top_pixels = image->getPixel(x, y);
-                    std::vector<uint8_t> bottom_pixels = image->getPixel(x, image->getHeight() - y - 1);
-
-                    image->setPixel(x, y, bottom_pixels);
-                    image->setPixel(x, image->getHeight() - y - 1, top_pixels);
+            Scheduler::parallel_for(image->getHeight()/2, 2 * image->getWidth(), [image](size_t begin, size_t end) {
+                for(size_t y = begin; y < end; ++y) {
+                    auto top = image->row(y);
+                    std::swap_ranges(top.begin(), top.end(), image->row(image->getHeight() - y - 1).begin());
                 }
-            }
+            });
         }
         else
         {
@@ -388,6 +736,20 @@ namespace augmentorLib {
     }
 
 
+    template<typename Image>
+    bool FlipOperation<Image>::orient(typename Image::orientation_type& o, size_t, size_t) const {
+        typename Image::orientation_type flip;
+        if (type == HORIZONTAL) {
+            flip.flip_horizontal = true;
+        } else if (type == VERTICAL) {
+            flip.flip_vertical = true;
+        } else {
+            return false;
+        }
+        o = o.then(flip);
+        return true;
+    }
+
     // Below is the implementation
     template<typename Image>
     template<typename Container>
@@ -416,13 +778,38 @@ namespace augmentorLib {
             return image;
         }
         auto factor = Operation<Image>::uniform_random_number();
-        int height = (upper.height - lower.height) * factor + lower.height;
-        int width = (upper.width - lower.width) * factor + lower.width;
+        size_t height = (upper.height - lower.height) * factor + lower.height;
+        size_t width = (upper.width - lower.width) * factor + lower.width;
+        last = image_size{height, width};
 
-        image->resize(height, width);
+        if (height == image->getHeight() && width == image->getWidth()) {
+            Operation<Image>::unchanged();
+            return image;
+        }
+        image->resize(height, width, filter);
         return image;
     }
 
+    template<typename Image>
+    bool ResizeOperation<Image>::hint_decode(typename Image::decode_options_type& options) const {
+        if (!Operation<Image>::always_operates()) {
+            return false;
+        }
+        options.min_height = std::max(lower.height, upper.height);
+        options.min_width = std::max(lower.width, upper.width);
+        return true;
+    }
+
+    template<typename Image>
+    bool CropOperation<Image>::hint_decode(typename Image::decode_options_type& options) const {
+        if (!Operation<Image>::always_operates() || !center) {
+            return false;
+        }
+        options.crop_height = size.height;
+        options.crop_width = size.width;
+        return true;
+    }
+
     template<typename Image>
     Image *CropOperation<Image>::perform(Image *image) {;
         if (!Operation<Image>::operate_this_time()) {
@@ -432,6 +819,16 @@ namespace augmentorLib {
         int w = image->getWidth();
         int h = image->getHeight();
 
+        // already cropped, e.g. by the decoder
+        if (center && image->getWidth() == size.width && image->getHeight() == size.height) {
+            Operation<Image>::unchanged();
+            return image;
+        }
+
+
+        if (center && (size.width > image->getWidth() || size.height > image->getHeight())) {
+            throw std::out_of_range("Crop is larger than the image");
+        }
 
         Image temp(size.width, size.height);
         if (center){
@@ -456,10 +853,10 @@ namespace augmentorLib {
 //            }
 //            std::cout<<temp->getWidth()<<" "<<temp->getHeight()<<std::endl;
 
-            for(unsigned long i=left_offset, i1=0; i<left_offset+size.width; i++, i1++){
-                for(unsigned long  j=down_offset, j1=0; j<down_offset+size.height; j++, j1++){
-                    temp.setPixel(i1, j1, image->getPixel(i,j));
-                }
+            const Image& source = *image;
+            for(unsigned long j=down_offset, j1=0; j<down_offset+size.height; j++, j1++){
+                auto src = source.row(j);
+                std::copy(src[left_offset], src[left_offset + size.width], temp.row(j1).begin());
             }
 
         }
@@ -469,7 +866,7 @@ namespace augmentorLib {
 //            auto down_shift = Operation<Image>::uniform_random_number(0, h - size.height);
         }
 
-        *image = temp;
+        image->swap(temp);
         return image;
     }
 
@@ -481,6 +878,7 @@ namespace augmentorLib {
 
         double zoom_level = Operation<Image>::uniform_random_number(factor.min_factor, factor.max_factor);
         zoom_level = static_cast<float>(static_cast<int>(zoom_level * 10.)) / 10.;
+        last_level = zoom_level;
 
         int w = image->getWidth();
         int h = image->getHeight();
@@ -488,8 +886,12 @@ namespace augmentorLib {
         //TODO: int double issue - very sloow
         int w_zoomed = w*zoom_level;
         int h_zoomed = h*zoom_level;
+        if (w_zoomed == w && h_zoomed == h) {
+            Operation<Image>::unchanged();
+            return image;
+        }
 
-        image->resize(h_zoomed, w_zoomed);
+        image->resize(h_zoomed, w_zoomed, filter);
 
         auto operation = CropOperation<Image>(
                 image_size{static_cast<size_t>(h), static_cast<size_t>(w)}, true, 1
@@ -508,37 +910,56 @@ namespace augmentorLib {
 
 
         double rotate_degree = Operation<Image>::uniform_random_number(range.min_rotate, range.max_rotate);
+        last_degree = rotate_degree;
+        if (rotate_degree == 0) {
+            Operation<Image>::unchanged();
+            return image;
+        }
 
-        int w = image->getWidth();
-        int h = image->getHeight();
-        Image temp(w, h);
-
-        int hwidth = w / 2;
-        int hheight = h / 2;
-        double angle = rotate_degree * PI / 180.0;
-
-        for (int x = 0; x < w;x++) {
-
-            for (int y = 0; y < h;y++) {
-
-
-                int xt = x - hwidth;
-                int yt = y - hheight;
-
-
-                int xs = (int)round((cos(angle) * xt - sin(angle) * yt) + hwidth);
-                int ys = (int)round((sin(angle) * xt + cos(angle) * yt) + hheight);
-
+        size_t w = image->getWidth();
+        size_t h = image->getHeight();
+        auto pixel_size = image->getPixelSize();
+        // rows() writes every output pixel, zeroing those outside the rotated source, so no fill is needed
+        auto temp = Image::uninitialised(w, h, pixel_size, image->getColorSpace());
+        rotation rotate(rotate_degree, w, h, mode);
+        // read through the const overload: the source is only read, so a shared buffer must not be detached
+        const Image& original = *image;
+        sample_plane source{const_cast<uint8_t*>(original.getData()), original.getStride(), w * pixel_size, h};
+        sample_plane rotated{temp.getData(), temp.getStride(), w * pixel_size, h};
+
+        // output pixels are independent of each other, so rows of the output split into ranges
+        Scheduler::parallel_for(h, w, [&](size_t first, size_t last) {
+            rotate.rows(source, rotated, pixel_size, first, last);
+        });
+
+        image->swap(temp);
+        return image;
+    }
 
-                if (xs >= 0 && xs < w && ys >= 0 && ys < h){
-                    temp.setPixel(x, y, image->getPixel(xs, ys));
+    template<typename Image>
+    bool RotateOperation<Image>::orient(typename Image::orientation_type& o, size_t width, size_t height) const {
+        if (range.min_rotate != range.max_rotate || range.min_rotate % 90 != 0) {
+            return false;
+        }
+        typename Image::orientation_type rotation;
+        switch ((range.min_rotate % 360 + 360) % 360) {
+            case 0:
+                break;
+            case 180:
+                rotation.flip_horizontal = true;
+                rotation.flip_vertical = true;
+                break;
+            default:
+                if (width != height) {
+                    return false;
                 }
-
-            }
+                // perform() samples source (w - 1 - y, x) at 90° and (y, h - 1 - x) at 270°
+                rotation.transpose = true;
+                rotation.flip_vertical = range.min_rotate % 360 == 90 || range.min_rotate % 360 == -270;
+                rotation.flip_horizontal = !rotation.flip_vertical;
         }
-
-        *image = temp;
-        return image;
+        o = o.then(rotation);
+        return true;
     }
 
     template<typename Image>
@@ -547,110 +968,41 @@ namespace augmentorLib {
             return image;
         }
         // Invert image
-        for(size_t y = 0; y < image->getHeight(); y++) {
-            for(size_t x = 0; x < image->getWidth(); x++) {
-                std::vector<uint8_t> pixels = image->getPixel(x, y);
-
-                for(uint8_t &p: pixels){
+        (void) image->getData();
+        Scheduler::parallel_for(image->getHeight(), image->getWidth(), [image](size_t begin, size_t end) {
+            for(size_t y = begin; y < end; y++) {
+                for(uint8_t &p: image->row(y)){
                     p = 255-p;
                 }
-                image->setPixel(x,y,pixels);
             }
-        }
+        });
         return image;
     }
 
 
-    inline void convert2pixel(const std::vector<double>& src, std::vector<uint8_t>& target, size_t n) {
-        for (size_t i = 0; i < n; ++i) {
-            target[i] = src[i];
-        }
-    }
-
     template<typename Image, int Kernel>
     Image *GaussianBlurOperation<Image, Kernel>::perform(Image *image) {
         if (!Operation<Image>::operate_this_time()) {
             return image;
         }
-        auto kernel_size = filter.size();
         auto transient = Image(image->getWidth(), image->getHeight(), image->getPixelSize(), image->getColorSpace());
-        auto pixel_size = image->getPixelSize();
-        auto val = std::vector<double>(pixel_size);
-        auto new_pixel = std::vector<uint8_t>(pixel_size);
-
-        // convolute at height axis
-        for (size_t i = 0; i< image->getWidth(); ++i) {
-            for (size_t j = 0; j < image->getHeight(); ++j) {
-                std::fill(val.begin(), val.end(), 0);
-                long x0 = i - (kernel_size / 2);
-
-                for (size_t k = 0; k < kernel_size; ++k) {
-                    size_t x = std::min((size_t) std::max(x0++, 0l), image->getWidth() - 1);
-//                    std::cout << i << " " << kernel_size << " " << x0 << " " <<  x << " " << j << " " << image->getWidth() << std::endl;
-                    auto pixel = image->getPixel(x, j);
-                    for (size_t p = 0; p < pixel_size; ++p) {
-                        val[p] += pixel[p] * filter[k];
-                    }
-                }
-                convert2pixel(val, new_pixel, pixel_size);
-                transient.setPixel(i, j, new_pixel);
-            }
-        }
-
-        // convolute at width axis
-        for (size_t i = 0; i< image->getWidth(); ++i) {
-            for (size_t j = 0; j < image->getHeight(); ++j) {
-                std::fill(val.begin(), val.end(), 0);
-                long y0 = j - (kernel_size / 2);
-
-                for (size_t k = 0; k < kernel_size; ++k) {
-                    size_t y = std::min((size_t) std::max(y0++, 0l), image->getHeight() - 1);
-                    auto pixel = image->getPixel(i, y);
-                    for (size_t p = 0; p < pixel_size; ++p) {
-                        val[p] += pixel[p] * filter[k];
-                    }
-                }
-                convert2pixel(val, new_pixel, pixel_size);
-                image->setPixel(i, j, new_pixel);
-            }
-        }
+        auto row_samples = image->getWidth() * image->getPixelSize();
+        sample_plane source{image->getData(), image->getStride(), row_samples, image->getHeight()};
+        sample_plane blurred{transient.getData(), transient.getStride(), row_samples, transient.getHeight()};
+
+        // along x into transient, then along y back into the image; each pass splits into ranges of output rows,
+        // the vertical one reading its halo of rows from the whole of transient
+        auto pixels = image->getWidth() * kernel.size();
+        Scheduler::parallel_for(image->getHeight(), pixels, [&](size_t first, size_t last) {
+            kernel.convolve_rows(source, blurred, image->getPixelSize(), first, last);
+        });
+        Scheduler::parallel_for(image->getHeight(), pixels, [&](size_t first, size_t last) {
+            kernel.convolve_columns(blurred, source, first, last);
+        });
 
         return image;
     }
 
-    struct accumulator {
-        typedef uint64_t _datatype;
-        std::vector<_datatype> values;
-
-        explicit accumulator(size_t n): values(n) {}
-
-        template <typename Value>
-        inline void add(std::vector<Value>&& val) {
-            for (size_t i = 0; i < values.size(); ++i) {
-                values[i] += val[i];
-            }
-
-        }
-
-        template <typename Value>
-        inline void shift(std::vector<Value>&& del, std::vector<Value>&& add) {
-            for (size_t i = 0; i < values.size(); ++i) {
-                values[i] += add[i];
-                values[i] -= del[i];
-            }
-
-        }
-
-        template <typename ReturnType=u_int8_t >
-        inline std::vector<ReturnType> div(_datatype denominator) {
-            std::vector<ReturnType> res(values.size());
-            for (size_t i = 0; i < values.size(); ++i) {
-                res[i] = values[i] / denominator;
-            }
-            return res;
-        }
-    };
-
     template<typename Image>
     Image *BoxBlurOperation<Image>::perform(Image *image) {
         if (!Operation<Image>::operate_this_time()) {
@@ -658,60 +1010,94 @@ namespace augmentorLib {
         }
 
         auto transient = Image(image->getWidth(), image->getHeight(), image->getPixelSize(), image->getColorSpace());
-        auto pixel_size = image->getPixelSize();
-
-        for (size_t i = 0; i< image->getWidth(); ++i) {
-            auto acc = accumulator(pixel_size);
+        auto row_samples = image->getWidth() * image->getPixelSize();
+        sample_plane source{image->getData(), image->getStride(), row_samples, image->getHeight()};
+        sample_plane blurred{transient.getData(), transient.getStride(), row_samples, transient.getHeight()};
+        box_filter box(filter.length);
+
+        // along y into transient, then along x back into the image, both in ranges of output rows
+        Scheduler::parallel_for(image->getHeight(), image->getWidth(), [&](size_t first, size_t last) {
+            box.filter_columns(source, blurred, first, last);
+        });
+        Scheduler::parallel_for(image->getHeight(), image->getWidth(), [&](size_t first, size_t last) {
+            box.filter_rows(blurred, source, image->getPixelSize(), first, last);
+        });
 
-            long y0 = -(filter.length / 2);
-            for (size_t k = 0; k < filter.length; ++k) {
-                size_t y = std::min((size_t) std::max(y0++, 0l), image->getHeight() - 1);
-                acc.add(image->getPixel(i, y));
-                transient.setPixel(i, 0, acc.div(filter.length));
-            }
+        return image;
+    }
 
-            long y_del = -(filter.length / 2);
-            size_t y_add = (filter.length / 2) + 1;
-            for (size_t j = 1; j < image->getHeight(); ++j) {
-                size_t prev = std::max(y_del++, 0l);
-                size_t next = std::min(y_add++, image->getHeight() - 1);
-                acc.shift(image->getPixel(i, prev), image->getPixel(i, next));
-                transient.setPixel(i, j, acc.div(filter.length));
-            }
+    template<typename Image>
+    Image* FastGaussianBlurOperation<Image>::perform(Image *image) {
+        if (!Operation<Image>::operate_this_time()) {
+            return image;
         }
-
-        for (size_t j = 0; j< image->getHeight(); ++j) {
-            auto acc = accumulator(pixel_size);
-
-            long x0 = -(filter.length / 2);
-            for (size_t k = 0; k < filter.length; ++k) {
-                size_t x = std::min((size_t) std::max(x0++, 0l), image->getWidth() - 1);
-                acc.add(transient.getPixel(x, j));
-                image->setPixel(0, j, acc.div(filter.length));
-            }
-
-            long x_del = -(filter.length / 2);
-            size_t x_add = (filter.length / 2) + 1;
-            for (size_t i = 1; i < image->getWidth(); ++i) {
-                size_t prev = std::max(x_del++, 0l);
-                size_t next = std::min(x_add++, image->getWidth() - 1);
-                acc.shift(transient.getPixel(prev, j), transient.getPixel(next, j));
-                image->setPixel(i, j, acc.div(filter.length));
-
+        if (mode == box_blur_mode::SLIDING) {
+            for (auto operation : box_blur_operations) {
+                image = operation.perform(image);
             }
+            return image;
         }
 
+        // every pass reads a table of the image as the previous pass left it; the table is sized once, for the
+        // widest box, and filled anew for each pass
+        auto pixel_size = image->getPixelSize();
+        sample_plane plane{image->getData(), image->getStride(), image->getWidth() * pixel_size, image->getHeight()};
+        if (lengths.empty()) {
+            return image;
+        }
+        size_t margin = *std::max_element(lengths.begin(), lengths.end()) / 2;
+        for (size_t length : lengths) {
+            integral.reset(plane, pixel_size, margin);
+            Scheduler::parallel_for(integral.rows(), image->getWidth(), [&](size_t first, size_t last) {
+                integral.sum_rows(first, last);
+            });
+            auto strip_pixels = integral.rows() * image->getWidth() / integral.strips();
+            Scheduler::parallel_for(integral.strips(), strip_pixels, [&](size_t first, size_t last) {
+                integral.sum_columns(first, last);
+            });
+            Scheduler::parallel_for(image->getHeight(), image->getWidth(), [&](size_t first, size_t last) {
+                integral.box(plane, length, first, last);
+            });
+        }
         return image;
     }
 
     template<typename Image>
-    Image* FastGaussianBlurOperation<Image>::perform(Image *image) {
+    blur_backend BlurOperation<Image>::choose(double sigma, size_t width, size_t height) {
+        // crossovers of the "blur" benchmark section: the kernel wins up to 13 taps on small images and up to 19 on
+        // large ones, where the recursion's float lines no longer stay in cache
+        auto taps = 2 * std::ceil(3 * sigma) + 1;
+        auto longest = width * height >= (size_t{2} << 20) ? 19 : 13;
+        return sigma < 0.5 || taps <= longest ? blur_backend::FIR : blur_backend::IIR;
+    }
+
+    template<typename Image>
+    Image* BlurOperation<Image>::perform(Image *image) {
         if (!Operation<Image>::operate_this_time()) {
             return image;
         }
-        for (auto operation : box_blur_operations) {
-            image = operation.perform(image);
+        last = backend == blur_backend::AUTO ? choose(sigma, image->getWidth(), image->getHeight()) : backend;
+        switch (last) {
+            case blur_backend::FIR:
+                return fir.perform(image);
+            case blur_backend::BOX:
+                return box.perform(image);
+            default:
+                break;
         }
+
+        auto transient = Image(image->getWidth(), image->getHeight(), image->getPixelSize(), image->getColorSpace());
+        auto row_samples = image->getWidth() * image->getPixelSize();
+        sample_plane source{image->getData(), image->getStride(), row_samples, image->getHeight()};
+        sample_plane filtered{transient.getData(), transient.getStride(), row_samples, transient.getHeight()};
+        // rows are independent along x; along y every strip of columns runs down and up all the rows
+        Scheduler::parallel_for(image->getHeight(), image->getWidth(), [&](size_t first, size_t last) {
+            iir->filter_rows(source, filtered, image->getPixelSize(), first, last);
+        });
+        auto strip_pixels = recursive_gaussian::strip_width / image->getPixelSize() * image->getHeight();
+        Scheduler::parallel_for(recursive_gaussian::strips(filtered), strip_pixels, [&](size_t first, size_t last) {
+            iir->filter_columns(filtered, source, first, last);
+        });
         return image;
     }
 
@@ -737,18 +1123,26 @@ namespace augmentorLib {
                 (size_t) ((upper_erase_size.width - lower_erase_size.width) * factor) + lower_erase_size.width
         };
 
+        if (erase_size.height == 0 || erase_size.width == 0) {
+            last_size = erase_size;
+            Operation<Image>::unchanged();
+            return image;
+        }
+
         auto top = xy_generator() % (image->getHeight() - erase_size.height + 1);
         auto left = xy_generator() % (image->getWidth() - erase_size.width + 1);
+        last_size = erase_size;
+        last_left = left;
+        last_top = top;
 
         auto pixel_size = image->getPixelSize();
-        auto new_pixel = std::vector<RandomEraseOperation::pixel_value_type>(pixel_size);
 
-        for (size_t i = left; i < left + erase_size.width; ++i) {
-            for (size_t j = top; j < top + erase_size.height; ++j) {
+        for (size_t j = top; j < top + erase_size.height; ++j) {
+            auto row = image->row(j);
+            for (auto p = row[left]; p != row[left + erase_size.width]; p += pixel_size) {
                 for (size_t k = 0; k < pixel_size; ++k) {
-                    new_pixel[k] = noise_generator();
+                    p[k] = noise_generator();
                 }
-                image->setPixel(i, j, new_pixel);
             }
         }
 
@@ -0,0 +1,613 @@
+#include "OutputSink.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+
+using jpegimageSTL::jpeg::Image;
+using jpegimageSTL::jpeg::encode_options;
+
+namespace fs = std::filesystem;
+
+namespace augmentorLib {
+
+    namespace {
+        const char RECORD_MAGIC[4] = {'A', 'U', 'G', 'R'};
+        const char INDEX_MAGIC[4] = {'A', 'U', 'G', 'I'};
+        const uint32_t INDEX_VERSION = 1;
+        const size_t RECORD_HEADER_SIZE = 16;
+        const size_t INDEX_HEADER_SIZE = 12;
+        const size_t INDEX_ENTRY_SIZE = 24;
+
+        void put_u32(std::vector<uint8_t>& out, uint32_t value) {
+            for (int i = 0; i < 4; ++i) {
+                out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+            }
+        }
+
+        void put_u64(std::vector<uint8_t>& out, uint64_t value) {
+            for (int i = 0; i < 8; ++i) {
+                out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+            }
+        }
+
+        uint64_t get_le(const uint8_t* in, int bytes) {
+            uint64_t value = 0;
+            for (int i = 0; i < bytes; ++i) {
+                value |= static_cast<uint64_t>(in[i]) << (8 * i);
+            }
+            return value;
+        }
+
+        void write_all(int fd, const uint8_t* data, size_t size, const std::string& path) {
+            while (size > 0) {
+                ssize_t written = ::write(fd, data, size);
+                if (written < 0) {
+                    throw std::runtime_error("Could not write " + path);
+                }
+                data += written;
+                size -= static_cast<size_t>(written);
+            }
+        }
+
+        void write_file(const std::string& path, const uint8_t* data, size_t size) {
+            int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                throw std::runtime_error("Could not open " + path + " for writing");
+            }
+            try {
+                write_all(fd, data, size, path);
+            } catch (...) {
+                ::close(fd);
+                throw;
+            }
+            ::close(fd);
+        }
+
+        std::vector<uint8_t> read_file(const std::string& path) {
+            std::ifstream file(path, std::ios::binary);
+            if (!file) {
+                throw std::runtime_error("Could not open " + path);
+            }
+            return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        }
+
+        /// Copies the file at from to to byte for byte
+        void copy_source(const std::string& from, const std::string& to, passthrough_mode mode) {
+            std::error_code ec;
+            fs::remove(to, ec);
+            if (mode == passthrough_mode::HARDLINK) {
+                fs::create_hard_link(from, to, ec);
+                if (!ec) {
+                    return;
+                }
+            }
+#ifdef __linux__
+            // copy_file_range keeps the bytes in the kernel, and shares extents on filesystems that can
+            int in = ::open(from.c_str(), O_RDONLY);
+            if (in < 0) {
+                throw std::runtime_error("Could not open " + from);
+            }
+            int out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (out < 0) {
+                ::close(in);
+                throw std::runtime_error("Could not open " + to + " for writing");
+            }
+            struct stat st{};
+            ::fstat(in, &st);
+            auto remaining = static_cast<size_t>(st.st_size);
+            ssize_t copied = 1;
+            while (remaining > 0 && (copied = ::copy_file_range(in, nullptr, out, nullptr, remaining, 0)) > 0) {
+                remaining -= static_cast<size_t>(copied);
+            }
+            ::close(in);
+            ::close(out);
+            if (remaining == 0) {
+                return;
+            }
+            // not supported between these filesystems, copy in user space below
+#endif
+            fs::copy_file(from, to, fs::copy_options::overwrite_existing);
+        }
+
+        /// Writes the data of the file at path back to disk
+        void sync_file(const std::string& path) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Could not open " + path);
+            }
+#ifdef __linux__
+            int result = ::fdatasync(fd);
+#else
+            int result = ::fsync(fd);
+#endif
+            ::close(fd);
+            if (result != 0) {
+                throw std::runtime_error("Could not sync " + path);
+            }
+        }
+
+        /// Writes the entries of directory back to disk, e.g. the names of files created or renamed in it
+        void sync_directory(const std::string& directory) {
+            int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+            if (fd < 0) {
+                throw std::runtime_error("Could not open " + directory);
+            }
+            int result = ::fsync(fd);
+            ::close(fd);
+            if (result != 0) {
+                throw std::runtime_error("Could not sync " + directory);
+            }
+        }
+
+        std::string json_string(const std::string& value) {
+            std::string out = "\"";
+            for (char c : value) {
+                switch (c) {
+                    case '"': out += "\\\""; break;
+                    case '\\': out += "\\\\"; break;
+                    case '\n': out += "\\n"; break;
+                    case '\t': out += "\\t"; break;
+                    default:
+                        if (static_cast<unsigned char>(c) < 0x20) {
+                            char escaped[8];
+                            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                            out += escaped;
+                        } else {
+                            out += c;
+                        }
+                }
+            }
+            return out + "\"";
+        }
+
+        std::string metadata_json(const sample_record& record) {
+            std::string out = "{\"index\":" + std::to_string(record.index) + ",\"source\":" + json_string(record.source) +
+                              ",\"operations\":[";
+            for (size_t i = 0; i < record.operations.size(); ++i) {
+                out += (i ? "," : "") + json_string(record.operations[i]);
+            }
+            return out + "]}";
+        }
+
+        /// NumPy's type string of an element
+        std::string numpy_descr(tensor_dtype dtype) {
+            if (dtype == tensor_dtype::UINT8) {
+                return "|u1";
+            }
+            const uint16_t probe = 1;
+            return *reinterpret_cast<const uint8_t*>(&probe) ? "<f4" : ">f4";
+        }
+
+        /// The shape of a batch of n samples as a list of its dimensions
+        std::vector<size_t> batch_shape(const tensor_options& options, size_t n) {
+            if (options.layout == tensor_layout::NHWC) {
+                return {n, options.height, options.width, options.channels};
+            }
+            return {n, options.channels, options.height, options.width};
+        }
+
+        /// Version 1.0 .npy header, padded so the data starts 64-byte aligned
+        std::string npy_header(const tensor_options& options, size_t n) {
+            std::string shape;
+            for (auto dimension : batch_shape(options, n)) {
+                shape += std::to_string(dimension) + ", ";
+            }
+            std::string dict = "{'descr': '" + numpy_descr(options.dtype) + "', 'fortran_order': False, 'shape': (" +
+                               shape.substr(0, shape.size() - 2) + "), }";
+            const size_t preamble = 10;
+            size_t length = (preamble + dict.size() + 1 + 63) / 64 * 64 - preamble;
+            dict.append(length - dict.size() - 1, ' ');
+            dict += '\n';
+            std::string header = "\x93NUMPY";
+            header += '\x01';
+            header += '\x00';
+            header += static_cast<char>(length & 0xff);
+            header += static_cast<char>(length >> 8);
+            return header + dict;
+        }
+
+        /// Copies one row of interleaved components into its place in the batch, reordered and converted
+        /// \param out the sample's first element in the batch
+        /// \param lookup FLOAT32 only: 256 values per channel
+        template<typename T>
+        void copy_row(const uint8_t* row, size_t y, T* out, const tensor_options& options, const float* lookup) {
+            const size_t w = options.width;
+            const size_t c = options.channels;
+            auto convert = [lookup](uint8_t value, size_t channel) -> T {
+                if constexpr (std::is_same_v<T, float>) {
+                    return lookup[channel * 256 + value];
+                } else {
+                    (void)channel;
+                    return value;
+                }
+            };
+            if (options.layout == tensor_layout::NHWC) {
+                out += y * w * c;
+                if constexpr (std::is_same_v<T, uint8_t>) {
+                    std::memcpy(out, row, w * c);
+                } else {
+                    for (size_t x = 0; x < w * c; x += c) {
+                        for (size_t k = 0; k < c; ++k) {
+                            out[x + k] = convert(row[x + k], k);
+                        }
+                    }
+                }
+                return;
+            }
+            // one pass per plane keeps every store sequential
+            const size_t plane = options.height * w;
+            for (size_t k = 0; k < c; ++k) {
+                T* dst = out + k * plane + y * w;
+                const uint8_t* src = row + k;
+                for (size_t x = 0; x < w; ++x) {
+                    dst[x] = convert(src[x * c], k);
+                }
+            }
+        }
+    }
+
+    DirectorySink::DirectorySink(std::string directory, directory_options options):
+            directory{std::move(directory)}, options{options} {}
+
+    DirectorySink::~DirectorySink() {
+        try {
+            flush();
+        } catch (const std::exception&) {
+            // nothing to report to from a destructor; flush() surfaces sync errors
+        }
+    }
+
+    std::string DirectorySink::path(size_t index) const {
+        auto out = directory;
+        if (options.fan_out > 0) {
+            // every name of a level has as many hex digits as the largest
+            size_t digits = 1;
+            for (size_t n = options.fan_out - 1; n > 15; n >>= 4) {
+                ++digits;
+            }
+            size_t leaf = index;
+            for (size_t l = 0; l < options.levels; ++l) {
+                auto sub = leaf % options.fan_out;
+                for (size_t d = digits; d-- > 0;) {
+                    out += "0123456789abcdef"[(sub >> (4 * d)) & 0xf];
+                }
+                out += '/';
+                leaf /= options.fan_out;
+            }
+        }
+        return out + "output_" + std::to_string(index) + ".jpg";
+    }
+
+    std::string DirectorySink::prepare(size_t index) {
+        auto target = path(index);
+        if (options.fan_out > 0) {
+            auto parent = fs::path(target).parent_path().string();
+            if (created.insert(parent).second) {
+                fs::create_directories(parent);
+            }
+        }
+        return target;
+    }
+
+    void DirectorySink::write(const sample_record& record, const std::vector<uint8_t>& bytes) {
+        auto target = prepare(record.index);
+        write_file(options.atomic ? target + ".tmp" : target, bytes.data(), bytes.size());
+        commit(target);
+    }
+
+    void DirectorySink::write_source(const sample_record& record, passthrough_mode mode) {
+        auto target = prepare(record.index);
+        copy_source(record.source, options.atomic ? target + ".tmp" : target, mode);
+        commit(target);
+    }
+
+    void DirectorySink::commit(const std::string& target) {
+        if (options.sync_every > 0) {
+            // an atomic file is renamed only after its data is on disk, so a crash never leaves a truncated file
+            // under the name
+            batch.push_back(target);
+            if (batch.size() >= options.sync_every) {
+                sync();
+            }
+        } else if (options.atomic) {
+            fs::rename(target + ".tmp", target);
+        }
+    }
+
+    void DirectorySink::flush() {
+        if (!batch.empty()) {
+            sync();
+        }
+    }
+
+    void DirectorySink::sync() {
+        // only this batch's files, not the whole filesystem, which other writers may share
+        for (const auto& target : batch) {
+            sync_file(options.atomic ? target + ".tmp" : target);
+        }
+        std::unordered_set<std::string> directories;
+        for (const auto& target : batch) {
+            if (options.atomic) {
+                fs::rename(target + ".tmp", target);
+            }
+            auto parent = fs::path(target).parent_path().string();
+            directories.insert(parent.empty() ? "." : parent);
+        }
+        // new names are durable once their directories are
+        for (const auto& written : directories) {
+            sync_directory(written);
+        }
+        batch.clear();
+    }
+
+    ShardSink::ShardSink(std::string directory, shard_options options):
+            directory{std::move(directory)}, options{std::move(options)} {
+        fs::create_directories(this->directory);
+        buffer.reserve(this->options.write_buffer_bytes);
+    }
+
+    ShardSink::~ShardSink() {
+        try {
+            close_shard();
+        } catch (const std::exception&) {
+            // nothing to report to from a destructor; flush() surfaces write errors
+        }
+    }
+
+    void ShardSink::write(const sample_record& record, const std::vector<uint8_t>& bytes) {
+        append(record, bytes.data(), bytes.size());
+    }
+
+    void ShardSink::write_source(const sample_record& record, passthrough_mode) {
+        auto bytes = read_file(record.source);
+        append(record, bytes.data(), bytes.size());
+    }
+
+    void ShardSink::append(const sample_record& record, const uint8_t* data, size_t size) {
+        auto metadata = metadata_json(record);
+        uint64_t record_size = RECORD_HEADER_SIZE + metadata.size() + size;
+        if (fd >= 0 && shard_size > 0 && shard_size + record_size > options.max_shard_bytes) {
+            close_shard();
+        }
+        if (fd < 0) {
+            open_shard();
+        }
+
+        entries.push_back(shard_entry{shard_size, size, static_cast<uint32_t>(metadata.size())});
+        buffer.insert(buffer.end(), RECORD_MAGIC, RECORD_MAGIC + 4);
+        put_u32(buffer, static_cast<uint32_t>(metadata.size()));
+        put_u64(buffer, size);
+        buffer.insert(buffer.end(), metadata.begin(), metadata.end());
+        buffer.insert(buffer.end(), data, data + size);
+        shard_size += record_size;
+        if (buffer.size() >= options.write_buffer_bytes) {
+            write_buffer();
+        }
+    }
+
+    void ShardSink::open_shard() {
+        char number[16];
+        std::snprintf(number, sizeof(number), "-%05zu", shard_paths.size());
+        auto path = (fs::path(directory) / (options.prefix + number + ".shard")).string();
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path + " for writing");
+        }
+        shard_paths.push_back(path);
+        shard_size = 0;
+        entries.clear();
+    }
+
+    void ShardSink::write_buffer() {
+        write_all(fd, buffer.data(), buffer.size(), shard_paths.back());
+        buffer.clear();
+    }
+
+    void ShardSink::write_index() const {
+        std::vector<uint8_t> index;
+        index.reserve(INDEX_HEADER_SIZE + entries.size() * INDEX_ENTRY_SIZE);
+        index.insert(index.end(), INDEX_MAGIC, INDEX_MAGIC + 4);
+        put_u32(index, INDEX_VERSION);
+        put_u32(index, static_cast<uint32_t>(entries.size()));
+        for (const auto& e : entries) {
+            put_u64(index, e.offset);
+            put_u64(index, e.data_size);
+            put_u32(index, e.metadata_size);
+            put_u32(index, 0);
+        }
+        // readers only ever see a complete index
+        auto path = ShardReader::index_path(shard_paths.back());
+        write_file(path + ".tmp", index.data(), index.size());
+        fs::rename(path + ".tmp", path);
+    }
+
+    void ShardSink::flush() {
+        if (fd < 0) {
+            return;
+        }
+        write_buffer();
+        write_index();
+    }
+
+    void ShardSink::close_shard() {
+        if (fd < 0) {
+            return;
+        }
+        flush();
+        ::close(fd);
+        fd = -1;
+    }
+
+    TensorSink::TensorSink(std::string directory, tensor_options options):
+            directory{std::move(directory)}, options{std::move(options)} {
+        const auto& o = this->options;
+        if (o.batch_size == 0 || o.height == 0 || o.width == 0 || o.channels == 0 || o.channels > o.mean.size()) {
+            throw std::invalid_argument("Tensor batches need a batch size, a height, a width and 1 to 4 channels");
+        }
+        size_t element = o.dtype == tensor_dtype::FLOAT32 ? sizeof(float) : 1;
+        sample_bytes = o.height * o.width * o.channels * element;
+        if (o.dtype == tensor_dtype::FLOAT32) {
+            lookup.resize(o.channels * 256);
+            for (size_t k = 0; k < o.channels; ++k) {
+                for (int v = 0; v < 256; ++v) {
+                    lookup[k * 256 + v] = (static_cast<float>(v) * o.scale - o.mean[k]) / o.std[k];
+                }
+            }
+        }
+        fs::create_directories(this->directory);
+        batch.resize(o.batch_size * sample_bytes);
+        records.reserve(o.batch_size);
+    }
+
+    TensorSink::~TensorSink() {
+        try {
+            flush();
+        } catch (const std::exception&) {
+            // nothing to report to from a destructor; flush() surfaces write errors
+        }
+    }
+
+    void TensorSink::write(const sample_record& record, const std::vector<uint8_t>& bytes) {
+        const Image image(bytes.data(), bytes.size());
+        write_image(record, image, encode_options{});
+    }
+
+    void TensorSink::write_source(const sample_record& record, passthrough_mode) {
+        const Image image(record.source);
+        write_image(record, image, encode_options{});
+    }
+
+    void TensorSink::write_image(const sample_record& record, const Image& image, const encode_options&) {
+        if (image.getHeight() != options.height || image.getWidth() != options.width ||
+            image.getPixelSize() != options.channels) {
+            throw std::invalid_argument("Sample " + std::to_string(record.index) + " is " +
+                                        std::to_string(image.getHeight()) + "x" + std::to_string(image.getWidth()) +
+                                        "x" + std::to_string(image.getPixelSize()) + ", tensor batches take " +
+                                        std::to_string(options.height) + "x" + std::to_string(options.width) + "x" +
+                                        std::to_string(options.channels));
+        }
+        uint8_t* out = batch.data() + records.size() * sample_bytes;
+        for (size_t y = 0; y < options.height; ++y) {
+            if (options.dtype == tensor_dtype::FLOAT32) {
+                copy_row(image.getRow(y), y, reinterpret_cast<float*>(out), options, lookup.data());
+            } else {
+                copy_row(image.getRow(y), y, out, options, nullptr);
+            }
+        }
+        records.push_back(metadata_json(record));
+        if (records.size() == options.batch_size) {
+            write_batch();
+        }
+    }
+
+    void TensorSink::flush() {
+        if (!records.empty()) {
+            write_batch();
+        }
+    }
+
+    void TensorSink::write_batch() {
+        char number[16];
+        std::snprintf(number, sizeof(number), "-%05zu", batch_paths.size());
+        auto base = (fs::path(directory) / (options.prefix + number)).string();
+        auto path = base + (options.format == tensor_format::NPY ? ".npy" : ".raw");
+
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path + " for writing");
+        }
+        try {
+            if (options.format == tensor_format::NPY) {
+                auto header = npy_header(options, records.size());
+                write_all(fd, reinterpret_cast<const uint8_t*>(header.data()), header.size(), path);
+            }
+            write_all(fd, batch.data(), records.size() * sample_bytes, path);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+
+        std::string shape;
+        for (auto dimension : batch_shape(options, records.size())) {
+            shape += (shape.empty() ? "" : ",") + std::to_string(dimension);
+        }
+        std::string json = "{\"shape\":[" + shape + "],\"dtype\":\"" +
+                           (options.dtype == tensor_dtype::FLOAT32 ? "float32" : "uint8") + "\",\"layout\":\"" +
+                           (options.layout == tensor_layout::NHWC ? "NHWC" : "NCHW") + "\",\"samples\":[";
+        for (size_t i = 0; i < records.size(); ++i) {
+            json += (i ? "," : "") + records[i];
+        }
+        json += "]}";
+        write_file(base + ".json", reinterpret_cast<const uint8_t*>(json.data()), json.size());
+
+        batch_paths.push_back(path);
+        records.clear();
+    }
+
+    std::string ShardReader::index_path(const std::string& path) {
+        return fs::path(path).replace_extension(".index").string();
+    }
+
+    ShardReader::ShardReader(const std::string& path) {
+        auto index = read_file(index_path(path));
+        if (index.size() < INDEX_HEADER_SIZE || std::memcmp(index.data(), INDEX_MAGIC, 4) != 0 ||
+            get_le(index.data() + 4, 4) != INDEX_VERSION) {
+            throw std::runtime_error(index_path(path) + " is not a shard index");
+        }
+        auto count = get_le(index.data() + 8, 4);
+        if (index.size() < INDEX_HEADER_SIZE + count * INDEX_ENTRY_SIZE) {
+            throw std::runtime_error(index_path(path) + " is truncated");
+        }
+        entries.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            const uint8_t* e = index.data() + INDEX_HEADER_SIZE + i * INDEX_ENTRY_SIZE;
+            entries.push_back(shard_entry{get_le(e, 8), get_le(e + 8, 8), static_cast<uint32_t>(get_le(e + 16, 4))});
+        }
+
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path);
+        }
+    }
+
+    ShardReader::~ShardReader() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    void ShardReader::read_at(uint64_t offset, uint8_t* data, size_t size) const {
+        while (size > 0) {
+            ssize_t n = ::pread(fd, data, size, static_cast<off_t>(offset));
+            if (n <= 0) {
+                throw std::runtime_error("Shard is truncated");
+            }
+            data += n;
+            offset += static_cast<uint64_t>(n);
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+    std::string ShardReader::metadata(size_t i) const {
+        const auto& e = entry(i);
+        std::string metadata(e.metadata_size, '\0');
+        read_at(e.offset + RECORD_HEADER_SIZE, reinterpret_cast<uint8_t*>(metadata.data()), metadata.size());
+        return metadata;
+    }
+
+    std::vector<uint8_t> ShardReader::read(size_t i) const {
+        const auto& e = entry(i);
+        std::vector<uint8_t> bytes(e.data_size);
+        read_at(e.offset + RECORD_HEADER_SIZE + e.metadata_size, bytes.data(), bytes.size());
+        return bytes;
+    }
+}
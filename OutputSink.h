@@ -0,0 +1,317 @@
+#ifndef LIB_OUTPUTSINK_H
+#define LIB_OUTPUTSINK_H
+
+#include "jpeg.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace augmentorLib {
+
+    /// How sample() writes a source no operation changed
+    enum class passthrough_mode {
+        /// decode and re-encode it like any other sample
+        DISABLED,
+        /// copy the source file's bytes, in the kernel where the platform allows
+        COPY,
+        /// hard link the output to the source file, falling back to a copy across filesystems
+        HARDLINK
+    };
+
+    /// What a sink records about a sample besides its bytes
+    struct sample_record {
+        /// Position of the sample within its sample() call
+        size_t index = 0;
+        /// Path of the source file
+        std::string source;
+        /// describe() of every operation that changed the sample, in pipeline order
+        std::vector<std::string> operations;
+    };
+
+    /// Where sample() puts its outputs
+    ///
+    /// sample() never calls into a sink from two threads at once, so sinks need no locking of their own.
+    class OutputSink {
+    public:
+        virtual ~OutputSink() = default;
+
+        /// Writes one encoded sample
+        /// \param record what the sample is
+        /// \param bytes the JPEG stream
+        virtual void write(const sample_record& record, const std::vector<uint8_t>& bytes) = 0;
+
+        /// Writes a sample whose bytes are exactly those of its source file
+        /// \param record what the sample is
+        /// \param mode how a sink keeping one file per sample may reproduce the source
+        virtual void write_source(const sample_record& record, passthrough_mode mode) = 0;
+
+        /// Writes one decoded sample; encodes it and passes the stream to write() unless the sink takes pixels.
+        /// sample() only calls it on sinks that do not keep JPEG, others get the stream encoded outside the sink.
+        /// \param record what the sample is
+        /// \param image the sample's pixels
+        /// \param options encoder settings of the output
+        virtual void write_image(const sample_record& record, const jpegimageSTL::jpeg::Image& image,
+                                 const jpegimageSTL::jpeg::encode_options& options) {
+            write(record, image.encode(options));
+        }
+
+        /// Whether the sink stores JPEG streams. When it does not, sample() never copies sources or transforms
+        /// them in the DCT domain, and hands every sample to write_image() decoded.
+        [[nodiscard]] virtual bool keeps_jpeg() const { return true; }
+
+        /// Makes everything written so far complete on disk, e.g. the index of the current shard
+        virtual void flush() {}
+    };
+
+    /// Settings of a DirectorySink
+    struct directory_options {
+        /// Subdirectories per level, named in hex; sample j goes to j % fan_out, then (j / fan_out) % fan_out, ...
+        /// 0 puts every file directly in the directory
+        size_t fan_out = 0;
+        /// Levels of subdirectories when fan_out is set, e.g. 2 levels of 256 hold 16M files at ~256 per directory
+        size_t levels = 1;
+        /// Write each file under a temporary name and rename it into place, so it is never seen half written. Costs
+        /// a rename per file, and a crash can leave `.tmp` files behind.
+        bool atomic = false;
+        /// Make the files durable every this many samples and on flush(): an fdatasync per file of the batch, then
+        /// an fsync per subdirectory it wrote to; 0 leaves write back to the OS. With atomic, a batch's files only
+        /// appear under their names once synced.
+        size_t sync_every = 0;
+    };
+
+    /// One JPEG file per sample, `output_<index>.jpg` in a directory or, with a fan out, in its subdirectories
+    class DirectorySink: public OutputSink {
+    public:
+        /// \param directory output directory, ending in a path separator
+        /// \param options subdirectory layout and durability
+        explicit DirectorySink(std::string directory, directory_options options = directory_options{});
+
+        ~DirectorySink() override;
+
+        DirectorySink(const DirectorySink&) = delete;
+        DirectorySink& operator=(const DirectorySink&) = delete;
+
+        void write(const sample_record& record, const std::vector<uint8_t>& bytes) override;
+
+        void write_source(const sample_record& record, passthrough_mode mode) override;
+
+        /// Syncs and renames the files of the current batch when sync_every is set
+        void flush() override;
+
+        /// Path the sample with the given index is written to
+        [[nodiscard]] std::string path(size_t index) const;
+
+    private:
+        /// Creates the subdirectory of the sample when it is the first one there
+        /// \return the sample's path
+        std::string prepare(size_t index);
+        /// Moves a file written to the temporary name of path into place, now or with its batch
+        void commit(const std::string& path);
+        void sync();
+
+        std::string directory;
+        directory_options options;
+        // subdirectories created so far
+        std::unordered_set<std::string> created;
+        // files written since the last sync, by final path; atomic ones still have their temporary name
+        std::vector<std::string> batch;
+    };
+
+    /// Settings of a ShardSink
+    struct shard_options {
+        /// A shard is closed before a record would take it past this size; a single larger record gets a shard alone
+        size_t max_shard_bytes = size_t(1) << 30;
+        /// Records are gathered in memory and written in chunks of this size
+        size_t write_buffer_bytes = size_t(8) << 20;
+        /// File names are <prefix>-<number>.shard and <prefix>-<number>.index
+        std::string prefix = "shard";
+    };
+
+    /// One record of a shard's index
+    struct shard_entry {
+        /// Offset of the record in the shard
+        uint64_t offset;
+        /// Bytes of the JPEG stream
+        uint64_t data_size;
+        /// Bytes of the JSON metadata
+        uint32_t metadata_size;
+    };
+
+    /// Packs samples into a few large shard files
+    ///
+    /// A shard is a sequence of records, each a 16 byte header ("AUGR", metadata size as u32, data size as u64, both
+    /// little endian), the metadata as a JSON object {"index", "source", "operations"}, then the JPEG bytes.
+    /// Next to it, the index is a header ("AUGI", version and record count as u32) followed by one fixed size
+    /// entry per record (offset and data size as u64, metadata size as u32, 4 bytes padding), so record i can be
+    /// found with one seek. Shards only grow by large sequential writes; the index is rewritten on flush().
+    class ShardSink: public OutputSink {
+    public:
+        /// \param directory directory to create the shards in
+        /// \param options shard size and write buffering
+        explicit ShardSink(std::string directory, shard_options options = shard_options{});
+
+        ~ShardSink() override;
+
+        ShardSink(const ShardSink&) = delete;
+        ShardSink& operator=(const ShardSink&) = delete;
+
+        void write(const sample_record& record, const std::vector<uint8_t>& bytes) override;
+
+        /// Reads the source file into a record; shards hold bytes, never links
+        void write_source(const sample_record& record, passthrough_mode mode) override;
+
+        void flush() override;
+
+        /// Paths of the shards written so far
+        [[nodiscard]] const std::vector<std::string>& shards() const { return shard_paths; }
+
+    private:
+        void append(const sample_record& record, const uint8_t* data, size_t size);
+        void open_shard();
+        void close_shard();
+        void write_buffer();
+        void write_index() const;
+
+        std::string directory;
+        shard_options options;
+        std::vector<std::string> shard_paths;
+        int fd = -1;
+        // bytes of the current shard, written or buffered
+        uint64_t shard_size = 0;
+        std::vector<uint8_t> buffer;
+        std::vector<shard_entry> entries;
+    };
+
+    /// Memory order of a TensorSink batch
+    enum class tensor_layout {
+        /// batch, row, column, channel: the decoder's interleaved order
+        NHWC,
+        /// batch, channel, row, column: one plane per channel
+        NCHW
+    };
+
+    /// Element type of a TensorSink batch
+    enum class tensor_dtype {
+        /// the pixel values as decoded
+        UINT8,
+        /// (value * scale - mean[c]) / std[c] for channel c
+        FLOAT32
+    };
+
+    /// File format of a TensorSink batch
+    enum class tensor_format {
+        /// NumPy .npy, loadable with numpy.load or numpy.memmap
+        NPY,
+        /// the elements alone, shape and type are in the batch's JSON
+        RAW
+    };
+
+    /// Settings of a TensorSink
+    struct tensor_options {
+        /// Samples per batch file; the last batch of a sample() call may be shorter
+        size_t batch_size = 256;
+        /// Every sample must be height x width x channels, e.g. through a final resize() or crop()
+        size_t height = 0;
+        size_t width = 0;
+        size_t channels = 3;
+        tensor_layout layout = tensor_layout::NHWC;
+        tensor_dtype dtype = tensor_dtype::UINT8;
+        tensor_format format = tensor_format::NPY;
+        /// FLOAT32 only: factor applied before the mean is subtracted, 1/255 maps pixels to [0, 1]
+        float scale = 1.0f / 255;
+        /// FLOAT32 only: per channel mean and standard deviation, after scaling
+        std::array<float, 4> mean{0, 0, 0, 0};
+        std::array<float, 4> std{1, 1, 1, 1};
+        /// File names are <prefix>-<number>.npy (or .raw) and <prefix>-<number>.json
+        std::string prefix = "batch";
+    };
+
+    /// Writes samples as fixed shape batches of raw pixels, ready to be mapped into a training framework's tensors
+    /// without decoding JPEG again
+    ///
+    /// Each batch is one contiguous array of batch_size samples, in NHWC or NCHW order, as uint8 or as float32
+    /// normalised with a per channel mean and standard deviation. Next to it, <prefix>-<number>.json holds the
+    /// shape, the element type and the record of every sample, in order.
+    class TensorSink: public OutputSink {
+    public:
+        /// Will throw if the options do not describe a valid shape
+        /// \param directory directory to create the batches in
+        /// \param options shape, layout, element type and normalisation
+        TensorSink(std::string directory, tensor_options options);
+
+        ~TensorSink() override;
+
+        TensorSink(const TensorSink&) = delete;
+        TensorSink& operator=(const TensorSink&) = delete;
+
+        /// Decodes the stream and adds it to the batch
+        void write(const sample_record& record, const std::vector<uint8_t>& bytes) override;
+
+        /// Decodes the source file and adds it to the batch
+        void write_source(const sample_record& record, passthrough_mode mode) override;
+
+        /// Will throw if the image is not of the configured shape
+        void write_image(const sample_record& record, const jpegimageSTL::jpeg::Image& image,
+                         const jpegimageSTL::jpeg::encode_options& options) override;
+
+        [[nodiscard]] bool keeps_jpeg() const override { return false; }
+
+        /// Writes the current batch, even when it is not full yet
+        void flush() override;
+
+        /// Paths of the batch arrays written so far
+        [[nodiscard]] const std::vector<std::string>& batches() const { return batch_paths; }
+
+    private:
+        void write_batch();
+
+        std::string directory;
+        tensor_options options;
+        // bytes of one sample in the batch
+        size_t sample_bytes;
+        // FLOAT32: the normalised value of every possible component, per channel
+        std::vector<float> lookup;
+        // the current batch, batch_size samples long
+        std::vector<uint8_t> batch;
+        std::vector<std::string> records;
+        std::vector<std::string> batch_paths;
+    };
+
+    /// Random access to the records of one shard through its index
+    class ShardReader {
+    public:
+        /// Will throw if the shard or its index cannot be read
+        /// \param path path of the .shard file
+        explicit ShardReader(const std::string& path);
+
+        ~ShardReader();
+
+        ShardReader(const ShardReader&) = delete;
+        ShardReader& operator=(const ShardReader&) = delete;
+
+        [[nodiscard]] size_t size() const { return entries.size(); }
+
+        [[nodiscard]] const shard_entry& entry(size_t i) const { return entries.at(i); }
+
+        /// JSON metadata of record i
+        [[nodiscard]] std::string metadata(size_t i) const;
+
+        /// JPEG bytes of record i
+        [[nodiscard]] std::vector<uint8_t> read(size_t i) const;
+
+        /// Path of the index belonging to the shard at path
+        static std::string index_path(const std::string& path);
+
+    private:
+        void read_at(uint64_t offset, uint8_t* data, size_t size) const;
+
+        int fd = -1;
+        std::vector<shard_entry> entries;
+    };
+}
+
+#endif //LIB_OUTPUTSINK_H
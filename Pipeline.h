@@ -0,0 +1,208 @@
+#ifndef LIB_PIPELINE_H
+#define LIB_PIPELINE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace augmentorLib {
+
+    /// Threads and queue sizes of a staged sample()
+    struct stage_options {
+        /// Threads reading source files
+        size_t readers = 1;
+        /// Threads decoding, or transcoding in the DCT domain
+        size_t decoders = 1;
+        /// Threads running the operations
+        size_t transformers = 1;
+        /// Threads encoding and handing outputs to the sink
+        size_t encoders = 1;
+        /// Samples each queue between two stages holds at most, rounded up to a power of two
+        size_t queue_capacity = 16;
+    };
+
+    /// What one stage of a staged sample() did
+    struct stage_stats {
+        std::string name;
+        size_t threads = 0;
+        /// Samples the stage handled
+        size_t items = 0;
+        /// Time the stage's threads spent working, summed over threads, without waits on queues
+        double busy_seconds = 0;
+        /// Wall time of the whole sample() call
+        double wall_seconds = 0;
+        /// Capacity of the queue the stage takes its samples from; 0 for the first stage
+        size_t queue_capacity = 0;
+        /// Samples waiting in that queue, averaged over the stage's takes, and at most
+        double mean_queue = 0;
+        size_t peak_queue = 0;
+
+        /// Samples per second of wall time
+        [[nodiscard]] double throughput() const { return wall_seconds > 0 ? items / wall_seconds : 0; }
+
+        /// Share of the stage's thread time spent working: near 1 with a full input queue marks the bottleneck
+        [[nodiscard]] double utilisation() const {
+            return wall_seconds > 0 && threads > 0 ? busy_seconds / (wall_seconds * threads) : 0;
+        }
+    };
+
+    /// A bounded multi-producer multi-consumer queue without locks
+    ///
+    /// Each slot carries a sequence number telling producers and consumers whose turn it is (D. Vyukov's bounded
+    /// MPMC queue), so a push or pop is one compare-and-swap on its index. The blocking push() and pop() spin, then
+    /// yield, then sleep briefly while the queue is full or empty. close() ends the stream: pop() drains what is
+    /// left and then fails, push() fails at once.
+    template<typename T>
+    class BoundedQueue {
+    public:
+        /// \param capacity most elements held, rounded up to a power of two of at least 2
+        explicit BoundedQueue(size_t capacity) {
+            size_t size = 2;
+            while (size < capacity) {
+                size <<= 1;
+            }
+            mask = size - 1;
+            cells = std::make_unique<cell[]>(size);
+            for (size_t i = 0; i < size; ++i) {
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        BoundedQueue(const BoundedQueue&) = delete;
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+        /// Moves value in unless the queue is full
+        bool try_push(T& value) {
+            cell* c;
+            size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+            for (;;) {
+                c = &cells[pos & mask];
+                auto diff = static_cast<intptr_t>(c->sequence.load(std::memory_order_acquire)) -
+                            static_cast<intptr_t>(pos);
+                if (diff == 0) {
+                    if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = enqueue_pos.load(std::memory_order_relaxed);
+                }
+            }
+            c->value = std::move(value);
+            c->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        /// Moves the oldest element into value unless the queue is empty
+        bool try_pop(T& value) {
+            cell* c;
+            size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+            for (;;) {
+                c = &cells[pos & mask];
+                auto diff = static_cast<intptr_t>(c->sequence.load(std::memory_order_acquire)) -
+                            static_cast<intptr_t>(pos + 1);
+                if (diff == 0) {
+                    if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = dequeue_pos.load(std::memory_order_relaxed);
+                }
+            }
+            value = std::move(c->value);
+            c->sequence.store(pos + mask + 1, std::memory_order_release);
+            return true;
+        }
+
+        /// Waits for room and moves value in
+        /// \return false, leaving value alone, when the queue was closed
+        bool push(T& value) {
+            for (unsigned attempt = 0; !closed.load(std::memory_order_acquire); ++attempt) {
+                if (try_push(value)) {
+                    return true;
+                }
+                backoff(attempt);
+            }
+            return false;
+        }
+
+        /// Waits for an element and moves it into value, recording how full the queue was
+        /// \return false once the queue is closed and empty
+        bool pop(T& value) {
+            for (unsigned attempt = 0;; ++attempt) {
+                // read first: every element pushed before close() is then visible to the try_pop() below
+                bool was_closed = closed.load(std::memory_order_acquire);
+                auto waiting = size();
+                if (try_pop(value)) {
+                    occupancy_sum.fetch_add(waiting, std::memory_order_relaxed);
+                    takes.fetch_add(1, std::memory_order_relaxed);
+                    auto peak = peak_size.load(std::memory_order_relaxed);
+                    while (waiting > peak && !peak_size.compare_exchange_weak(peak, waiting, std::memory_order_relaxed)) {}
+                    return true;
+                }
+                if (was_closed) {
+                    return false;
+                }
+                backoff(attempt);
+            }
+        }
+
+        /// No more elements will come; wakes every waiting pop()
+        void close() {
+            closed.store(true, std::memory_order_release);
+        }
+
+        /// Elements in the queue, approximate while others push and pop
+        [[nodiscard]] size_t size() const {
+            auto in = enqueue_pos.load(std::memory_order_relaxed);
+            auto out = dequeue_pos.load(std::memory_order_relaxed);
+            return in > out ? in - out : 0;
+        }
+
+        [[nodiscard]] size_t capacity() const { return mask + 1; }
+
+        /// Queue size averaged over the pops so far
+        [[nodiscard]] double mean_occupancy() const {
+            auto n = takes.load(std::memory_order_relaxed);
+            return n ? static_cast<double>(occupancy_sum.load(std::memory_order_relaxed)) / n : 0;
+        }
+
+        [[nodiscard]] size_t peak_occupancy() const { return peak_size.load(std::memory_order_relaxed); }
+
+    private:
+        struct cell {
+            std::atomic<size_t> sequence;
+            T value;
+        };
+
+        static void backoff(unsigned attempt) {
+            if (attempt < 64) {
+                return;
+            }
+            if (attempt < 128) {
+                std::this_thread::yield();
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+
+        // the indices are written by different sides, keep them off each other's cache line
+        alignas(64) std::atomic<size_t> enqueue_pos{0};
+        alignas(64) std::atomic<size_t> dequeue_pos{0};
+        alignas(64) std::atomic<bool> closed{false};
+        std::atomic<uint64_t> occupancy_sum{0};
+        std::atomic<uint64_t> takes{0};
+        std::atomic<size_t> peak_size{0};
+        size_t mask = 0;
+        std::unique_ptr<cell[]> cells;
+    };
+}
+
+#endif //LIB_PIPELINE_H
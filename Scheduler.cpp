@@ -0,0 +1,171 @@
+#include "Scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace augmentorLib {
+
+    namespace {
+        thread_local Scheduler* current_scheduler = nullptr;
+        thread_local size_t current_index = 0;
+    }
+
+    Scheduler::Scheduler(size_t workers, size_t tile_pixels): tile_pixels{tile_pixels} {
+        workers = std::max<size_t>(1, workers);
+        for (size_t i = 0; i < workers; ++i) {
+            deques.push_back(std::make_unique<worker_deque>());
+        }
+        for (size_t i = 0; i < workers; ++i) {
+            threads.emplace_back([this, i]() { work(i); });
+        }
+    }
+
+    Scheduler::~Scheduler() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    Scheduler* Scheduler::current() {
+        return current_scheduler;
+    }
+
+    size_t Scheduler::current_worker() {
+        return current_index;
+    }
+
+    void Scheduler::spawn(task_group& group, std::function<void()> run, bool leaf) {
+        group.pending.fetch_add(1, std::memory_order_relaxed);
+        size_t index = current_scheduler == this ? current_index : next_deque++ % deques.size();
+        {
+            std::lock_guard<std::mutex> lock(deques[index]->mutex);
+            deques[index]->tasks.push_back(task{std::move(run), &group, leaf});
+        }
+        ++queued;
+        // a sleeping worker also wakes on its own within a millisecond
+        wake.notify_one();
+    }
+
+    bool Scheduler::take(size_t index, bool leaf_only, task& out) {
+        auto eligible = [leaf_only](const task& t) { return !leaf_only || t.leaf; };
+        // newest first from our own deque, it is the most likely to still be in cache
+        {
+            auto& own = *deques[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            auto it = std::find_if(own.tasks.rbegin(), own.tasks.rend(), eligible);
+            if (it != own.tasks.rend()) {
+                out = std::move(*it);
+                own.tasks.erase(std::next(it).base());
+                --queued;
+                return true;
+            }
+        }
+        // oldest first from the others, it tends to be the largest piece of work left
+        for (size_t k = 1; k < deques.size(); ++k) {
+            auto& victim = *deques[(index + k) % deques.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            auto it = std::find_if(victim.tasks.begin(), victim.tasks.end(), eligible);
+            if (it != victim.tasks.end()) {
+                out = std::move(*it);
+                victim.tasks.erase(it);
+                --queued;
+                ++steal_count;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Scheduler::execute(task& t) {
+        auto* group = t.group;
+        try {
+            t.run();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(group->error_mutex);
+            if (!group->error) {
+                group->error = std::current_exception();
+            }
+        }
+        t.run = nullptr;
+        if (group->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            // the lock orders this against a waiter between checking the group and going to sleep
+            { std::lock_guard<std::mutex> lock(sleep_mutex); }
+            wake.notify_all();
+        }
+    }
+
+    void Scheduler::work(size_t index) {
+        current_scheduler = this;
+        current_index = index;
+        task t;
+        for (;;) {
+            if (take(index, false, t)) {
+                execute(t);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            if (stopping && queued == 0) {
+                return;
+            }
+            wake.wait_for(lock, std::chrono::milliseconds(1), [this]() { return queued > 0 || stopping; });
+        }
+    }
+
+    void Scheduler::wait(task_group& group) {
+        if (current_scheduler == this) {
+            // only leaf tasks: anything else could start another task on this worker's state before ours is done
+            task t;
+            for (unsigned idle = 0; !group.done();) {
+                if (take(current_index, true, t)) {
+                    execute(t);
+                    idle = 0;
+                } else if (++idle > 64) {
+                    std::this_thread::yield();
+                }
+            }
+        } else {
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [&group]() { return group.done(); });
+        }
+        std::lock_guard<std::mutex> lock(group.error_mutex);
+        if (group.error) {
+            auto error = group.error;
+            group.error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    void Scheduler::parallel_for(size_t count, size_t pixels_per_item, const std::function<void(size_t, size_t)>& body) {
+        auto* scheduler = current_scheduler;
+        if (!scheduler || scheduler->tile_pixels == 0 || scheduler->size() < 2 || count < 2 ||
+            count * pixels_per_item < scheduler->tile_pixels) {
+            body(0, count);
+            return;
+        }
+        // a few ranges per worker, so ranges that happen to cost more are evened out too
+        size_t ranges = std::min(count, scheduler->size() * 4);
+        task_group group;
+        for (size_t r = 1; r < ranges; ++r) {
+            size_t begin = count * r / ranges;
+            size_t end = count * (r + 1) / ranges;
+            scheduler->spawn(group, [&body, begin, end]() { body(begin, end); }, true);
+        }
+        try {
+            body(0, count / ranges);
+        } catch (...) {
+            // the other ranges still refer to body
+            try {
+                scheduler->wait(group);
+            } catch (...) {
+                // the first error is the one to report
+            }
+            throw;
+        }
+        scheduler->wait(group);
+    }
+}
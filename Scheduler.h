@@ -0,0 +1,109 @@
+#ifndef LIB_SCHEDULER_H
+#define LIB_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace augmentorLib {
+
+    /// Tasks whose completion is waited for together
+    class task_group {
+    public:
+        task_group() = default;
+        task_group(const task_group&) = delete;
+        task_group& operator=(const task_group&) = delete;
+
+        /// \return Whether every task spawned into the group has finished
+        [[nodiscard]] bool done() const { return pending.load(std::memory_order_acquire) == 0; }
+
+    private:
+        friend class Scheduler;
+        std::atomic<size_t> pending{0};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+    };
+
+    /// A pool of worker threads that balance load by work stealing
+    ///
+    /// Every worker owns a deque: it runs its newest task first and, when its deque is empty, steals the oldest task
+    /// of another worker, so a worker held up by one expensive task has its backlog taken by idle ones. A task can
+    /// split its own work with parallel_for(); such leaf tasks are spawned onto the worker's deque and the worker
+    /// runs leaf tasks only while it waits for them, so a long task is shared out instead of holding the tail.
+    class Scheduler {
+    public:
+        /// \param workers number of threads, at least 1
+        /// \param tile_pixels parallel_for() splits work of at least this many pixels into leaf tasks; 0 never does
+        explicit Scheduler(size_t workers, size_t tile_pixels = 0);
+
+        /// Waits for the queued tasks to finish and stops the workers
+        ~Scheduler();
+
+        Scheduler(const Scheduler&) = delete;
+        Scheduler& operator=(const Scheduler&) = delete;
+
+        /// Queues task into group, on the calling worker's deque or, from another thread, the workers' in turn
+        /// \param leaf whether the task spawns no further work and can run while its worker waits for a group
+        void spawn(task_group& group, std::function<void()> task, bool leaf = false);
+
+        /// Waits for every task of group, running tasks meanwhile when called from a worker.
+        /// Rethrows the first exception a task of the group threw.
+        void wait(task_group& group);
+
+        [[nodiscard]] size_t size() const { return deques.size(); }
+
+        /// Tasks taken from another worker's deque so far
+        [[nodiscard]] size_t steals() const { return steal_count.load(std::memory_order_relaxed); }
+
+        /// The scheduler the calling thread works for, or nullptr outside of a worker
+        static Scheduler* current();
+
+        /// Index of the calling worker in its scheduler; only meaningful when current() is not null
+        static size_t current_worker();
+
+        /// Parallel for
+        ///
+        /// Calls body(begin, end) over consecutive ranges covering [0, count). On a worker of a scheduler with
+        /// tiling on, when count * pixels_per_item reaches its tile size, the ranges run as leaf tasks across the
+        /// workers; otherwise body(0, count) runs on the calling thread. Ranges must be independent of each other.
+        /// \param pixels_per_item pixels one index of the range touches, e.g. an image's width for a row
+        static void parallel_for(size_t count, size_t pixels_per_item, const std::function<void(size_t, size_t)>& body);
+
+    private:
+        struct task {
+            std::function<void()> run;
+            task_group* group;
+            bool leaf;
+        };
+
+        struct worker_deque {
+            std::mutex mutex;
+            std::deque<task> tasks;
+        };
+
+        void work(size_t index);
+        /// Takes a task from the back of the worker's own deque or the front of another's
+        /// \param leaf_only skip tasks that may spawn and wait themselves
+        bool take(size_t index, bool leaf_only, task& out);
+        void execute(task& t);
+
+        std::vector<std::unique_ptr<worker_deque>> deques;
+        std::vector<std::thread> threads;
+        size_t tile_pixels;
+        std::atomic<size_t> queued{0};
+        std::atomic<size_t> next_deque{0};
+        std::atomic<size_t> steal_count{0};
+        std::atomic<bool> stopping{false};
+        std::mutex sleep_mutex;
+        std::condition_variable wake;
+    };
+}
+
+#endif //LIB_SCHEDULER_H
@@ -0,0 +1,759 @@
+//
+// Micro-benchmarks for the image kernels.
+//
+// Usage: benchmark [section] [width] [height]
+// Runs every section when no section name is given.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "Augmentor.h"
+
+typedef std::chrono::high_resolution_clock clocking;
+
+// Every allocation made through operator new is counted, so the per-pixel allocation cost of a kernel can be read
+// off directly. Pixel buffers themselves come from the BufferPool and are not included.
+static std::atomic<size_t> allocation_count{0};
+
+void* operator new(size_t n) {
+    ++allocation_count;
+    if (void* p = std::malloc(n ? n : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+// GCC inlines these into new-expressions and then sees malloc'd memory reach free through operator delete
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+namespace {
+
+    struct options {
+        size_t width = 1920;
+        size_t height = 1080;
+    };
+
+    Image synthetic_image(size_t width, size_t height) {
+        Image image(width, height);
+        for (size_t y = 0; y < height; ++y) {
+            auto row = image.row(y);
+            for (size_t x = 0; x < width; ++x) {
+                auto p = row[x];
+                p[0] = static_cast<uint8_t>(x * 255 / width);
+                p[1] = static_cast<uint8_t>(y * 255 / height);
+                p[2] = static_cast<uint8_t>((x ^ y) & 0xff);
+            }
+        }
+        return image;
+    }
+
+    /// Writes a synthetic frame of the benchmark size as a JPEG under the temp path and returns its path.
+    std::string synthetic_jpeg(const options& opts) {
+        auto path = (std::filesystem::temp_directory_path() /
+                     ("augmentor_bench_" + std::to_string(opts.width) + "x" + std::to_string(opts.height) + ".jpg")).string();
+        if (!std::filesystem::exists(path)) {
+            synthetic_image(opts.width, opts.height).save(path);
+        }
+        return path;
+    }
+
+    template <typename Function>
+    double time_ms(int repeats, Function&& function) {
+        auto start = clocking::now();
+        for (int i = 0; i < repeats; ++i) {
+            function();
+        }
+        return std::chrono::duration<double, std::milli>(clocking::now() - start).count() / repeats;
+    }
+
+    void report(const std::string& name, double ms, size_t allocations, size_t pixels) {
+        std::cout << std::left << std::setw(28) << name
+                  << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms"
+                  << std::setw(12) << allocations << " allocs"
+                  << std::setw(14) << std::setprecision(6) << static_cast<double>(allocations) / pixels
+                  << " allocs/pixel" << std::endl;
+    }
+
+    void run_operation(const std::string& name, augmentorLib::Operation<Image>& operation, const Image& source) {
+        Image image(source);
+        // unshare the copy-on-write buffer outside the timed region
+        (void) image.getData();
+        auto before = allocation_count.load();
+        auto start = clocking::now();
+        operation.perform(&image);
+        auto end = clocking::now();
+        auto allocations = allocation_count.load() - before;
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        report(name, ms, allocations, source.getWidth() * source.getHeight());
+    }
+
+    /// Time each built-in operation on one frame and count the heap allocations it makes.
+    void pixel_access(const options& opts) {
+        using namespace augmentorLib;
+        auto source = synthetic_image(opts.width, opts.height);
+        std::cout << "pixel access, " << opts.width << "x" << opts.height << std::endl;
+
+        FlipOperation<Image> flip_h(HORIZONTAL);
+        run_operation("flip horizontal", flip_h, source);
+        FlipOperation<Image> flip_v(VERTICAL);
+        run_operation("flip vertical", flip_v, source);
+        InvertOperation<Image> invert;
+        run_operation("invert", invert, source);
+        CropOperation<Image> crop(image_size{opts.height / 2, opts.width / 2}, true);
+        run_operation("crop", crop, source);
+        RotateOperation<Image> rotate(rotate_range{30, 30});
+        run_operation("rotate", rotate, source);
+        ResizeOperation<Image> resize(image_size{opts.height / 2, opts.width / 2},
+                                      image_size{opts.height / 2, opts.width / 2});
+        run_operation("resize", resize, source);
+        GaussianBlurOperation<Image, 5> gaussian(2.0);
+        run_operation("gaussian blur<5>", gaussian, source);
+        BoxBlurOperation<Image> box(5);
+        run_operation("box blur 5", box, source);
+        RandomEraseOperation<Image> erase(image_size{opts.height / 4, opts.width / 4},
+                                          image_size{opts.height / 4, opts.width / 4});
+        run_operation("random erase", erase, source);
+    }
+
+    /// Run a frame-producing chain repeatedly with and without buffer reuse.
+    void buffer_pool(const options& opts) {
+        using namespace augmentorLib;
+        auto source = synthetic_image(opts.width, opts.height);
+        std::cout << "buffer pool, " << opts.width << "x" << opts.height << ", 50 frames" << std::endl;
+
+        for (bool reuse : {false, true}) {
+            buffer_pool_options pool_options;
+            pool_options.max_bytes_cached = reuse ? pool_options.max_bytes_cached : 0;
+            auto pool = BufferPool::create(pool_options);
+            BufferPool::scoped_use use_pool(pool);
+
+            CropOperation<Image> crop(image_size{opts.height * 3 / 4, opts.width * 3 / 4}, true);
+            RotateOperation<Image> rotate(rotate_range{10, 10});
+            BoxBlurOperation<Image> box(3);
+            auto start = clocking::now();
+            for (int i = 0; i < 50; ++i) {
+                Image image(source);
+                crop.perform(&image);
+                rotate.perform(&image);
+                box.perform(&image);
+            }
+            double ms = std::chrono::duration<double, std::milli>(clocking::now() - start).count();
+            auto stats = pool->stats();
+            std::cout << std::left << std::setw(28) << (reuse ? "pooled" : "unpooled")
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms"
+                      << std::setw(10) << std::setprecision(3) << stats.reuse_rate() << " reuse"
+                      << std::setw(14) << stats.peak_bytes_held / (1 << 20) << " MiB peak" << std::endl;
+        }
+    }
+
+    /// Decode one frame from its (mapped) file at full size and DCT-reduced scales, from memory, and as a centre window.
+    void decode(const options& opts) {
+        auto path = synthetic_jpeg(opts);
+        std::cout << "decode, " << opts.width << "x" << opts.height << std::endl;
+        for (size_t divisor : {1, 2, 4, 8}) {
+            decode_options decode;
+            if (divisor > 1) {
+                decode.min_width = opts.width / divisor;
+                decode.min_height = opts.height / divisor;
+            }
+            size_t width = 0;
+            double ms = time_ms(5, [&]() { width = Image(path, decode).getWidth(); });
+            std::cout << std::left << std::setw(28) << ("scale 1/" + std::to_string(divisor) + " -> " + std::to_string(width))
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms" << std::endl;
+        }
+        {
+            std::ifstream file(path, std::ios::binary);
+            std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            double ms = time_ms(5, [&]() { (void) Image(bytes.data(), bytes.size()); });
+            std::cout << std::left << std::setw(28) << "from memory"
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms" << std::endl;
+        }
+        for (size_t divisor : {2, 4, 10}) {
+            decode_options decode;
+            decode.crop_width = opts.width / divisor;
+            decode.crop_height = opts.height / divisor;
+            double ms = time_ms(5, [&]() { (void) Image(path, decode); });
+            std::cout << std::left << std::setw(28) << ("centre crop 1/" + std::to_string(divisor))
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms" << std::endl;
+        }
+    }
+
+    /// Decode and encode throughput for different numbers of rows per libjpeg call.
+    void scanlines(const options& opts) {
+        auto path = synthetic_jpeg(opts);
+        auto source = Image(path);
+        auto out = (std::filesystem::temp_directory_path() / "augmentor_bench_out.jpg").string();
+        double megapixels = opts.width * opts.height / 1e6;
+        std::cout << "scanlines, " << opts.width << "x" << opts.height << std::endl;
+        for (size_t block : {1, 2, 8, 16, 32}) {
+            decode_options decode;
+            decode.block_height = block;
+            encode_options encode;
+            encode.block_height = block;
+            double decode_ms = time_ms(5, [&]() { (void) Image(path, decode); });
+            double encode_ms = time_ms(5, [&]() { source.save(out, encode); });
+            std::cout << std::left << std::setw(28) << ("block " + std::to_string(block))
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(1)
+                      << megapixels / decode_ms * 1e3 << " MP/s decode"
+                      << std::setw(10) << megapixels / encode_ms * 1e3 << " MP/s encode" << std::endl;
+        }
+    }
+
+    /// Encode time against output size for each encoder preset.
+    void encoder(const options& opts) {
+        auto path = synthetic_jpeg(opts);
+        auto source = Image(path);
+        auto out = (std::filesystem::temp_directory_path() / "augmentor_bench_out.jpg").string();
+        std::cout << "encoder presets, " << opts.width << "x" << opts.height << std::endl;
+
+        encode_options subsampled444 = encode_options::standard();
+        subsampled444.subsampling = chroma_subsampling::YUV444;
+        encode_options float_dct = encode_options::standard();
+        float_dct.dct = dct_method::FLOAT;
+        const std::vector<std::pair<std::string, encode_options>> presets = {
+                {"standard (q95)", encode_options::standard()},
+                {"standard 4:4:4", subsampled444},
+                {"standard float dct", float_dct},
+                {"fast (q90)", encode_options::fast()},
+                {"fast (q75)", encode_options::fast(75)},
+                {"compact (q90)", encode_options::compact()},
+        };
+        for (auto& [name, preset] : presets) {
+            double ms = time_ms(5, [&]() { source.save(out, preset); });
+            std::cout << std::left << std::setw(28) << name
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms"
+                      << std::setw(12) << std::filesystem::file_size(out) / 1024 << " KiB" << std::endl;
+        }
+    }
+
+    /// Flips and half turns through the pixels (decode, transform, encode) and on the DCT coefficients.
+    void lossless(const options& opts) {
+        using namespace augmentorLib;
+        auto path = synthetic_jpeg(opts);
+        auto out = (std::filesystem::temp_directory_path() / "augmentor_bench_out.jpg").string();
+        std::cout << "lossless, " << opts.width << "x" << opts.height << std::endl;
+
+        FlipOperation<Image> flip(HORIZONTAL);
+        RotateOperation<Image> half_turn(rotate_range{180, 180});
+        orientation mirror;
+        mirror.flip_horizontal = true;
+        Transcoder transcoder(path);
+        const std::vector<std::tuple<std::string, Operation<Image>*, orientation>> transforms = {
+                {"flip horizontal", &flip, mirror},
+                {"rotate 180", &half_turn, orientation{false, true, true}},
+        };
+        for (auto& [name, operation, o] : transforms) {
+            double pixels_ms = time_ms(5, [&]() {
+                Image image(path);
+                operation->perform(&image);
+                image.save(out);
+            });
+            std::cout << std::left << std::setw(28) << (name + " pixels")
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(2) << pixels_ms << " ms" << std::endl;
+            if (!transcoder.exact(o)) {
+                std::cout << std::left << std::setw(28) << (name + " dct") << "partial edge MCUs" << std::endl;
+                continue;
+            }
+            double dct_ms = time_ms(5, [&]() { transcoder.save(out, o); });
+            std::cout << std::left << std::setw(28) << (name + " dct")
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(2) << dct_ms << " ms" << std::endl;
+        }
+    }
+
+    /// Writing the same encoded frame many times as one file per sample and packed into shards.
+    void output(const options& opts) {
+        using namespace augmentorLib;
+        const size_t count = 2000;
+        auto bytes = synthetic_image(opts.width / 8, opts.height / 8).encode();
+        auto root = std::filesystem::temp_directory_path() / "augmentor_bench_output";
+        std::cout << "output, " << count << " samples of " << bytes.size() / 1024 << " KiB" << std::endl;
+
+        auto run = [&](const std::string& name, OutputSink& sink) {
+            sample_record record;
+            record.source = "bench.jpg";
+            record.operations = {"invert"};
+            double ms = time_ms(1, [&]() {
+                for (size_t i = 0; i < count; ++i) {
+                    record.index = i;
+                    sink.write(record, bytes);
+                }
+                sink.flush();
+            });
+            std::cout << std::left << std::setw(28) << name
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms"
+                      << std::setw(12) << std::setprecision(1) << count / ms * 1e3 << " samples/s" << std::endl;
+        };
+
+        std::filesystem::remove_all(root);
+        std::filesystem::create_directories(root / "files");
+        {
+            DirectorySink files((root / "files").string() + "/");
+            run("one file per sample", files);
+            ShardSink shards((root / "shards").string());
+            run("shards", shards);
+        }
+        std::filesystem::remove_all(root);
+    }
+
+    /// Many small files through a DirectorySink: flat against fanned out, with and without atomic renames and
+    /// batched syncs. AUGMENTOR_BENCH_OUTPUTS sets the number of files, 1M by default.
+    void fan_out(const options&) {
+        using namespace augmentorLib;
+        const char* env = std::getenv("AUGMENTOR_BENCH_OUTPUTS");
+        const size_t count = env ? std::stoul(env) : 1000000;
+        auto bytes = synthetic_image(32, 32).encode();
+        auto root = std::filesystem::temp_directory_path() / "augmentor_bench_fan_out";
+        std::cout << "fan_out, " << count << " files of " << bytes.size() << " bytes" << std::endl;
+
+        directory_options flat;
+        directory_options flat_atomic;
+        flat_atomic.atomic = true;
+        directory_options fanned_plain;
+        fanned_plain.fan_out = 1024;
+        directory_options fanned = fanned_plain;
+        fanned.atomic = true;
+        directory_options fanned_synced = fanned;
+        fanned_synced.sync_every = 16384;
+        const std::vector<std::pair<std::string, directory_options>> layouts = {
+                {"flat", flat},
+                {"flat, atomic", flat_atomic},
+                {"fan out 1024", fanned_plain},
+                {"fan out 1024, atomic", fanned},
+                {"fan out 1024, sync 16384", fanned_synced},
+        };
+        for (auto& [name, layout] : layouts) {
+            std::filesystem::remove_all(root);
+            std::filesystem::create_directories(root);
+            DirectorySink sink(root.string() + "/", layout);
+            sample_record record;
+            double ms = time_ms(1, [&]() {
+                for (size_t i = 0; i < count; ++i) {
+                    record.index = i;
+                    sink.write(record, bytes);
+                }
+                sink.flush();
+            });
+            // looking a file up by name is what slows down in a huge directory
+            double lookup_ms = time_ms(1, [&]() {
+                for (size_t i = 0; i < count; i += 97) {
+                    if (!std::filesystem::exists(sink.path(i))) {
+                        throw std::runtime_error("missing " + sink.path(i));
+                    }
+                }
+            });
+            std::cout << std::left << std::setw(28) << name
+                      << std::right << std::setw(12) << std::fixed << std::setprecision(1) << count / ms * 1e3
+                      << " files/s" << std::setw(12) << (count / 97 + 1) / lookup_ms * 1e3 << " lookups/s" << std::endl;
+        }
+        std::filesystem::remove_all(root);
+    }
+
+    /// Writes four frames of the benchmark size as the input directory of an Augmentor
+    std::filesystem::path sample_inputs(const options& opts, const std::string& name) {
+        auto in = std::filesystem::temp_directory_path() / name;
+        std::filesystem::remove_all(in);
+        std::filesystem::create_directories(in);
+        for (int i = 0; i < 4; ++i) {
+            synthetic_image(opts.width, opts.height).save((in / ("input_" + std::to_string(i) + ".jpg")).string());
+        }
+        return in;
+    }
+
+    /// sample() throughput as workers are added, up to the hardware threads, for a decode, rotate, invert and encode
+    /// chain over frames of the benchmark size.
+    void workers(const options& opts) {
+        using namespace augmentorLib;
+        const size_t count = 64;
+        auto in = sample_inputs(opts, "augmentor_bench_workers_in");
+        auto out = std::filesystem::temp_directory_path() / "augmentor_bench_workers_out";
+        std::filesystem::create_directories(out);
+        size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+        std::cout << "workers, " << count << " samples of " << opts.width << "x" << opts.height
+                  << ", " << hardware << " hardware threads" << std::endl;
+
+        double serial_ms = 0;
+        for (size_t n = 1; ; n = std::min(n * 2, hardware)) {
+            std::ostringstream discard;
+            auto* previous = std::cout.rdbuf(discard.rdbuf());
+            Augmentor augmentor(in.string() + "/", out.string() + "/");
+            augmentor.workers(n).passthrough(passthrough_mode::DISABLED).rotate(-20, 20).invert(0.5);
+            double ms = time_ms(1, [&]() { augmentor.sample(count); });
+            std::cout.rdbuf(previous);
+            serial_ms = n == 1 ? ms : serial_ms;
+            std::cout << std::left << std::setw(28) << (std::to_string(n) + (n == 1 ? " worker" : " workers"))
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(1) << count / ms * 1e3
+                      << " samples/s" << std::setw(10) << std::setprecision(2) << serial_ms / ms << "x" << std::endl;
+            if (n == hardware) {
+                break;
+            }
+        }
+        std::filesystem::remove_all(in);
+        std::filesystem::remove_all(out);
+    }
+
+    /// sample() over a directory of thumbnails with a few frames of the benchmark size among them, on every hardware
+    /// thread, with and without splitting the large frames into tile tasks.
+    void stealing(const options& opts) {
+        using namespace augmentorLib;
+        const size_t count = 96;
+        auto in = std::filesystem::temp_directory_path() / "augmentor_bench_stealing_in";
+        auto out = std::filesystem::temp_directory_path() / "augmentor_bench_stealing_out";
+        std::filesystem::remove_all(in);
+        std::filesystem::create_directories(in);
+        std::filesystem::create_directories(out);
+        for (int i = 0; i < 30; ++i) {
+            synthetic_image(300, 300).save((in / ("thumb_" + std::to_string(i) + ".jpg")).string());
+        }
+        for (int i = 0; i < 2; ++i) {
+            synthetic_image(opts.width, opts.height).save((in / ("large_" + std::to_string(i) + ".jpg")).string());
+        }
+        size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+        std::cout << "stealing, " << count << " samples of 300x300 and " << opts.width << "x" << opts.height
+                  << ", " << hardware << " hardware threads" << std::endl;
+
+        for (size_t tile_pixels : {size_t(0), size_t(1) << 20}) {
+            std::ostringstream discard;
+            auto* previous = std::cout.rdbuf(discard.rdbuf());
+            Augmentor augmentor(in.string() + "/", out.string() + "/");
+            augmentor.workers(0).tiles(tile_pixels).rapid_blur(3).invert(1);
+            double ms = time_ms(1, [&]() { augmentor.sample(count); });
+            std::cout.rdbuf(previous);
+            std::cout << std::left << std::setw(28) << (tile_pixels ? "tiles of 1 MP and more" : "whole samples")
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(1) << ms << " ms" << std::endl;
+        }
+        std::filesystem::remove_all(in);
+        std::filesystem::remove_all(out);
+    }
+
+    /// The separable gaussian blur across kernel sizes, whose cost grows linearly with the size.
+    void gaussian(const options& opts) {
+        using namespace augmentorLib;
+        auto source = synthetic_image(opts.width, opts.height);
+        std::cout << "gaussian, " << opts.width << "x" << opts.height << std::endl;
+        for (size_t n : {3, 5, 7, 11, 15, 21, 25, 31}) {
+            GaussianBlurOperation<Image> blur(n / 4.0, n);
+            Image image(source);
+            (void) image.getData();
+            double ms = time_ms(3, [&]() { blur.perform(&image); });
+            std::cout << std::left << std::setw(28) << ("kernel " + std::to_string(n))
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms"
+                      << std::setw(10) << std::setprecision(1)
+                      << opts.width * opts.height / (ms * 1000) << " MP/s" << std::endl;
+        }
+    }
+
+    /// Each blur backend across sigma, at two image sizes; BlurOperation::choose() follows the crossovers.
+    void blur(const options& opts) {
+        using namespace augmentorLib;
+        std::vector<std::pair<size_t, size_t>> sizes = {{512, 384}, {opts.width, opts.height}};
+        for (auto [width, height] : sizes) {
+            auto source = synthetic_image(width, height);
+            std::cout << "blur, " << width << "x" << height << std::endl;
+            std::cout << std::left << std::setw(12) << "sigma" << std::right << std::setw(12) << "fir"
+                      << std::setw(12) << "box" << std::setw(12) << "iir" << std::setw(8) << "auto" << std::endl;
+            for (double sigma : {0.5, 1.0, 1.5, 2.0, 3.0, 5.0, 10.0, 20.0, 50.0}) {
+                std::cout << std::left << std::setw(12) << sigma << std::right;
+                for (auto backend : {blur_backend::FIR, blur_backend::BOX, blur_backend::IIR}) {
+                    BlurOperation<Image> operation(sigma, backend);
+                    Image image(source);
+                    (void) image.getData();
+                    double ms = time_ms(3, [&]() { operation.perform(&image); });
+                    std::cout << std::setw(9) << std::fixed << std::setprecision(2) << ms << " ms";
+                }
+                static const char* names[] = {"auto", "fir", "box", "iir"};
+                std::cout << std::setw(8) << names[static_cast<int>(BlurOperation<Image>::choose(sigma, width, height))]
+                          << std::endl;
+            }
+        }
+    }
+
+    /// Rapid blurs by running sums against summed-area tables, across sigma.
+    void box(const options& opts) {
+        using namespace augmentorLib;
+        auto source = synthetic_image(opts.width, opts.height);
+        std::cout << "box, " << opts.width << "x" << opts.height << std::endl;
+        for (double sigma : {2.0, 5.0, 20.0, 50.0}) {
+            for (auto mode : {box_blur_mode::SLIDING, box_blur_mode::INTEGRAL}) {
+                FastGaussianBlurOperation<Image> blur(sigma, 3, mode);
+                Image image(source);
+                (void) image.getData();
+                double ms = time_ms(3, [&]() { blur.perform(&image); });
+                std::cout << std::left << std::setw(28) << blur.describe()
+                          << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms"
+                          << std::endl;
+            }
+        }
+    }
+
+    /// Rotation as the per-pixel loop it replaced, taking the sine and cosine and bounds-checking every pixel,
+    /// against the fixed point kernel in nearest and bilinear mode.
+    void rotate(const options& opts) {
+        using namespace augmentorLib;
+        auto source = synthetic_image(opts.width, opts.height);
+        std::cout << "rotate, " << opts.width << "x" << opts.height << std::endl;
+        for (int degree : {7, 30, 90}) {
+            Image image(source);
+            auto per_pixel_loop = [&]() {
+                auto w = static_cast<int>(image.getWidth()), h = static_cast<int>(image.getHeight());
+                const Image& from = image;
+                Image temp(w, h, image.getPixelSize(), image.getColorSpace());
+                double angle = degree * M_PI / 180.0;
+                for (int y = 0; y < h; ++y) {
+                    for (int x = 0; x < w; ++x) {
+                        int xs = (int) round(cos(angle) * (x - w / 2) - sin(angle) * (y - h / 2) + w / 2);
+                        int ys = (int) round(sin(angle) * (x - w / 2) + cos(angle) * (y - h / 2) + h / 2);
+                        if (xs >= 0 && xs < w && ys >= 0 && ys < h) {
+                            auto src = from.pixelUnchecked(xs, ys);
+                            std::copy(src, src + image.getPixelSize(), temp.pixelUnchecked(x, y));
+                        }
+                    }
+                }
+            };
+            // each side runs once untimed, so that neither pays for first touching its output buffers
+            per_pixel_loop();
+            double per_pixel = time_ms(3, per_pixel_loop);
+            std::cout << std::left << std::setw(28) << "rotate " + std::to_string(degree) + " per-pixel trig"
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(2) << per_pixel << " ms"
+                      << std::endl;
+            for (auto mode : {interpolation::NEAREST, interpolation::BILINEAR}) {
+                RotateOperation<Image> rotation(rotate_range{degree, degree}, mode);
+                rotation.perform(&image);
+                double ms = time_ms(3, [&]() { rotation.perform(&image); });
+                std::cout << std::left << std::setw(28) << rotation.describe()
+                          << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms"
+                          << std::setw(8) << std::setprecision(1) << per_pixel / ms << "x" << std::endl;
+            }
+        }
+    }
+
+    /// Each resize filter shrinking by 4 and growing by 1.5, against the nearest-neighbour loop it replaced, which
+    /// divided in float for every pixel.
+    void resize(const options& opts) {
+        using namespace augmentorLib;
+        auto source = synthetic_image(opts.width, opts.height);
+        std::cout << "resize, " << opts.width << "x" << opts.height << std::endl;
+        for (auto [height, width] : std::vector<std::pair<size_t, size_t>>{
+                {opts.height / 4, opts.width / 4}, {opts.height * 3 / 2, opts.width * 3 / 2}}) {
+            double per_pixel = time_ms(3, [&]() {
+                float scale = static_cast<float>(width) / source.getWidth();
+                float scale_row = static_cast<float>(height) / source.getHeight();
+                Image resized(width, height);
+                for (size_t row = 0; row < height; ++row) {
+                    const uint8_t* src = source.getRow(static_cast<size_t>(row / scale_row));
+                    uint8_t* dst = resized.getRow(row);
+                    for (size_t col = 0; col < width; ++col) {
+                        auto old = static_cast<size_t>(col / scale);
+                        std::copy(src + old * 3, src + old * 3 + 3, dst + col * 3);
+                    }
+                }
+            });
+            std::string size = std::to_string(height) + "x" + std::to_string(width);
+            std::cout << std::left << std::setw(28) << "resize " + size + " per-pixel"
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(2) << per_pixel << " ms"
+                      << std::endl;
+            for (auto filter : {resize_filter::NEAREST, resize_filter::BILINEAR, resize_filter::AREA,
+                                resize_filter::LANCZOS3}) {
+                ResizeOperation<Image> operation(image_size{height, width}, image_size{height, width}, filter);
+                double ms = time_ms(3, [&]() {
+                    Image image(source);
+                    operation.perform(&image);
+                });
+                std::cout << std::left << std::setw(28) << operation.describe()
+                          << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms"
+                          << std::endl;
+            }
+        }
+    }
+
+    /// One large image through each tiled operation, on the calling thread and split across a scheduler's workers.
+    void tiles(const options& opts) {
+        using namespace augmentorLib;
+        auto source = synthetic_image(opts.width, opts.height);
+        size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+        std::cout << "tiles, " << opts.width << "x" << opts.height << ", " << hardware << " hardware threads"
+                  << std::endl;
+
+        GaussianBlurOperation<Image> gaussian(2, size_t{7});
+        RotateOperation<Image> rotate(rotate_range{30, 30});
+        ResizeOperation<Image> resize(image_size{opts.height * 3 / 2, opts.width * 3 / 2},
+                                      image_size{opts.height * 3 / 2, opts.width * 3 / 2});
+        std::vector<std::pair<std::string, Operation<Image>*>> operations = {
+                {"gaussian 7", &gaussian}, {"rotate", &rotate}, {"resize 1.5x", &resize}};
+        Scheduler scheduler(hardware, 1 << 20);
+        for (auto& [name, operation] : operations) {
+            run_operation(name + ", serial", *operation, source);
+            task_group group;
+            scheduler.spawn(group, [&, name = name, operation = operation]() {
+                run_operation(name + ", tiled", *operation, source);
+            });
+            scheduler.wait(group);
+        }
+    }
+
+    /// sample() as one loop against the staged pipeline, with what each stage did.
+    void stages(const options& opts) {
+        using namespace augmentorLib;
+        const size_t count = 64;
+        auto in = sample_inputs(opts, "augmentor_bench_stages_in");
+        auto out = std::filesystem::temp_directory_path() / "augmentor_bench_stages_out";
+        std::filesystem::create_directories(out);
+        size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+        std::cout << "stages, " << count << " samples of " << opts.width << "x" << opts.height
+                  << ", " << hardware << " hardware threads" << std::endl;
+
+        auto run = [&](const std::string& name, const std::function<void(Augmentor&)>& configure) {
+            std::ostringstream discard;
+            auto* previous = std::cout.rdbuf(discard.rdbuf());
+            Augmentor augmentor(in.string() + "/", out.string() + "/");
+            configure(augmentor);
+            augmentor.passthrough(passthrough_mode::DISABLED).rotate(-20, 20).invert(0.5);
+            double ms = time_ms(1, [&]() { augmentor.sample(count); });
+            std::cout.rdbuf(previous);
+            std::cout << std::left << std::setw(28) << name
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(1) << count / ms * 1e3
+                      << " samples/s" << std::endl;
+            for (const auto& stage : augmentor.stage_report()) {
+                std::cout << "  " << std::left << std::setw(26) << (stage.name + " x" + std::to_string(stage.threads))
+                          << std::right << std::setw(10) << std::setprecision(1) << stage.throughput() << " samples/s"
+                          << std::setw(8) << std::setprecision(0) << stage.utilisation() * 100 << "% busy"
+                          << std::setw(8) << std::setprecision(1) << stage.mean_queue << "/" << stage.queue_capacity
+                          << " queued, peak " << stage.peak_queue << std::endl;
+            }
+        };
+        run("one loop", [](Augmentor&) {});
+        run("stages 1/1/1/1", [](Augmentor& a) { a.stages({1, 1, 1, 1, 16}); });
+        size_t compute = hardware / 3;
+        if (compute > 1) {
+            auto threads = std::to_string(compute);
+            run("stages 1/" + threads + "/" + threads + "/" + threads,
+                [compute](Augmentor& a) { a.stages({1, compute, compute, compute, 16}); });
+        }
+        std::filesystem::remove_all(in);
+        std::filesystem::remove_all(out);
+    }
+
+    /// Handing samples to a trainer as JPEG (encode here, decode there) against raw tensor batches.
+    void tensor(const options& opts) {
+        using namespace augmentorLib;
+        const size_t count = 256;
+        auto image = synthetic_image(opts.width / 4, opts.height / 4);
+        auto root = std::filesystem::temp_directory_path() / "augmentor_bench_tensor";
+        std::cout << "tensor, " << count << " samples of " << image.getWidth() << "x" << image.getHeight() << std::endl;
+
+        auto report = [&](const std::string& name, double ms) {
+            std::cout << std::left << std::setw(28) << name
+                      << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms"
+                      << std::setw(12) << std::setprecision(1) << count / ms * 1e3 << " samples/s" << std::endl;
+        };
+        report("jpeg encode + decode", time_ms(1, [&]() {
+            for (size_t i = 0; i < count; ++i) {
+                auto bytes = image.encode(encode_options::fast());
+                Image decoded(bytes.data(), bytes.size());
+            }
+        }));
+
+        tensor_options uint8_nhwc;
+        uint8_nhwc.batch_size = 64;
+        uint8_nhwc.height = image.getHeight();
+        uint8_nhwc.width = image.getWidth();
+        tensor_options float_nchw = uint8_nhwc;
+        float_nchw.layout = tensor_layout::NCHW;
+        float_nchw.dtype = tensor_dtype::FLOAT32;
+        float_nchw.mean = {0.485f, 0.456f, 0.406f, 0};
+        float_nchw.std = {0.229f, 0.224f, 0.225f, 1};
+        const std::vector<std::pair<std::string, tensor_options>> layouts = {
+                {"tensor uint8 NHWC", uint8_nhwc},
+                {"tensor float32 NCHW", float_nchw},
+        };
+        for (auto& [name, tensor_opts] : layouts) {
+            std::filesystem::remove_all(root);
+            TensorSink sink(root.string(), tensor_opts);
+            sample_record record;
+            report(name, time_ms(1, [&]() {
+                for (size_t i = 0; i < count; ++i) {
+                    record.index = i;
+                    sink.write_image(record, image, encode_options{});
+                }
+                sink.flush();
+            }));
+        }
+        std::filesystem::remove_all(root);
+    }
+
+    struct section {
+        const char* name;
+        std::function<void(const options&)> run;
+    };
+
+    const std::vector<section> sections = {
+            {"pixel_access", pixel_access},
+            {"buffer_pool", buffer_pool},
+            {"decode", decode},
+            {"scanlines", scanlines},
+            {"encoder", encoder},
+            {"lossless", lossless},
+            {"output", output},
+            {"workers", workers},
+            {"gaussian", gaussian},
+            {"blur", blur},
+            {"box", box},
+            {"rotate", rotate},
+            {"resize", resize},
+            {"stealing", stealing},
+            {"tiles", tiles},
+            {"stages", stages},
+            {"fan_out", fan_out},
+            {"tensor", tensor},
+    };
+}
+
+int main(int argc, char* argv[]) {
+    std::string only = argc > 1 ? argv[1] : "";
+    options opts;
+    if (argc > 3) {
+        opts.width = std::stoul(argv[2]);
+        opts.height = std::stoul(argv[3]);
+    }
+
+    try {
+        for (auto& s : sections) {
+            if (only.empty() || only == "all" || only == s.name) {
+                s.run(opts);
+                std::cout << std::endl;
+            }
+        }
+        return 0;
+    }
+    catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
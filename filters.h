@@ -6,6 +6,7 @@
 #define LIB_FILTERS_H
 
 #include <vector>
+#include <cassert>
 #include <cmath>
 #include <numeric>
 
@@ -44,11 +45,11 @@ namespace augmentorLib {
             }
         }
 
-        inline double operator[](size_t i){
+        inline double operator[](size_t i) const {
             return array[i];
         }
 
-        inline size_t size() {
+        inline size_t size() const {
             return N;
         }
     };
@@ -83,11 +84,11 @@ namespace augmentorLib {
             }
         }
 
-        inline double operator[](size_t i){
+        inline double operator[](size_t i) const {
             return vector[i];
         }
 
-        inline size_t size() {
+        inline size_t size() const {
             return vector.size();
         }
     };
@@ -1,7 +1,17 @@
 #include "jpeg.h"
+#include "BufferPool.h"
+#include "Scheduler.h"
 
 #include <jpeglib.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <stdexcept>
 #include <string>
@@ -11,6 +21,18 @@
 
 namespace jpegimageSTL::jpeg
     {
+        void Image::allocate()
+        {
+            m_stride = (m_width * m_pixelSize + row_alignment - 1) / row_alignment * row_alignment;
+            size_t bytes = m_stride * m_height;
+            if (bytes == 0){
+                m_bitmapData.reset();
+                return;
+            }
+            // frames come and go for every sample, so they are recycled through the thread's pool
+            m_bitmapData = BufferPool::current()->acquire(bytes);
+        }
+
         Image::Image(const size_t x, const size_t y, const size_t pixelSize, const int colourSpace)
         {
             m_errorMgr = std::make_shared<::jpeg_error_mgr>();
@@ -29,14 +51,21 @@ namespace jpegimageSTL::jpeg
             m_pixelSize   = pixelSize;
             m_colourSpace = colourSpace;
 
-            m_bitmapData.clear();
-            m_bitmapData.reserve(m_height);
-
-            for(size_t i = 0; i < m_height; ++i){
-                std::vector<uint8_t> vec(m_width*m_pixelSize, 0);
-                m_bitmapData.push_back(vec);
+            allocate();
+            if (m_bitmapData){
+                std::memset(m_bitmapData.get(), 0, m_height * m_stride);
             }
+        }
 
+        Image Image::uninitialised(const size_t x, const size_t y, const size_t pixelSize, const int colourSpace)
+        {
+            Image image;
+            image.m_width       = x;
+            image.m_height      = y;
+            image.m_pixelSize   = pixelSize;
+            image.m_colourSpace = colourSpace;
+            image.allocate();
+            return image;
         }
 
         Image::Image()
@@ -53,36 +82,155 @@ namespace jpegimageSTL::jpeg
             };
         }
 
-        Image::Image( const std::string& fileName )
+        Image::Image( std::shared_ptr<uint8_t> pixels, size_t x, size_t y, size_t pixelSize, int colourSpace, size_t stride ):
+                Image()
         {
-            // Creating a custom deleter for the decompressInfo pointer
+            if (reinterpret_cast<uintptr_t>(pixels.get()) % row_alignment != 0 || stride % row_alignment != 0 || stride < x * pixelSize){
+                throw std::invalid_argument("External pixels must be " + std::to_string(row_alignment) + "-byte aligned");
+            }
+            m_bitmapData  = std::move(pixels);
+            m_width       = x;
+            m_height      = y;
+            m_pixelSize   = pixelSize;
+            m_colourSpace = colourSpace;
+            m_stride      = stride;
+            // never write into storage we do not own
+            m_shared.store(true, std::memory_order_relaxed);
+        }
+
+        Image::Image( const std::string& fileName ): Image( fileName, decode_options{} )
+        {
+        }
+
+        namespace
+        {
+            // A libjpeg error manager that throws instead of exit()ing
+            void installThrowingErrorHandler( ::jpeg_error_mgr& errorMgr )
+            {
+                ::jpeg_std_error( &errorMgr );
+                errorMgr.error_exit = [](::j_common_ptr cinfo){
+                    char jpegLastErrorMsg[JMSG_LENGTH_MAX];
+                    (*(cinfo->err->format_message))(cinfo, jpegLastErrorMsg);
+                    throw std::runtime_error(jpegLastErrorMsg);
+                };
+            }
+
+            // A libjpeg destination that grows a vector, so encoded bytes never go through a temporary file
+            struct VectorDestination
+            {
+                // first member, so the pointer libjpeg hands back converts to the whole struct
+                ::jpeg_destination_mgr manager{};
+                std::vector<uint8_t>&  bytes;
+
+                explicit VectorDestination( std::vector<uint8_t>& bytes ): bytes{bytes}
+                {
+                    manager.init_destination = []( ::j_compress_ptr cinfo ){
+                        auto& self = *reinterpret_cast<VectorDestination*>( cinfo->dest );
+                        self.bytes.resize( std::max<size_t>( self.bytes.capacity(), 1 << 16 ) );
+                        self.manager.next_output_byte = self.bytes.data();
+                        self.manager.free_in_buffer = self.bytes.size();
+                    };
+                    manager.empty_output_buffer = []( ::j_compress_ptr cinfo ) -> ::boolean {
+                        auto& self = *reinterpret_cast<VectorDestination*>( cinfo->dest );
+                        size_t used = self.bytes.size();
+                        self.bytes.resize( used * 2 );
+                        self.manager.next_output_byte = self.bytes.data() + used;
+                        self.manager.free_in_buffer = self.bytes.size() - used;
+                        return TRUE;
+                    };
+                    manager.term_destination = []( ::j_compress_ptr cinfo ){
+                        auto& self = *reinterpret_cast<VectorDestination*>( cinfo->dest );
+                        self.bytes.resize( self.bytes.size() - self.manager.free_in_buffer );
+                    };
+                }
+            };
+
+            // Creating a custom deleter for the compressInfo pointer
             // to ensure ::jpeg_destroy_compress() gets called even if
-            // we throw out of this function.
-            auto dt = []( ::jpeg_decompress_struct *ds ){
-                ::jpeg_destroy_decompress( ds );
+            // we throw out of the caller.
+            struct CompressDeleter
+            {
+                void operator()( ::jpeg_compress_struct* cs ) const
+                {
+                    ::jpeg_destroy_compress( cs );
+                    delete cs;
+                }
             };
+            typedef std::unique_ptr<::jpeg_compress_struct, CompressDeleter> CompressPtr;
 
-            std::unique_ptr<::jpeg_decompress_struct, decltype(dt)> decompressInfo(new ::jpeg_decompress_struct,dt);
+            // A compressor reporting through errorMgr, which has to outlive it
+            CompressPtr createCompress( ::jpeg_error_mgr& errorMgr )
+            {
+                CompressPtr compressInfo( new ::jpeg_compress_struct );
+                installThrowingErrorHandler( errorMgr );
+                compressInfo->err = &errorMgr;
+                ::jpeg_create_compress( compressInfo.get() );
+                return compressInfo;
+            }
 
-            // Note this is a shared pointer as we can share this
-            // between objects which have copy constructed from each other
-            m_errorMgr = std::make_shared<::jpeg_error_mgr>();
+            // Read-only mapping of a whole file, unmapped when it goes out of scope
+            class MappedFile
+            {
+            public:
+                const uint8_t* data = nullptr;
+                size_t         size = 0;
 
-            // Using fopen here ( and in save() ) because libjpeg expects
-            // a FILE pointer.
-            // We store the FILE* in a unique_ptr so we can also use the custom
-            // deleter here to ensure fclose() gets called even if we throw.
-            auto fdt = []( FILE* fp ){
-                fclose( fp );
+                explicit MappedFile( const std::string& fileName )
+                {
+                    int fd = ::open( fileName.c_str(), O_RDONLY );
+                    if ( fd < 0 ){
+                        throw std::runtime_error( "Could not open " + fileName );
+                    }
+                    struct stat st{};
+                    if ( ::fstat( fd, &st ) == 0 && st.st_size > 0 ){
+                        void* p = ::mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+                        if ( p != MAP_FAILED ){
+                            // the decoder reads front to back exactly once
+                            ::madvise( p, st.st_size, MADV_SEQUENTIAL );
+                            data = static_cast<const uint8_t*>( p );
+                            size = st.st_size;
+                        }
+                    }
+                    ::close( fd );
+                    if ( data == nullptr && st.st_size > 0 ){
+                        throw std::runtime_error( "Could not map " + fileName );
+                    }
+                }
+
+                ~MappedFile()
+                {
+                    if ( data != nullptr ){
+                        ::munmap( const_cast<uint8_t*>( data ), size );
+                    }
+                }
+
+                MappedFile( const MappedFile& ) = delete;
+                MappedFile& operator=( const MappedFile& ) = delete;
             };
+        }
 
-            std::unique_ptr<FILE, decltype(fdt)>infile(
-                    fopen(fileName.c_str(), "rb"),fdt
-            );
+        Image::Image( const std::string& fileName, const decode_options& options ): Image()
+        {
+            // the file is mapped and handed to libjpeg as one buffer, no stdio buffering or read() calls
+            MappedFile file( fileName );
+            decode( file.data, file.size, options );
+        }
 
-            if (infile.get() == NULL){
-                throw std::runtime_error("Could not open " + fileName);
-            }
+        Image::Image( const uint8_t* data, size_t size, const decode_options& options ): Image()
+        {
+            decode( data, size, options );
+        }
+
+        void Image::decode( const uint8_t* data, size_t size, const decode_options& options )
+        {
+            // Creating a custom deleter for the decompressInfo pointer
+            // to ensure ::jpeg_destroy_compress() gets called even if
+            // we throw out of this function.
+            auto dt = []( ::jpeg_decompress_struct *ds ){
+                ::jpeg_destroy_decompress( ds );
+            };
+
+            std::unique_ptr<::jpeg_decompress_struct, decltype(dt)> decompressInfo(new ::jpeg_decompress_struct,dt);
 
             decompressInfo->err = ::jpeg_std_error(m_errorMgr.get());
 
@@ -97,33 +245,100 @@ namespace jpegimageSTL::jpeg
             };
             ::jpeg_create_decompress(decompressInfo.get());
 
-            // Read the file:
-            ::jpeg_stdio_src(decompressInfo.get(), infile.get());
+            // Read from memory:
+            ::jpeg_mem_src(decompressInfo.get(), data, size);
 
             int rc = ::jpeg_read_header(decompressInfo.get(), TRUE);
             if (rc != 1){
                 throw std::runtime_error("File does not seem to be a normal JPEG");
             }
 
+            if (options.scaled()){
+                // let the IDCT produce a reduced image directly: try M/8 scales from the smallest up
+                decompressInfo->scale_denom = 8;
+                for (unsigned num = 1; num <= 8; ++num){
+                    decompressInfo->scale_num = num;
+                    ::jpeg_calc_output_dimensions(decompressInfo.get());
+                    if (decompressInfo->output_width >= options.min_width && decompressInfo->output_height >= options.min_height){
+                        break;
+                    }
+                }
+            }
+
             ::jpeg_start_decompress(decompressInfo.get());
 
-            m_width       = decompressInfo->output_width;
-            m_height      = decompressInfo->output_height;
+            // the window of the output we keep, the whole frame unless a centre crop was asked for
+            size_t fullWidth  = decompressInfo->output_width;
+            size_t fullHeight = decompressInfo->output_height;
+            size_t width  = options.crop_width  ? std::min(options.crop_width,  fullWidth)  : fullWidth;
+            size_t height = options.crop_height ? std::min(options.crop_height, fullHeight) : fullHeight;
+            size_t left   = fullWidth / 2 - width / 2;
+            size_t top    = fullHeight / 2 - height / 2;
+
+            // columns libjpeg will hand us, from `decodedLeft` and `decodedWidth` wide
+            ::JDIMENSION decodedLeft  = 0;
+            ::JDIMENSION decodedWidth = fullWidth;
+#ifdef LIBJPEG_TURBO_VERSION
+            if (width < fullWidth){
+                // widens the window to iMCU boundaries and only decodes those columns
+                decodedLeft  = left;
+                decodedWidth = width;
+                ::jpeg_crop_scanline(decompressInfo.get(), &decodedLeft, &decodedWidth);
+            }
+#endif
+
+            m_width       = width;
+            m_height      = height;
             m_pixelSize   = decompressInfo->output_components;
             m_colourSpace = decompressInfo->out_color_space;
 
-            size_t row_stride = m_width * m_pixelSize;
+            allocate();
+
+            // libjpeg is handed a block of row pointers per call, amortising its per-call overhead
+            size_t block = options.block_height ? options.block_height : decompressInfo->rec_outbuf_height;
+            std::vector<::JSAMPROW> rows(block);
+
+            // rows wider than what we keep are decoded into scratch and the window is copied out
+            size_t decodedBytes = decodedWidth * m_pixelSize;
+            size_t skipBytes = (left - decodedLeft) * m_pixelSize;
+            bool inPlace = decodedWidth == width;
+            std::vector<uint8_t> scratch(inPlace && top == 0 ? 0 : block * decodedBytes);
+
+            if (top > 0){
+#ifdef LIBJPEG_TURBO_VERSION
+                ::jpeg_skip_scanlines(decompressInfo.get(), top);
+#endif
+                // without libjpeg-turbo (or if it skipped fewer), rows above the window are decoded and dropped
+                while (decompressInfo->output_scanline < top){
+                    size_t n = std::min<size_t>(block, top - decompressInfo->output_scanline);
+                    for (size_t i = 0; i < n; ++i){
+                        rows[i] = scratch.data() + i * decodedBytes;
+                    }
+                    ::jpeg_read_scanlines(decompressInfo.get(), rows.data(), n);
+                }
+            }
 
-            m_bitmapData.clear();
-            m_bitmapData.reserve(m_height);
+            // decode straight into the pixel buffer, no per-row copies
+            while (decompressInfo->output_scanline < top + m_height){
+                size_t y = decompressInfo->output_scanline - top;
+                size_t n = std::min(block, m_height - y);
+                for (size_t i = 0; i < n; ++i){
+                    rows[i] = inPlace ? getRow(y + i) : scratch.data() + i * decodedBytes;
+                }
+                n = ::jpeg_read_scanlines(decompressInfo.get(), rows.data(), n);
+                if (!inPlace){
+                    for (size_t i = 0; i < n; ++i){
+                        std::memcpy(getRow(y + i), scratch.data() + i * decodedBytes + skipBytes, m_width * m_pixelSize);
+                    }
+                }
+            }
 
-            while (decompressInfo->output_scanline < m_height){
-                std::vector<uint8_t> vec(row_stride);
-                uint8_t* p = vec.data();
-                ::jpeg_read_scanlines(decompressInfo.get(), &p, 1);
-                m_bitmapData.push_back(vec);
+            if (decompressInfo->output_scanline < fullHeight){
+                // rows below the window are never decoded
+                ::jpeg_abort_decompress(decompressInfo.get());
+            } else {
+                ::jpeg_finish_decompress(decompressInfo.get());
             }
-            ::jpeg_finish_decompress(decompressInfo.get());
         }
 
         // Copy constructor
@@ -134,7 +349,63 @@ namespace jpegimageSTL::jpeg
             m_width         = rhs.m_width;
             m_height        = rhs.m_height;
             m_pixelSize     = rhs.m_pixelSize;
+            m_stride        = rhs.m_stride;
             m_colourSpace   = rhs.m_colourSpace;
+            if (m_bitmapData){
+                rhs.m_shared.store(true, std::memory_order_relaxed);
+                m_shared.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        Image& Image::operator=( const Image& rhs )
+        {
+            if (this != &rhs){
+                Image copy(rhs);
+                swap(copy);
+            }
+            return *this;
+        }
+
+        void Image::detach()
+        {
+            if (m_bitmapData.use_count() > 1){
+                auto shared = std::move(m_bitmapData);
+                allocate();
+                std::memcpy(m_bitmapData.get(), shared.get(), m_height * m_stride);
+            } else {
+                // the other owners are gone; pairs with the release in their shared_ptr destructors
+                std::atomic_thread_fence(std::memory_order_acquire);
+            }
+            m_shared.store(false, std::memory_order_relaxed);
+        }
+
+        Image::Image( Image&& rhs ) noexcept
+        {
+            swap(rhs);
+        }
+
+        Image& Image::operator=( Image&& rhs ) noexcept
+        {
+            if (this != &rhs){
+                Image released(std::move(rhs));
+                swap(released);
+            }
+            return *this;
+        }
+
+        void Image::swap( Image& other ) noexcept
+        {
+            using std::swap;
+            swap(m_errorMgr,    other.m_errorMgr);
+            swap(m_bitmapData,  other.m_bitmapData);
+            swap(m_width,       other.m_width);
+            swap(m_height,      other.m_height);
+            swap(m_pixelSize,   other.m_pixelSize);
+            swap(m_stride,      other.m_stride);
+            swap(m_colourSpace, other.m_colourSpace);
+            bool shared = m_shared.load(std::memory_order_relaxed);
+            m_shared.store(other.m_shared.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            other.m_shared.store(shared, std::memory_order_relaxed);
         }
 
         /// Destructor
@@ -144,112 +415,336 @@ namespace jpegimageSTL::jpeg
 
         void Image::save( const std::string& fileName, int quality ) const
         {
+            encode_options options;
+            options.quality = quality;
+            save( fileName, options );
+        }
+
+        void Image::save( const std::string& fileName, const encode_options& options ) const
+        {
+            auto fdt = []( FILE* fp ){
+                fclose( fp );
+            };
+            std::unique_ptr<FILE, decltype(fdt)> outfile( fopen(fileName.c_str(), "wb"), fdt );
+            if ( outfile == NULL ){
+                throw std::runtime_error("Could not open " + fileName + " for writing");
+            }
+            ::jpeg_error_mgr errorMgr{};
+            auto compressInfo = createCompress( errorMgr );
+            ::jpeg_stdio_dest( compressInfo.get(), outfile.get() );
+            compress( compressInfo.get(), options );
+        }
+
+        std::vector<uint8_t> Image::encode( const encode_options& options ) const
+        {
+            std::vector<uint8_t> bytes;
+            ::jpeg_error_mgr errorMgr{};
+            auto compressInfo = createCompress( errorMgr );
+            VectorDestination destination( bytes );
+            compressInfo->dest = &destination.manager;
+            compress( compressInfo.get(), options );
+            return bytes;
+        }
+
+        void Image::compress( ::jpeg_compress_struct* compressInfo, const encode_options& options ) const
+        {
+            int quality = options.quality;
             if ( quality < 0 ){
                 quality = 0;
             }
             if ( quality > 100 ){
                 quality = 100;
             }
-            FILE* outfile = fopen(fileName.c_str(), "wb");
-            if ( outfile == NULL ){
-                throw std::runtime_error("Could not open " + fileName + " for writing");
-            }
-            // Creating a custom deleter for the compressInfo pointer
-            // to ensure ::jpeg_destroy_compress() gets called even if
-            // we throw out of this function.
-            auto dt = []( ::jpeg_compress_struct *cs ){
-                ::jpeg_destroy_compress( cs );
-
-            };
-            std::unique_ptr<::jpeg_compress_struct, decltype(dt)> compressInfo(
-                    new ::jpeg_compress_struct,
-                    dt );
-            ::jpeg_create_compress( compressInfo.get() );
-            ::jpeg_stdio_dest( compressInfo.get(), outfile);
             compressInfo->image_width = m_width;
             compressInfo->image_height = m_height;
             compressInfo->input_components = m_pixelSize;
             compressInfo->in_color_space =
                     static_cast<::J_COLOR_SPACE>( m_colourSpace );
-            compressInfo->err = ::jpeg_std_error( m_errorMgr.get() );
-            ::jpeg_set_defaults( compressInfo.get() );
-            ::jpeg_set_quality( compressInfo.get(), quality, TRUE );
-            ::jpeg_start_compress( compressInfo.get(), TRUE);
-            for ( auto const& vecLine : m_bitmapData ){
-                ::JSAMPROW rowPtr[1];
-                // Casting const-ness away here because the jpeglib
-                // call expects a non-const pointer. It presumably
-                // doesn't modify our data.
-                rowPtr[0] = const_cast<::JSAMPROW>( vecLine.data() );
-                ::jpeg_write_scanlines(compressInfo.get(),rowPtr,1);
-            }
-            ::jpeg_finish_compress( compressInfo.get() );
-            fclose( outfile );
+            ::jpeg_set_defaults( compressInfo );
+            ::jpeg_set_quality( compressInfo, quality, TRUE );
+
+            switch ( options.dct ){
+                case dct_method::ISLOW: compressInfo->dct_method = ::JDCT_ISLOW; break;
+                case dct_method::IFAST: compressInfo->dct_method = ::JDCT_IFAST; break;
+                case dct_method::FLOAT: compressInfo->dct_method = ::JDCT_FLOAT; break;
+            }
+            compressInfo->optimize_coding = options.optimize_coding ? TRUE : FALSE;
+            if ( compressInfo->num_components == 3 ){
+                // luma sampling factors relative to the two chroma components
+                compressInfo->comp_info[0].h_samp_factor = options.subsampling == chroma_subsampling::YUV444 ? 1 : 2;
+                compressInfo->comp_info[0].v_samp_factor = options.subsampling == chroma_subsampling::YUV420 ? 2 : 1;
+                for ( int c = 1; c < 3; ++c ){
+                    compressInfo->comp_info[c].h_samp_factor = 1;
+                    compressInfo->comp_info[c].v_samp_factor = 1;
+                }
+            }
+            if ( options.progressive ){
+                ::jpeg_simple_progression( compressInfo );
+            }
+
+            ::jpeg_start_compress( compressInfo, TRUE);
+            // hand libjpeg a block of rows per call
+            size_t block = options.block_height ? options.block_height : 1;
+            std::vector<::JSAMPROW> rowPtrs( block );
+            while ( compressInfo->next_scanline < m_height ){
+                size_t y = compressInfo->next_scanline;
+                size_t n = std::min( block, m_height - y );
+                for ( size_t i = 0; i < n; ++i ){
+                    // Casting const-ness away here because the jpeglib
+                    // call expects a non-const pointer. It presumably
+                    // doesn't modify our data.
+                    rowPtrs[i] = const_cast<::JSAMPROW>( getRow( y + i ) );
+                }
+                ::jpeg_write_scanlines( compressInfo, rowPtrs.data(), n );
+            }
+            ::jpeg_finish_compress( compressInfo );
         }
 
-        std::vector<uint8_t> Image::getPixel( size_t x, size_t y ) const
+        namespace
         {
+            // Where each coefficient of a transformed 8x8 block comes from, and its sign
+            struct BlockTransform
+            {
+                int      from[DCTSIZE2];
+                ::JCOEF  sign[DCTSIZE2];
 
-            if (y > m_bitmapData.size()){
+                explicit BlockTransform( const orientation& o )
+                {
+                    // coefficients are in natural order, the row being the vertical frequency
+                    for ( int v = 0; v < DCTSIZE; ++v ){
+                        for ( int u = 0; u < DCTSIZE; ++u ){
+                            from[v * DCTSIZE + u] = o.transpose ? u * DCTSIZE + v : v * DCTSIZE + u;
+                            // mirroring a block negates its odd frequencies along the mirrored axis
+                            bool negate = ( o.flip_horizontal && ( u & 1 ) ) != ( o.flip_vertical && ( v & 1 ) );
+                            sign[v * DCTSIZE + u] = negate ? -1 : 1;
+                        }
+                    }
+                }
+
+                void operator()( const ::JCOEF* src, ::JCOEF* dst ) const
+                {
+                    for ( int i = 0; i < DCTSIZE2; ++i ){
+                        dst[i] = static_cast<::JCOEF>( src[from[i]] * sign[i] );
+                    }
+                }
+            };
+        }
+
+        Transcoder::Transcoder( const std::string& fileName ): m_fileName{fileName}
+        {
+            MappedFile file( fileName );
+            ::jpeg_error_mgr errorMgr{};
+            auto dt = []( ::jpeg_decompress_struct *ds ){
+                ::jpeg_destroy_decompress( ds );
+            };
+            std::unique_ptr<::jpeg_decompress_struct, decltype(dt)> decompressInfo(new ::jpeg_decompress_struct, dt);
+            installThrowingErrorHandler( errorMgr );
+            decompressInfo->err = &errorMgr;
+            ::jpeg_create_decompress( decompressInfo.get() );
+            ::jpeg_mem_src( decompressInfo.get(), file.data, file.size );
+            if ( ::jpeg_read_header( decompressInfo.get(), TRUE ) != 1 ){
+                throw std::runtime_error( "File does not seem to be a normal JPEG" );
+            }
+
+            m_width  = decompressInfo->image_width;
+            m_height = decompressInfo->image_height;
+            // a single component is coded in plain 8x8 blocks whatever its sampling factors say
+            if ( decompressInfo->num_components > 1 ){
+                m_mcuWidth  = decompressInfo->max_h_samp_factor * DCTSIZE;
+                m_mcuHeight = decompressInfo->max_v_samp_factor * DCTSIZE;
+            }
+        }
+
+        bool Transcoder::exact( const orientation& o ) const
+        {
+            // mirrors are made after the transpose, on its output dimensions
+            size_t width     = o.transpose ? m_height    : m_width;
+            size_t height    = o.transpose ? m_width     : m_height;
+            size_t mcuWidth  = o.transpose ? m_mcuHeight : m_mcuWidth;
+            size_t mcuHeight = o.transpose ? m_mcuWidth  : m_mcuHeight;
+            return ( !o.flip_horizontal || width % mcuWidth == 0 ) && ( !o.flip_vertical || height % mcuHeight == 0 );
+        }
+
+        void Transcoder::save( const std::string& fileName, const orientation& o ) const
+        {
+            auto fdt = []( FILE* fp ){
+                fclose( fp );
+            };
+            std::unique_ptr<FILE, decltype(fdt)> outfile( nullptr, fdt );
+            transcode( o, [&]( ::jpeg_compress_struct* dst ){
+                // opened only once the source is known to be good
+                outfile.reset( fopen( fileName.c_str(), "wb" ) );
+                if ( outfile == NULL ){
+                    throw std::runtime_error( "Could not open " + fileName + " for writing" );
+                }
+                ::jpeg_stdio_dest( dst, outfile.get() );
+            } );
+        }
+
+        std::vector<uint8_t> Transcoder::encode( const orientation& o ) const
+        {
+            std::vector<uint8_t> bytes;
+            VectorDestination destination( bytes );
+            transcode( o, [&]( ::jpeg_compress_struct* dst ){
+                dst->dest = &destination.manager;
+            } );
+            return bytes;
+        }
+
+        void Transcoder::transcode( const orientation& o, const std::function<void( ::jpeg_compress_struct* )>& setDestination ) const
+        {
+            if ( !exact( o ) ){
+                throw std::invalid_argument( "Transform would cut partial MCUs off " + m_fileName );
+            }
+
+            MappedFile file( m_fileName );
+            ::jpeg_error_mgr srcErrorMgr{};
+            ::jpeg_error_mgr dstErrorMgr{};
+            auto ddt = []( ::jpeg_decompress_struct *ds ){
+                ::jpeg_destroy_decompress( ds );
+            };
+            std::unique_ptr<::jpeg_decompress_struct, decltype(ddt)> src(new ::jpeg_decompress_struct, ddt);
+            installThrowingErrorHandler( srcErrorMgr );
+            src->err = &srcErrorMgr;
+            ::jpeg_create_decompress( src.get() );
+            ::jpeg_mem_src( src.get(), file.data, file.size );
+            ::jpeg_read_header( src.get(), TRUE );
+
+            // a transpose changes the shape of the block grid and needs arrays of its own, requested before
+            // jpeg_read_coefficients() realises them; mirrors are made in place
+            int components = src->num_components;
+            std::vector<::jvirt_barray_ptr> dstArrays( components );
+            for ( int c = 0; o.transpose && c < components; ++c ){
+                const ::jpeg_component_info& comp = src->comp_info[c];
+                ::JDIMENSION hSamp = comp.v_samp_factor;
+                ::JDIMENSION vSamp = comp.h_samp_factor;
+                dstArrays[c] = (*src->mem->request_virt_barray)(
+                        reinterpret_cast<::j_common_ptr>( src.get() ), JPOOL_IMAGE, FALSE,
+                        ( comp.height_in_blocks + hSamp - 1 ) / hSamp * hSamp,
+                        ( comp.width_in_blocks + vSamp - 1 ) / vSamp * vSamp, vSamp );
+            }
+            ::jvirt_barray_ptr* srcArrays = ::jpeg_read_coefficients( src.get() );
+
+            auto dst = createCompress( dstErrorMgr );
+            setDestination( dst.get() );
+            ::jpeg_copy_critical_parameters( src.get(), dst.get() );
+            if ( o.transpose ){
+                std::swap( dst->image_width, dst->image_height );
+                for ( int c = 0; c < components; ++c ){
+                    std::swap( dst->comp_info[c].h_samp_factor, dst->comp_info[c].v_samp_factor );
+                }
+                // quantisation tables are indexed by frequency, so they transpose with the blocks
+                for ( auto* table : dst->quant_tbl_ptrs ){
+                    if ( table == nullptr ){
+                        continue;
+                    }
+                    for ( int v = 0; v < DCTSIZE; ++v ){
+                        for ( int u = 0; u < v; ++u ){
+                            std::swap( table->quantval[v * DCTSIZE + u], table->quantval[u * DCTSIZE + v] );
+                        }
+                    }
+                }
+            }
+            if ( src->progressive_mode ){
+                ::jpeg_simple_progression( dst.get() );
+            }
+
+            const BlockTransform transformBlock( o );
+            auto common = reinterpret_cast<::j_common_ptr>( src.get() );
+            for ( int c = 0; c < components; ++c ){
+                const ::jpeg_component_info& comp = src->comp_info[c];
+                if ( o.transpose ){
+                    ::JDIMENSION width  = comp.height_in_blocks;
+                    ::JDIMENSION height = comp.width_in_blocks;
+                    // jctrans reads whole sample factor groups, so the padding blocks past the image are copied too,
+                    // from the padding of the source arrays, like jpegtran does; exact() keeps them off mirrored axes
+                    ::JDIMENSION paddedWidth  = ( width + comp.v_samp_factor - 1 ) / comp.v_samp_factor * comp.v_samp_factor;
+                    ::JDIMENSION paddedHeight = ( height + comp.h_samp_factor - 1 ) / comp.h_samp_factor * comp.h_samp_factor;
+                    for ( ::JDIMENSION by = 0; by < paddedHeight; ++by ){
+                        ::JBLOCKROW dstRow = (*src->mem->access_virt_barray)( common, dstArrays[c], by, 1, TRUE )[0];
+                        // undo the mirrors, then the transpose, to find the source block
+                        ::JDIMENSION y = o.flip_vertical && by < height ? height - 1 - by : by;
+                        for ( ::JDIMENSION bx = 0; bx < paddedWidth; ++bx ){
+                            ::JDIMENSION x = o.flip_horizontal && bx < width ? width - 1 - bx : bx;
+                            auto srcRow = (*src->mem->access_virt_barray)( common, srcArrays[c], x, 1, FALSE )[0];
+                            transformBlock( srcRow[y], dstRow[bx] );
+                        }
+                    }
+                    continue;
+                }
+
+                // a row pair is swapped through scratch, since one access may invalidate the row of the previous
+                ::JDIMENSION width  = comp.width_in_blocks;
+                ::JDIMENSION height = comp.height_in_blocks;
+                std::vector<::JBLOCK> upper( width );
+                std::vector<::JBLOCK> lower( width );
+                auto mirrorRow = [&]( ::JBLOCKROW row, ::JBLOCK* out ){
+                    for ( ::JDIMENSION bx = 0; bx < width; ++bx ){
+                        transformBlock( row[o.flip_horizontal ? width - 1 - bx : bx], out[bx] );
+                    }
+                };
+                for ( ::JDIMENSION by = 0; by < ( o.flip_vertical ? ( height + 1 ) / 2 : height ); ++by ){
+                    ::JDIMENSION mirrored = o.flip_vertical ? height - 1 - by : by;
+                    mirrorRow( (*src->mem->access_virt_barray)( common, srcArrays[c], by, 1, TRUE )[0], upper.data() );
+                    if ( mirrored != by ){
+                        ::JBLOCKROW row = (*src->mem->access_virt_barray)( common, srcArrays[c], mirrored, 1, TRUE )[0];
+                        mirrorRow( row, lower.data() );
+                        std::memcpy( row, upper.data(), width * sizeof( ::JBLOCK ) );
+                    }
+                    ::JBLOCKROW row = (*src->mem->access_virt_barray)( common, srcArrays[c], by, 1, TRUE )[0];
+                    std::memcpy( row, mirrored != by ? lower.data() : upper.data(), width * sizeof( ::JBLOCK ) );
+                }
+            }
+
+            ::jpeg_write_coefficients( dst.get(), o.transpose ? dstArrays.data() : srcArrays );
+            ::jpeg_finish_compress( dst.get() );
+            ::jpeg_finish_decompress( src.get() );
+        }
+
+        std::vector<uint8_t> Image::getPixel( size_t x, size_t y ) const
+        {
+            if ( y >= m_height ){
                 throw std::out_of_range( "Y value too large" );
             }
-            if (x > m_bitmapData[0].size() / m_pixelSize){
+            if ( x >= m_width ){
                 throw std::out_of_range( "X value too large" );
             }
-            std::vector<uint8_t> vec;
-            vec.reserve(m_pixelSize);
-            for (size_t n = 0; n < m_pixelSize; ++n){
-                vec.push_back( m_bitmapData[ y ][ x * m_pixelSize + n ] );
-            }
-            return vec;
+            const uint8_t* p = pixelUnchecked( x, y );
+            return std::vector<uint8_t>( p, p + m_pixelSize );
         }
 
-        void Image::setPixel(size_t x, size_t y, std::vector<uint8_t> pixelValue)
+        void Image::setPixel(size_t x, size_t y, const std::vector<uint8_t>& pixelValue)
         {
-            if ( y >= m_bitmapData.size() ){
-                std::cout<<"y:"<<y<<" m_bitmapData:"<<m_bitmapData.size()<<"\n";
+            if ( y >= m_height ){
                 throw std::out_of_range( "SetPixel: Y value too large" );
             }
-            if ( x >= (m_bitmapData[0].size() / m_pixelSize) ){
-                std::cout<<"x:"<<x<<" m_bitmapData:"<<m_bitmapData[0].size()/m_pixelSize<<"\n";
+            if ( x >= m_width ){
                 throw std::out_of_range( "SetPixel: X value too large" );
             }
-            for ( size_t n = 0; n < m_pixelSize; ++n ){
-                m_bitmapData[ y ][ x * m_pixelSize + n ] = pixelValue[n];
-            }
+            std::copy_n( pixelValue.begin(), m_pixelSize, pixelUnchecked( x, y ) );
         }
 
 
-        void Image::resize( size_t newHeight, size_t newWidth )
+        void Image::resize( size_t newHeight, size_t newWidth, augmentorLib::resize_filter filter )
         {
             if (newHeight == 0 || newWidth == 0){
                 std::cout<< "Invalid height or width value";
                 return;
             }
 
-            float scaleFactor = static_cast<float>(newWidth) / m_width;
-            float scaleFactorRow = static_cast<float>(newHeight) / m_height;
-            std::vector<std::vector<uint8_t>> vecNewBitmap;
-            vecNewBitmap.reserve( newHeight );
-
-            for ( size_t row = 0; row < newHeight; ++row )
+            augmentorLib::resampler resample( filter, m_width, m_height, newWidth, newHeight );
+            const Image& source = *this;
+            Image resized(newWidth, newHeight, m_pixelSize, m_colourSpace);
+            // only read, so the pixels stay shared with any copies
+            augmentorLib::sample_plane from{ const_cast<uint8_t*>( source.getData() ), m_stride, m_width * m_pixelSize,
+                                             m_height };
+            augmentorLib::sample_plane to{ resized.getData(), resized.getStride(), newWidth * m_pixelSize, newHeight };
+            // output rows only read the source, so they split into ranges across workers
+            augmentorLib::Scheduler::parallel_for( newHeight, newWidth, [&]( size_t first, size_t last )
             {
-                size_t oldRow = row / scaleFactorRow;
-                std::vector<uint8_t> vecNewLine( newWidth * m_pixelSize );
-                for ( size_t col = 0; col < newWidth; ++col )
-                {
-                    size_t oldCol = col / scaleFactor;
-                    for ( size_t n = 0; n < m_pixelSize; ++n )
-                    {
-                        vecNewLine[ col * m_pixelSize + n ] =
-                                m_bitmapData[ oldRow ][ oldCol * m_pixelSize + n ];
-                    }
-                }
-                vecNewBitmap.push_back( vecNewLine );
-            }
-            m_bitmapData = vecNewBitmap;
-            m_height = m_bitmapData.size();
-            m_width = m_bitmapData[0].size() / m_pixelSize;
+                resample.rows( from, to, m_pixelSize, first, last );
+            } );
+            swap(resized);
         }
 
     } // namespace marengo
@@ -1,30 +1,253 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
+#include "Geometry.h"
+
 // forward declarations of jpeglib struct
 struct jpeg_error_mgr;
+struct jpeg_compress_struct;
 
 namespace jpegimageSTL::jpeg
     {
 
+        /// A non-owning view of one row of an Image
+        ///
+        /// Gives zero-copy access to the interleaved components of a row. The view stays valid until the image
+        /// it was taken from is resized, reassigned or destroyed.
+        /// \tparam T uint8_t for a writable row, const uint8_t for a read-only one
+        template<typename T>
+        class basic_row_span
+        {
+        private:
+            T*     m_data;
+            size_t m_width;
+            size_t m_pixelSize;
+
+        public:
+            basic_row_span( T* data, size_t width, size_t pixelSize ):
+                    m_data{data}, m_width{width}, m_pixelSize{pixelSize} {}
+
+            /// Pointer to the first component of the row
+            [[nodiscard]] T* data() const { return m_data; }
+            /// Number of pixels in the row
+            [[nodiscard]] size_t size() const { return m_width; }
+            /// Number of bytes covered by the row's pixels (excludes stride padding)
+            [[nodiscard]] size_t bytes() const { return m_width * m_pixelSize; }
+            [[nodiscard]] size_t pixelSize() const { return m_pixelSize; }
+
+            /// Pointer to the first component of pixel x. Not bounds checked.
+            T* operator[]( size_t x ) const { return m_data + x * m_pixelSize; }
+
+            T* begin() const { return m_data; }
+            T* end()   const { return m_data + m_width * m_pixelSize; }
+        };
+
+        typedef basic_row_span< uint8_t >       row_span;
+        typedef basic_row_span< const uint8_t > const_row_span;
+
+        /// Hints that let the decoder skip work a pipeline would throw away
+        struct decode_options
+        {
+            /// When non-zero, decode with DCT-domain scaling (scale_num/8) to the smallest size that is still at
+            /// least min_width x min_height. Sources already smaller are decoded at full size.
+            size_t min_width  = 0;
+            size_t min_height = 0;
+
+            /// When non-zero, only the crop_width x crop_height window at the centre of the (scaled) source is
+            /// decoded, at offset (width / 2 - crop_width / 2, height / 2 - crop_height / 2). Rows outside it are
+            /// skipped, and with libjpeg-turbo so are the iMCU columns outside it.
+            size_t crop_width  = 0;
+            size_t crop_height = 0;
+
+            /// Rows handed to libjpeg per jpeg_read_scanlines() call; 0 uses the decoder's rec_outbuf_height
+            size_t block_height = 16;
+
+            [[nodiscard]] bool scaled() const { return min_width != 0 || min_height != 0; }
+            [[nodiscard]] bool cropped() const { return crop_width != 0 || crop_height != 0; }
+        };
+
+        /// Forward DCT used by the encoder, see libjpeg's J_DCT_METHOD
+        enum class dct_method { ISLOW, IFAST, FLOAT };
+
+        /// Chroma subsampling of 3-component output
+        enum class chroma_subsampling { YUV444, YUV422, YUV420 };
+
+        /// Settings of the JPEG encoder
+        struct encode_options
+        {
+            /// 0-100
+            int quality = 95;
+            dct_method dct = dct_method::ISLOW;
+            /// Compute optimal Huffman tables (an extra pass over the coefficients, smaller files)
+            bool optimize_coding = false;
+            chroma_subsampling subsampling = chroma_subsampling::YUV420;
+            bool progressive = false;
+            /// Rows handed to libjpeg per jpeg_write_scanlines() call
+            size_t block_height = 16;
+
+            /// libjpeg's defaults at quality 95, what save() has always produced
+            static encode_options standard() { return encode_options{}; }
+
+            /// Cheapest encode: fast integer DCT, default Huffman tables
+            static encode_options fast( int quality = 90 )
+            {
+                encode_options options;
+                options.quality = quality;
+                options.dct = dct_method::IFAST;
+                return options;
+            }
+
+            /// Smallest files: optimised Huffman tables and progressive scans, at the cost of encode time
+            static encode_options compact( int quality = 90 )
+            {
+                encode_options options;
+                options.quality = quality;
+                options.optimize_coding = true;
+                options.progressive = true;
+                return options;
+            }
+        };
+
+        /// One of the eight transforms of the pixel grid made of flips and rotations by multiples of 90°:
+        /// an optional transpose (x and y swapped), then optional horizontal and vertical mirrors
+        struct orientation
+        {
+            bool transpose       = false;
+            bool flip_horizontal = false;
+            bool flip_vertical   = false;
+
+            /// This transform followed by next
+            [[nodiscard]] orientation then( const orientation& next ) const
+            {
+                // a transpose turns a mirror made before it into the other mirror
+                orientation result;
+                result.transpose       = transpose != next.transpose;
+                result.flip_horizontal = next.flip_horizontal != ( next.transpose ? flip_vertical : flip_horizontal );
+                result.flip_vertical   = next.flip_vertical != ( next.transpose ? flip_horizontal : flip_vertical );
+                return result;
+            }
+
+            [[nodiscard]] bool identity() const { return !transpose && !flip_horizontal && !flip_vertical; }
+        };
+
+        /// Lossless transforms of a JPEG file
+        ///
+        /// Applies an orientation to the DCT coefficients of a JPEG file the way jpegtran does: blocks are moved,
+        /// transposed and have their odd frequencies negated, with no IDCT/FDCT round trip and so no generation loss.
+        /// Only the header is read on construction.
+        class Transcoder
+        {
+        private:
+            std::string m_fileName;
+            size_t      m_width     = 0;
+            size_t      m_height    = 0;
+            // iMCU size in pixels, the unit blocks move in
+            size_t      m_mcuWidth  = 8;
+            size_t      m_mcuHeight = 8;
+
+            // Reads the coefficients, transforms them and writes them to the destination setDestination installs
+            void transcode( const orientation& o, const std::function<void( ::jpeg_compress_struct* )>& setDestination ) const;
+
+        public:
+            /// Will throw if the file cannot be read or is not a JPEG
+            /// \param fileName path to the input file
+            explicit Transcoder( const std::string& fileName );
+
+            [[nodiscard]] size_t getWidth()  const { return m_width; }
+            [[nodiscard]] size_t getHeight() const { return m_height; }
+
+            /// Exact
+            ///
+            /// Whether o can be applied without losing the image's edges. A mirror moves the partial MCU at the
+            /// right or bottom edge to the opposite side, where it cannot go, so a mirrored dimension has to be a
+            /// whole number of MCUs. Transposes alone are always exact.
+            [[nodiscard]] bool exact( const orientation& o ) const;
+
+            /// Save
+            ///
+            /// Writes the file transformed by o. Quantisation and sampling are carried over from the source.
+            /// \param fileName output path
+            /// \param o transform to apply; will throw std::invalid_argument if it is not exact()
+            void save( const std::string& fileName, const orientation& o ) const;
+
+            /// Encode
+            ///
+            /// Same as save(), into memory
+            /// \param o transform to apply; will throw std::invalid_argument if it is not exact()
+            /// \return The JPEG stream
+            [[nodiscard]] std::vector<uint8_t> encode( const orientation& o ) const;
+        };
+
         class Image
         {
         private:
             // Note that m_errorMgr is a shared ptr and will be shared
             // between objects if one copy constructs from another
             std::shared_ptr< ::jpeg_error_mgr > m_errorMgr;
-            std::vector< std::vector<uint8_t> > m_bitmapData;
-            size_t                            m_width;
-            size_t                            m_height;
-            size_t                            m_pixelSize;
-            int                               m_colourSpace;
+            // All rows live in one contiguous, row_alignment-aligned block drawn from BufferPool::current().
+            // Row y starts at m_bitmapData + y * m_stride. Copies share the block until one of them writes.
+            std::shared_ptr< uint8_t >          m_bitmapData;
+            // Set on both sides of a copy, cleared once the buffer is known to be exclusively ours again
+            mutable std::atomic<bool>         m_shared{false};
+            size_t                            m_width       = 0;
+            size_t                            m_height      = 0;
+            size_t                            m_pixelSize   = 0;
+            size_t                            m_stride      = 0;
+            int                               m_colourSpace = 0;
+
+            // Allocates (uninitialised) storage for the current width, height and pixel size
+            void allocate();
+
+            // Copy on write: gives this image its own buffer before it is written to if it may be shared
+            void prepareWrite()
+            {
+                if ( m_shared.load( std::memory_order_relaxed ) ){
+                    detach();
+                }
+            }
+
+            void detach();
+
+            // Decodes a JPEG stream into this image
+            void decode( const uint8_t* data, size_t size, const decode_options& options );
+
+            // Encodes this image through a compressor whose error handler and destination are set up
+            void compress( ::jpeg_compress_struct* compressInfo, const encode_options& options ) const;
+
+            // Throw std::out_of_range in debug builds, compile to nothing when NDEBUG is defined
+            void checkRow( [[maybe_unused]] size_t y ) const
+            {
+#ifndef NDEBUG
+                if ( y >= m_height ){
+                    throw std::out_of_range( "Y value too large" );
+                }
+#endif
+            }
+
+            void checkBounds( [[maybe_unused]] size_t x, [[maybe_unused]] size_t y ) const
+            {
+                checkRow( y );
+#ifndef NDEBUG
+                if ( x >= m_width ){
+                    throw std::out_of_range( "X value too large" );
+                }
+#endif
+            }
 
         public:
             typedef uint8_t pixel_value_type;
+            typedef jpegimageSTL::jpeg::decode_options decode_options_type;
+            typedef jpegimageSTL::jpeg::orientation orientation_type;
+
+            /// Alignment in bytes of the pixel buffer and of every row within it
+            static constexpr size_t row_alignment = 64;
 
             ///Image constructor
             ///
@@ -41,18 +264,89 @@ namespace jpegimageSTL::jpeg
             );
 
 
+            /// Image factory
+            ///
+            /// Like Image( size_t x, size_t y, size_t pixelSize, int colourSpace ), but leaves the pixels uninitialised
+            /// instead of zeroing them. For operations that write every pixel of their output before reading any.
+            /// \param x width of the image
+            /// \param y height of the image
+            /// \param pixelSize size of a single pixel
+            /// \param colourSpace Type of the colourSpace
+            /// \return an image whose pixel values are unspecified
+            static Image uninitialised( size_t x, size_t y, size_t pixelSize = 3, int colourSpace = 2 );
+
             /// Image constructor
             ///
             /// Construct with an existing file. Will throw if file cannot be loaded, or is in the wrong format or some other error is encountered.
             /// \param fileName path to the input file
             explicit Image( const std::string& fileName );
 
+            /// Image constructor
+            ///
+            /// Construct with an existing file, decoding only as much of it as options asks for.
+            /// \param fileName path to the input file
+            /// \param options decode hints, see decode_options
+            Image( const std::string& fileName, const decode_options& options );
+
+            /// Image constructor
+            ///
+            /// Decode JPEG bytes already in memory (e.g. read from a tar shard or a cache) without touching the
+            /// filesystem. Will throw if the bytes are not a JPEG the library can decode.
+            /// \param data first byte of the JPEG stream
+            /// \param size number of bytes in the stream
+            /// \param options decode hints, see decode_options
+            Image( const uint8_t* data, size_t size, const decode_options& options = decode_options{} );
+
+            /// Image constructor
+            ///
+            /// Wraps pixels that live elsewhere, e.g. in a memory mapped file, without copying them. The image only
+            /// reads them: the first write gives it a private copy (see Image( const Image& rhs )).
+            /// Will throw std::invalid_argument if the buffer or stride is not row_alignment aligned.
+            /// \param pixels first byte of row 0; the shared_ptr keeps the underlying storage alive
+            /// \param x width of the image
+            /// \param y height of the image
+            /// \param pixelSize size of a single pixel
+            /// \param colourSpace Type of the colourSpace
+            /// \param stride bytes between the starts of two rows
+            Image( std::shared_ptr<uint8_t> pixels, size_t x, size_t y, size_t pixelSize, int colourSpace, size_t stride );
+
             /// copy constructor
             ///
             /// We can construct from an existing image object. This allows us to work on a copy (e.g. shrink then save) without affecting the original we have in memory.
+            /// The pixels are shared copy-on-write: the copy is cheap, and whichever image is written to first gets its own buffer.
             /// \param rhs Source image object
             Image( const Image& rhs );
 
+            /// copy assignment
+            ///
+            /// Shares the pixels of rhs copy-on-write, see Image( const Image& rhs ).
+            /// \param rhs Source image object
+            Image& operator=( const Image& rhs );
+
+            /// move constructor
+            ///
+            /// Takes over the pixel buffer of rhs without copying it. rhs is left as an empty (0x0) image.
+            /// \param rhs Source image object
+            Image( Image&& rhs ) noexcept;
+
+            /// move assignment
+            ///
+            /// Takes over the pixel buffer of rhs, releasing the one held by this image. rhs is left as an empty (0x0) image.
+            /// \param rhs Source image object
+            Image& operator=( Image&& rhs ) noexcept;
+
+            /// Whether the pixel buffer may currently be shared with another image
+            [[nodiscard]] bool isShared() const { return m_shared.load( std::memory_order_relaxed ); }
+
+            /// Number of bytes the pixel buffer occupies
+            [[nodiscard]] size_t getByteSize() const { return m_stride * m_height; }
+
+            /// Swap
+            ///
+            /// Exchanges the pixel buffers and dimensions of two images in constant time.
+            /// \param other image to swap with
+            void swap( Image& other ) noexcept;
+
             ~Image();
 
             Image();
@@ -65,17 +359,86 @@ namespace jpegimageSTL::jpeg
             /// @note Will throw if file cannot be saved. Quality's usable values are 0-100
             void save( const std::string& fileName, int quality = 95 ) const;
 
+            /// Save
+            ///
+            /// saves the image to the path specified
+            /// \param fileName output path to save the image to
+            /// \param options encoder settings
+            /// @note Will throw if file cannot be saved.
+            void save( const std::string& fileName, const encode_options& options ) const;
+
+            /// Encode
+            ///
+            /// Encodes the image into memory, e.g. to pack it into a shard, without touching the filesystem.
+            /// \param options encoder settings
+            /// \return The JPEG stream
+            [[nodiscard]] std::vector<uint8_t> encode( const encode_options& options = encode_options{} ) const;
+
             [[nodiscard]] size_t getHeight()    const { return m_height; }
             [[nodiscard]] size_t getWidth()     const { return m_width;  }
             [[nodiscard]] size_t getPixelSize() const { return m_pixelSize; }
             [[nodiscard]] int getColorSpace() const { return m_colourSpace; }
 
+            /// Number of bytes between the starts of two consecutive rows. Always a multiple of row_alignment
+            /// and at least getWidth() * getPixelSize().
+            [[nodiscard]] size_t getStride() const { return m_stride; }
+
+            /// Raw pointer to the first byte of the pixel buffer (row 0), or nullptr for an empty image.
+            /// The non-const accessors below unshare a copy-on-write buffer first, read through a const Image
+            /// when no writes are intended.
+            [[nodiscard]] uint8_t* getData() { prepareWrite(); return m_bitmapData.get(); }
+            [[nodiscard]] const uint8_t* getData() const { return m_bitmapData.get(); }
+
+            /// Raw pointer to the first byte of row y. Pixels are packed as getPixelSize() interleaved components.
+            /// \param y row index, must be less than getHeight()
+            [[nodiscard]] uint8_t* getRow( size_t y ) { prepareWrite(); return m_bitmapData.get() + y * m_stride; }
+            [[nodiscard]] const uint8_t* getRow( size_t y ) const { return m_bitmapData.get() + y * m_stride; }
+
+            /// Row
+            ///
+            /// Zero-copy view of row y. Bounds are checked in debug builds only (when NDEBUG is not defined).
+            /// \param y row index
+            [[nodiscard]] row_span row( size_t y )
+            {
+                checkRow( y );
+                return row_span( getRow( y ), m_width, m_pixelSize );
+            }
+
+            [[nodiscard]] const_row_span row( size_t y ) const
+            {
+                checkRow( y );
+                return const_row_span( getRow( y ), m_width, m_pixelSize );
+            }
+
+            /// Pixel
+            ///
+            /// Pointer to the getPixelSize() components of the pixel at x,y, which can be read or written in place.
+            /// Bounds are checked in debug builds only (when NDEBUG is not defined).
+            /// \param x x coordinate of the pixel
+            /// \param y y coordinate of the pixel
+            [[nodiscard]] uint8_t* pixel( size_t x, size_t y )
+            {
+                checkBounds( x, y );
+                return pixelUnchecked( x, y );
+            }
+
+            [[nodiscard]] const uint8_t* pixel( size_t x, size_t y ) const
+            {
+                checkBounds( x, y );
+                return pixelUnchecked( x, y );
+            }
+
+            /// Same as pixel() but never bounds checked, for inner loops that have already clipped their coordinates
+            [[nodiscard]] uint8_t* pixelUnchecked( size_t x, size_t y ) { return getRow( y ) + x * m_pixelSize; }
+            [[nodiscard]] const uint8_t* pixelUnchecked( size_t x, size_t y ) const { return getRow( y ) + x * m_pixelSize; }
+
             /// GetPixel
             ///
             /// Will return a vector of pixel components. The vector's size will be 1 for monochrome or 3 for RGB. Elements for the latter will be in order R, G, B.
             /// \param x x coordinate of the pizel
             /// \param y y cooridinate of the pixel
             /// \return A pixelvalue: vector of characters that make that pixel
+            /// @note Allocates on every call, prefer row() or pixel() in loops
             [[nodiscard]] std::vector<uint8_t> getPixel( size_t x, size_t y ) const;
 
             /// Set Pixel
@@ -84,11 +447,22 @@ namespace jpegimageSTL::jpeg
             /// \param x x coordinate of the pizel
             /// \param y y cooridinate of the pixel
             /// \param pixelValue An RGB vector of characters [R, G, B] that make that pixel
-            void setPixel(size_t x, size_t y, std::vector<uint8_t> pixelValue);
+            void setPixel(size_t x, size_t y, const std::vector<uint8_t>& pixelValue);
 
-            // Convenience function to resize image using height, width
-            void resize( size_t newHeight, size_t newWidth );
+            /// Resize
+            ///
+            /// Resamples the image to newWidth x newHeight with filter, see augmentorLib::resampler
+            /// \param newHeight height of the resized image
+            /// \param newWidth width of the resized image
+            /// \param filter how the source pixels under each output pixel are weighed
+            void resize( size_t newHeight, size_t newWidth,
+                         augmentorLib::resize_filter filter = augmentorLib::resize_filter::NEAREST );
 
         };
 
+        inline void swap( Image& lhs, Image& rhs ) noexcept
+        {
+            lhs.swap( rhs );
+        }
+
     }
@@ -5,6 +5,47 @@
 #include "gtest/gtest.h"
 #include "Augmentor.h"
 #include "jpeg.h"
+#include <filesystem>
+#include <thread>
+#include <cstring>
+#include <fstream>
+
+namespace {
+    // Writes count synthetic gradient images into a fresh directory under the temp path, returned with a trailing /
+    std::string make_input_dir(const std::string& name, size_t count, size_t width = 64, size_t height = 48)
+    {
+        auto dir = std::filesystem::temp_directory_path() / ("augmentor_" + name);
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directories(dir);
+        for (size_t i = 0; i < count; ++i) {
+            Image image(width, height);
+            for (size_t y = 0; y < height; ++y) {
+                for (size_t x = 0; x < width; ++x) {
+                    auto p = image.pixel(x, y);
+                    p[0] = x * 255 / width;
+                    p[1] = y * 255 / height;
+                    p[2] = (i * 40) & 0xff;
+                }
+            }
+            image.save((dir / ("input_" + std::to_string(i) + ".jpg")).string());
+        }
+        return dir.string() + "/";
+    }
+
+    std::string read_file(const std::string& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    }
+
+    std::string make_output_dir(const std::string& name)
+    {
+        auto dir = std::filesystem::temp_directory_path() / ("augmentor_" + name);
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directories(dir);
+        return dir.string() + "/";
+    }
+}
 
 class AugmentorTest : public ::testing::Test {
 
@@ -86,8 +127,1199 @@ TEST_F(AugmentorTest, rotate0)
 }
 
 
+TEST(ImageTest, pixelAccess0)
+{
+    Image image(5, 4);
+    uint8_t* p = image.pixel(4, 3);
+    p[0] = 1; p[1] = 2; p[2] = 3;
+
+    EXPECT_TRUE(image.row(3)[4] == p);
+    EXPECT_TRUE(image.getPixel(4, 3) == (std::vector<uint8_t>{1, 2, 3}));
+    EXPECT_EQ(image.row(0).bytes(), 15u);
+    EXPECT_EQ(image.getStride() % Image::row_alignment, 0u);
+    EXPECT_THROW(image.getPixel(5, 0), std::out_of_range);
+    EXPECT_THROW(image.getPixel(0, 4), std::out_of_range);
+}
+
+TEST(ImageTest, flip0)
+{
+    Image image(3, 2);
+    image.setPixel(0, 0, {10, 20, 30});
+    augmentorLib::FlipOperation<Image>(HORIZONTAL).perform(&image);
+    EXPECT_TRUE(image.getPixel(2, 0) == (std::vector<uint8_t>{10, 20, 30}));
+    augmentorLib::FlipOperation<Image>(VERTICAL).perform(&image);
+    EXPECT_TRUE(image.getPixel(2, 1) == (std::vector<uint8_t>{10, 20, 30}));
+}
+
+TEST(ImageTest, move0)
+{
+    Image image(4, 2);
+    image.setPixel(1, 1, {7, 8, 9});
+    const uint8_t* buffer = image.getData();
+
+    Image moved(std::move(image));
+    EXPECT_EQ(moved.getData(), buffer);
+    EXPECT_EQ(image.getWidth(), 0u);
+
+    Image other(2, 2);
+    other.swap(moved);
+    EXPECT_EQ(other.getData(), buffer);
+    EXPECT_TRUE(other.getPixel(1, 1) == (std::vector<uint8_t>{7, 8, 9}));
+    EXPECT_EQ(moved.getWidth(), 2u);
+}
+
+TEST(BufferPoolTest, reuse0)
+{
+    auto pool = BufferPool::create();
+    {
+        BufferPool::scoped_use use_pool(pool);
+        Image first(64, 64);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(first.getData()) % BufferPool::alignment, 0u);
+    }
+    {
+        BufferPool::scoped_use use_pool(pool);
+        Image second(64, 64);
+    }
+    auto stats = pool->stats();
+    EXPECT_EQ(stats.requests, 2u);
+    EXPECT_EQ(stats.reuses, 1u);
+    EXPECT_EQ(stats.bytes_held, stats.bytes_cached);
+    pool->trim();
+    EXPECT_EQ(pool->stats().bytes_held, 0u);
+}
+
+TEST(ImageCacheTest, copyOnWrite0)
+{
+    auto in = make_input_dir("cache_in", 1);
+    augmentorLib::ImageCache cache(1 << 20);
+    int loads = 0;
+    auto load = [&]() { ++loads; return Image(in + "input_0.jpg"); };
+
+    Image first = cache.get("input_0", load);
+    Image second = cache.get("input_0", load);
+    EXPECT_EQ(loads, 1);
+    EXPECT_EQ(static_cast<const Image&>(first).getData(), static_cast<const Image&>(second).getData());
+
+    auto before = static_cast<const Image&>(second).getPixel(0, 0);
+    augmentorLib::InvertOperation<Image>().perform(&first);
+    EXPECT_TRUE(static_cast<const Image&>(second).getPixel(0, 0) == before);
+    EXPECT_TRUE(cache.get("input_0", load).getPixel(0, 0) == before);
+
+    auto stats = cache.stats();
+    EXPECT_EQ(stats.hits, 2u);
+    EXPECT_EQ(stats.misses, 1u);
+}
+
+TEST(ImageCacheTest, rotate0)
+{
+    auto in = make_input_dir("cache_rotate_in", 1);
+    augmentorLib::ImageCache cache(1 << 20);
+    auto load = [&]() { return Image(in + "input_0.jpg"); };
+    Image cached = cache.get("input_0", load);
+    const uint8_t* buffer = static_cast<const Image&>(cached).getData();
+
+    auto pool = BufferPool::create();
+    {
+        BufferPool::scoped_use use_pool(pool);
+        Image image = cache.get("input_0", load);
+        augmentorLib::RotateOperation<Image>({17, 17}).perform(&image);
+    }
+    // one buffer for the rotated output, none for a private copy of the source
+    EXPECT_EQ(pool->stats().requests, 1u);
+    EXPECT_TRUE(cached.isShared());
+    EXPECT_EQ(static_cast<const Image&>(cache.get("input_0", load)).getData(), buffer);
+}
+
+TEST(ImageCacheTest, sample0)
+{
+    auto in = make_input_dir("sample_cache_in", 2);
+    auto out = make_output_dir("sample_cache_out");
+    augmentorLib::Augmentor augmentor(in, out);
+    augmentor.cache(1 << 20).invert(1).sample(6);
+
+    auto stats = augmentor.cache_stats();
+    EXPECT_EQ(stats.hits + stats.misses, 6u);
+    EXPECT_LE(stats.misses, 2u);
+}
+
+TEST(DatasetStoreTest, roundTrip0)
+{
+    auto in = make_input_dir("store_in", 2);
+    auto out = make_output_dir("store_out");
+    std::vector<std::string> sources{in + "input_0.jpg", in + "input_1.jpg"};
+    auto store = augmentorLib::DatasetStore::open(out + "photos.store", sources);
+    ASSERT_EQ(store->size(), 2u);
+
+    auto stored = store->find(sources[1]);
+    ASSERT_TRUE(stored.has_value());
+    Image decoded(sources[1]);
+    EXPECT_EQ(stored->getWidth(), decoded.getWidth());
+    EXPECT_TRUE(stored->getPixel(10, 10) == decoded.getPixel(10, 10));
+
+    // writes go to a private copy, never to the mapping
+    augmentorLib::InvertOperation<Image>().perform(&*stored);
+    EXPECT_TRUE(store->find(sources[1])->getPixel(10, 10) == decoded.getPixel(10, 10));
+
+    // a rewritten source invalidates its entry
+    std::filesystem::last_write_time(sources[0], std::filesystem::last_write_time(sources[0]) + std::chrono::seconds(5));
+    EXPECT_FALSE(augmentorLib::DatasetStore(out + "photos.store").find(sources[0]).has_value());
+    EXPECT_EQ(augmentorLib::DatasetStore::open(out + "photos.store", sources)->size(), 2u);
+
+    // an index left behind next to a different blob is refused, and open() rebuilds
+    std::filesystem::resize_file(out + "photos.store", std::filesystem::file_size(out + "photos.store") + 4096);
+    EXPECT_THROW(augmentorLib::DatasetStore(out + "photos.store"), std::runtime_error);
+    EXPECT_EQ(augmentorLib::DatasetStore::open(out + "photos.store", sources)->size(), 2u);
+}
+
+TEST(DecodeTest, scaled0)
+{
+    auto in = make_input_dir("scaled_in", 1, 640, 480);
+    decode_options options;
+    options.min_width = 150;
+    options.min_height = 100;
+    Image image(in + "input_0.jpg", options);
+    EXPECT_EQ(image.getWidth(), 160u);
+    EXPECT_EQ(image.getHeight(), 120u);
+
+    auto out = make_output_dir("scaled_out");
+    augmentorLib::Augmentor augmentor(in, out);
+    augmentor.resize(100, 120, 1).sample(1);
+    Image result(out + "output_0.jpg");
+    EXPECT_EQ(result.getHeight(), 100u);
+    EXPECT_EQ(result.getWidth(), 120u);
+}
+
+TEST(DecodeTest, cropped0)
+{
+    auto in = make_input_dir("cropped_in", 1, 640, 480);
+    decode_options options;
+    options.crop_width = 100;
+    options.crop_height = 60;
+    Image window(in + "input_0.jpg", options);
+    ASSERT_EQ(window.getWidth(), 100u);
+    ASSERT_EQ(window.getHeight(), 60u);
+
+    Image full(in + "input_0.jpg");
+    augmentorLib::CropOperation<Image>(augmentorLib::image_size{60, 100}, true).perform(&full);
+    int max_diff = 0;
+    for (size_t y = 0; y < window.getHeight(); ++y) {
+        for (size_t x = 0; x < window.row(y).bytes(); ++x) {
+            max_diff = std::max(max_diff, std::abs(window.row(y).data()[x] - full.row(y).data()[x]));
+        }
+    }
+    // only chroma upsampling at the window's edges may differ
+    EXPECT_LE(max_diff, 2);
+}
+
+TEST(DecodeTest, memory0)
+{
+    auto in = make_input_dir("memory_in", 1);
+    std::ifstream file(in + "input_0.jpg", std::ios::binary);
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    Image from_memory(bytes.data(), bytes.size());
+    Image from_file(in + "input_0.jpg");
+    EXPECT_EQ(from_memory.getWidth(), from_file.getWidth());
+    EXPECT_TRUE(from_memory.getPixel(30, 20) == from_file.getPixel(30, 20));
+
+    std::vector<uint8_t> garbage(100, 0x42);
+    EXPECT_THROW(Image(garbage.data(), garbage.size()), std::runtime_error);
+    EXPECT_THROW(Image(in + "missing.jpg"), std::runtime_error);
+}
+
+TEST(DecodeTest, blockHeight0)
+{
+    auto in = make_input_dir("block_in", 1, 100, 75);
+    decode_options one_row;
+    one_row.block_height = 1;
+    decode_options odd_block;
+    odd_block.block_height = 7;
+    odd_block.crop_width = 50;
+    odd_block.crop_height = 41;
+    Image single(in + "input_0.jpg", one_row);
+    Image batched(in + "input_0.jpg");
+    Image cropped(in + "input_0.jpg", odd_block);
+    for (size_t y = 0; y < single.getHeight(); ++y) {
+        EXPECT_TRUE(std::equal(single.row(y).begin(), single.row(y).end(), batched.row(y).begin()));
+    }
+    EXPECT_EQ(cropped.getHeight(), 41u);
+
+    auto out = make_output_dir("block_out");
+    encode_options encode;
+    encode.block_height = 5;
+    batched.save(out + "batched.jpg", encode);
+    single.save(out + "single.jpg");
+    EXPECT_EQ(std::filesystem::file_size(out + "batched.jpg"), std::filesystem::file_size(out + "single.jpg"));
+}
+
+TEST(EncodeTest, presets0)
+{
+    auto in = make_input_dir("presets_in", 1, 160, 120);
+    auto out = make_output_dir("presets_out");
+    Image image(in + "input_0.jpg");
+
+    encode_options options = encode_options::compact(80);
+    options.subsampling = chroma_subsampling::YUV444;
+    options.dct = dct_method::FLOAT;
+    image.save(out + "compact.jpg", options);
+    image.save(out + "fast.jpg", encode_options::fast());
+
+    Image compact(out + "compact.jpg");
+    EXPECT_EQ(compact.getWidth(), 160u);
+    EXPECT_EQ(Image(out + "fast.jpg").getHeight(), 120u);
+
+    augmentorLib::Augmentor augmentor(in, out);
+    augmentor.encoder(encode_options::fast(70)).invert(1).sample(1);
+    EXPECT_EQ(Image(out + "output_0.jpg").getWidth(), 160u);
+}
+
+TEST(CropTest, bounds0)
+{
+    Image image(64, 64);
+    augmentorLib::CropOperation<Image> wider(augmentorLib::image_size{64, 200}, true);
+    EXPECT_THROW(wider.perform(&image), std::out_of_range);
+    augmentorLib::CropOperation<Image> taller(augmentorLib::image_size{65, 64}, true);
+    EXPECT_THROW(taller.perform(&image), std::out_of_range);
+    EXPECT_EQ(image.getWidth(), 64u);
+
+    augmentorLib::CropOperation<Image> inside(augmentorLib::image_size{64, 10}, true);
+    inside.perform(&image);
+    EXPECT_EQ(image.getWidth(), 10u);
+}
+
+TEST(PassthroughTest, roll0)
+{
+    Image image(32, 16);
+    augmentorLib::InvertOperation<Image> never(0);
+    EXPECT_FALSE(never.roll());
+    never.perform(&image);
+    EXPECT_FALSE(never.changed());
+
+    augmentorLib::CropOperation<Image> same_size(augmentorLib::image_size{16, 32}, true);
+    EXPECT_TRUE(same_size.roll());
+    same_size.perform(&image);
+    EXPECT_FALSE(same_size.changed());
+
+    augmentorLib::CropOperation<Image> smaller(augmentorLib::image_size{8, 8}, true);
+    smaller.perform(&image);
+    EXPECT_TRUE(smaller.changed());
+}
+
+TEST(PassthroughTest, sample0)
+{
+    auto in = make_input_dir("passthrough_in", 1);
+    auto source = read_file(in + "input_0.jpg");
+
+    auto out = make_output_dir("passthrough_out");
+    augmentorLib::Augmentor untouched(in, out);
+    untouched.invert(0).crop(48, 64, true).sample(2);
+    EXPECT_EQ(read_file(out + "output_0.jpg"), source);
+    EXPECT_EQ(read_file(out + "output_1.jpg"), source);
+
+    auto linked = make_output_dir("passthrough_link");
+    augmentorLib::Augmentor hardlinks(in, linked);
+    hardlinks.passthrough(augmentorLib::passthrough_mode::HARDLINK).invert(0).sample(1);
+    EXPECT_EQ(read_file(linked + "output_0.jpg"), source);
+
+    auto encoded = make_output_dir("passthrough_encoded");
+    augmentorLib::Augmentor reencode(in, encoded);
+    reencode.passthrough(augmentorLib::passthrough_mode::DISABLED).invert(0).sample(1);
+    EXPECT_NE(read_file(encoded + "output_0.jpg"), source);
+
+    augmentorLib::Augmentor inverted(in, encoded);
+    inverted.invert(1).sample(1);
+    EXPECT_NE(read_file(encoded + "output_0.jpg"), source);
+}
+
+namespace {
+    // Largest component difference between image and source seen through o
+    int max_difference(const Image& image, const Image& source, const orientation& o)
+    {
+        int difference = 0;
+        for (size_t y = 0; y < image.getHeight(); ++y) {
+            for (size_t x = 0; x < image.getWidth(); ++x) {
+                size_t tx = o.flip_horizontal ? image.getWidth() - 1 - x : x;
+                size_t ty = o.flip_vertical ? image.getHeight() - 1 - y : y;
+                auto expected = o.transpose ? source.pixel(ty, tx) : source.pixel(tx, ty);
+                for (size_t c = 0; c < image.getPixelSize(); ++c) {
+                    difference = std::max(difference, std::abs(image.pixel(x, y)[c] - expected[c]));
+                }
+            }
+        }
+        return difference;
+    }
+}
+
+TEST(LosslessTest, transcoder0)
+{
+    auto in = make_input_dir("lossless_in", 1, 64, 40);
+    auto out = make_output_dir("lossless_out");
+    const Image source(in + "input_0.jpg");
+    Transcoder transcoder(in + "input_0.jpg");
+    EXPECT_EQ(transcoder.getWidth(), 64u);
+    EXPECT_EQ(transcoder.getHeight(), 40u);
+
+    orientation mirror;
+    mirror.flip_horizontal = true;
+    orientation upside_down;
+    upside_down.flip_vertical = true;
+    orientation transpose;
+    transpose.transpose = true;
+    // 40 rows leave a partial 16-row MCU at the bottom
+    EXPECT_TRUE(transcoder.exact(mirror));
+    EXPECT_FALSE(transcoder.exact(upside_down));
+    EXPECT_TRUE(transcoder.exact(transpose));
+    EXPECT_FALSE(transcoder.exact(transpose.then(mirror)));
+    EXPECT_THROW(transcoder.save(out + "upside_down.jpg", upside_down), std::invalid_argument);
+
+    for (const auto& o : {mirror, transpose, transpose.then(upside_down)}) {
+        transcoder.save(out + "transformed.jpg", o);
+        const Image transformed(out + "transformed.jpg");
+        EXPECT_EQ(transformed.getWidth(), o.transpose ? 40u : 64u);
+        // the coefficients are the same, only IDCT rounding and chroma upsampling run along other axes
+        EXPECT_LE(max_difference(transformed, source, o), 3);
+    }
+}
+
+TEST(LosslessTest, padding0)
+{
+    // block counts that are not a multiple of the 4:2:0 sampling factors leave padding blocks in the arrays
+    for (size_t size : {24, 40, 72, 88}) {
+        auto in = make_input_dir("lossless_padding_in", 1, size, size);
+        const Image source(in + "input_0.jpg");
+        orientation transpose;
+        transpose.transpose = true;
+        Transcoder transcoder(in + "input_0.jpg");
+        ASSERT_TRUE(transcoder.exact(transpose));
+        auto bytes = transcoder.encode(transpose);
+        EXPECT_LE(max_difference(Image(bytes.data(), bytes.size()), source, transpose), 3) << size;
+    }
+
+    // a quarter turn and a mirror fold into the same transpose
+    auto in = make_input_dir("lossless_padding_in", 1, 40, 40);
+    auto out = make_output_dir("lossless_padding_out");
+    augmentorLib::Augmentor augmentor(in, out);
+    augmentor.rotate(90, 90).flip(VERTICAL).sample(1);
+    EXPECT_EQ(Image(out + "output_0.jpg").getWidth(), 40u);
+}
+
+TEST(LosslessTest, sample0)
+{
+    auto in = make_input_dir("lossless_sample_in", 1, 64, 64);
+    auto out = make_output_dir("lossless_sample_out");
+    augmentorLib::Augmentor augmentor(in, out);
+    augmentor.flip(HORIZONTAL).rotate(90, 90).sample(1);
+    const Image transformed(out + "output_0.jpg");
+
+    // the pixel path turns about the same centre, so the two differ only by the re-encode
+    auto decoded_out = make_output_dir("lossless_decoded_out");
+    augmentorLib::Augmentor decoded(in, decoded_out);
+    decoded.lossless(false).flip(HORIZONTAL).rotate(90, 90).sample(1);
+    EXPECT_NE(read_file(out + "output_0.jpg"), read_file(decoded_out + "output_0.jpg"));
+    EXPECT_LE(max_difference(transformed, Image(decoded_out + "output_0.jpg"), orientation{}), 4);
+
+    // two mirrors cancel out
+    augmentorLib::Augmentor twice(in, out);
+    twice.flip(VERTICAL).flip(VERTICAL).sample(1);
+    EXPECT_EQ(read_file(out + "output_0.jpg"), read_file(in + "input_0.jpg"));
+}
+
+TEST(CloneTest, reseed0)
+{
+    augmentorLib::ResizeOperation<Image> resize(augmentorLib::image_size{8, 8}, augmentorLib::image_size{40, 40}, 1, 7);
+    auto first = resize.clone();
+    auto second = resize.clone();
+    auto third = resize.clone();
+    first->reseed(11);
+    second->reseed(11);
+    third->reseed(12);
+    std::string drawn_first, drawn_second, drawn_third;
+    for (int i = 0; i < 8; ++i) {
+        Image a(16, 16), b(16, 16), c(16, 16);
+        first->perform(&a);
+        second->perform(&b);
+        third->perform(&c);
+        drawn_first += first->describe() + ";";
+        drawn_second += second->describe() + ";";
+        drawn_third += third->describe() + ";";
+    }
+    EXPECT_EQ(drawn_first, drawn_second);
+    EXPECT_NE(drawn_first, drawn_third);
+    EXPECT_EQ(first->describe().rfind("resize ", 0), 0u);
+    EXPECT_EQ(resize.seed(), 7u);
+    EXPECT_EQ(third->seed(), 12u);
+}
+
+TEST(ParallelTest, tiles0)
+{
+    auto in = make_input_dir("parallel_tiles_in", 2, 320, 240);
+    auto out = make_output_dir("parallel_tiles_out");
+    augmentorLib::Augmentor augmentor(in, out);
+    augmentor.workers(3).tiles(10000).rapid_blur(2, 3).invert(1).sample(6);
+    for (size_t j = 0; j < 6; ++j) {
+        Image image(out + "output_" + std::to_string(j) + ".jpg");
+        EXPECT_EQ(image.getWidth(), 320u);
+    }
+}
+
+TEST(ParallelTest, reseed0)
+{
+    auto in = make_input_dir("parallel_reseed_in", 1);
+    // the operations a parallel run drew, in any order
+    auto drawn = [&in](const std::string& name) {
+        auto shards = make_output_dir(name);
+        augmentorLib::Augmentor augmentor(in, make_output_dir("parallel_reseed_unused"));
+        augmentor.workers(2).shards(shards).rotate(0, 359).sample(8);
+        augmentorLib::ShardReader reader(shards + "shard-00000.shard");
+        std::vector<std::string> operations;
+        for (size_t i = 0; i < reader.size(); ++i) {
+            auto metadata = reader.metadata(i);
+            operations.push_back(metadata.substr(metadata.find("\"operations\"")));
+        }
+        std::sort(operations.begin(), operations.end());
+        return operations;
+    };
+    // worker chains are seeded afresh for every run
+    EXPECT_NE(drawn("parallel_reseed_first"), drawn("parallel_reseed_second"));
+}
+
+TEST(ParallelTest, sample0)
+{
+    auto in = make_input_dir("parallel_in", 3);
+    auto out = make_output_dir("parallel_out");
+    augmentorLib::Augmentor augmentor(in, out);
+    augmentor.workers(4).invert(1).rotate(10, 20, 0.5).random_erase({4, 4}, {8, 8}, 0.5).sample(40);
+    for (size_t j = 0; j < 40; ++j) {
+        Image image(out + "output_" + std::to_string(j) + ".jpg");
+        EXPECT_EQ(image.getWidth(), 64u);
+        EXPECT_EQ(image.getHeight(), 48u);
+    }
+
+    auto shards = make_output_dir("parallel_shards");
+    augmentorLib::Augmentor packed(in, out);
+    packed.workers(0).shards(shards).flip(HORIZONTAL, 0.5).invert(0.5).sample(25);
+    augmentorLib::ShardReader reader(shards + "shard-00000.shard");
+    ASSERT_EQ(reader.size(), 25u);
+    std::vector<bool> seen(25);
+    for (size_t i = 0; i < reader.size(); ++i) {
+        auto metadata = reader.metadata(i);
+        auto index = std::stoul(metadata.substr(metadata.find(':') + 1));
+        ASSERT_LT(index, 25u);
+        EXPECT_FALSE(seen[index]);
+        seen[index] = true;
+    }
+}
+
+TEST(BoundedQueueTest, concurrent0)
+{
+    augmentorLib::BoundedQueue<size_t> queue(5);
+    EXPECT_EQ(queue.capacity(), 8u);
+    const size_t per_producer = 20000;
+    std::atomic<size_t> producers_left{4};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<size_t> count{0};
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < 4; ++p) {
+        threads.emplace_back([&, p]() {
+            for (size_t i = 0; i < per_producer; ++i) {
+                size_t value = p * per_producer + i;
+                EXPECT_TRUE(queue.push(value));
+            }
+            if (--producers_left == 0) {
+                queue.close();
+            }
+        });
+    }
+    for (size_t c = 0; c < 4; ++c) {
+        threads.emplace_back([&]() {
+            size_t value;
+            while (queue.pop(value)) {
+                sum += value;
+                ++count;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    const size_t n = 4 * per_producer;
+    EXPECT_EQ(count, n);
+    EXPECT_EQ(sum, static_cast<uint64_t>(n) * (n - 1) / 2);
+    EXPECT_LE(queue.peak_occupancy(), queue.capacity());
+    size_t value = 1;
+    EXPECT_FALSE(queue.push(value));
+}
+
+TEST(SchedulerTest, steal0)
+{
+    augmentorLib::Scheduler scheduler(4);
+    augmentorLib::task_group group;
+    std::atomic<size_t> done{0};
+    for (size_t i = 0; i < 200; ++i) {
+        scheduler.spawn(group, [&done, i]() {
+            // every 50th task is far more expensive, like a large image among thumbnails
+            std::this_thread::sleep_for(std::chrono::microseconds(i % 50 == 0 ? 5000 : 10));
+            ++done;
+        });
+    }
+    scheduler.wait(group);
+    EXPECT_EQ(done, 200u);
+    EXPECT_TRUE(group.done());
+
+    augmentorLib::task_group failing;
+    scheduler.spawn(failing, []() { throw std::runtime_error("task failed"); });
+    scheduler.spawn(failing, [&done]() { ++done; });
+    EXPECT_THROW(scheduler.wait(failing), std::runtime_error);
+    EXPECT_EQ(done, 201u);
+}
+
+TEST(SchedulerTest, tiles0)
+{
+    Image source(301, 203);
+    for (size_t y = 0; y < source.getHeight(); ++y) {
+        for (size_t x = 0; x < source.getWidth(); ++x) {
+            auto p = source.pixel(x, y);
+            p[0] = x * 7 + y;
+            p[1] = (x ^ y) & 0xff;
+            p[2] = y * 3;
+        }
+    }
+    auto run = [&source](augmentorLib::Operation<Image>& operation) {
+        Image image = source;
+        operation.perform(&image);
+        return image;
+    };
+    augmentorLib::InvertOperation<Image> invert;
+    augmentorLib::FlipOperation<Image> flip_h(HORIZONTAL);
+    augmentorLib::FlipOperation<Image> flip_v(VERTICAL);
+    augmentorLib::FastGaussianBlurOperation<Image> blur(2.5, 3);
+    augmentorLib::GaussianBlurOperation<Image> gaussian(1.5, size_t{7});
+    augmentorLib::RotateOperation<Image> rotate({17, 17});
+    augmentorLib::ResizeOperation<Image> resize({150, 400}, {150, 400});
+    augmentorLib::ZoomOperation<Image> zoom({1.5, 1.5});
+    augmentorLib::BlurOperation<Image> recursive(6, augmentorLib::blur_backend::IIR);
+    augmentorLib::FastGaussianBlurOperation<Image> integral(2.5, 3, augmentorLib::box_blur_mode::INTEGRAL);
+    augmentorLib::RotateOperation<Image> bilinear({-29, -29}, augmentorLib::interpolation::BILINEAR);
+    augmentorLib::ResizeOperation<Image> area({120, 80}, {120, 80}, augmentorLib::resize_filter::AREA);
+    augmentorLib::ResizeOperation<Image> lanczos({150, 400}, {150, 400}, augmentorLib::resize_filter::LANCZOS3);
+    std::vector<augmentorLib::Operation<Image>*> operations = {&invert, &flip_h, &flip_v, &blur, &gaussian, &rotate,
+                                                               &resize, &zoom, &recursive, &integral, &bilinear,
+                                                               &area, &lanczos};
+
+    augmentorLib::Scheduler scheduler(4, 1000);
+    for (auto* operation : operations) {
+        Image serial = run(*operation);
+        Image tiled;
+        augmentorLib::task_group group;
+        scheduler.spawn(group, [&]() { tiled = run(*operation); });
+        scheduler.wait(group);
+        ASSERT_EQ(serial.getWidth(), tiled.getWidth()) << operation->describe();
+        ASSERT_EQ(serial.getHeight(), tiled.getHeight()) << operation->describe();
+        for (size_t y = 0; y < serial.getHeight(); ++y) {
+            const Image& a = serial;
+            const Image& b = tiled;
+            ASSERT_EQ(std::memcmp(a.getRow(y), b.getRow(y), a.getWidth() * a.getPixelSize()), 0) << operation->describe();
+        }
+    }
+}
+
+TEST(ConvolutionTest, gaussian0)
+{
+    Image source(101, 67);
+    for (size_t y = 0; y < source.getHeight(); ++y) {
+        for (size_t x = 0; x < source.getWidth(); ++x) {
+            auto p = source.pixel(x, y);
+            p[0] = x * 7 + y;
+            p[1] = (x ^ y) & 0xff;
+            p[2] = ((x / 8 + y / 8) % 2) * 255;
+        }
+    }
+    auto clamp = [](long v, size_t size) { return static_cast<size_t>(std::clamp(v, 0l, static_cast<long>(size) - 1)); };
+    for (auto [sigma, n] : std::vector<std::pair<double, size_t>>{{1, 3}, {2.5, 11}, {8, 31}}) {
+        augmentorLib::gaussian_blur_filter_1D<> filter(sigma, n);
+        // rows, then columns of those rows, in double precision and rounded after each pass
+        const size_t w = source.getWidth(), h = source.getHeight(), c = source.getPixelSize();
+        std::vector<double> rows(w * h * c);
+        for (size_t y = 0; y < h; ++y) {
+            for (size_t x = 0; x < w; ++x) {
+                for (size_t p = 0; p < c; ++p) {
+                    double sum = 0;
+                    for (size_t k = 0; k < n; ++k) {
+                        sum += filter[k] * source.pixel(clamp(static_cast<long>(x + k) - static_cast<long>(n / 2), w), y)[p];
+                    }
+                    rows[(y * w + x) * c + p] = std::round(sum);
+                }
+            }
+        }
+
+        augmentorLib::GaussianBlurOperation<Image> gaussian(sigma, n);
+        Image image = source;
+        gaussian.perform(&image);
+        for (size_t y = 0; y < h; ++y) {
+            for (size_t x = 0; x < w; ++x) {
+                for (size_t p = 0; p < c; ++p) {
+                    double sum = 0;
+                    for (size_t k = 0; k < n; ++k) {
+                        sum += filter[k] * rows[(clamp(static_cast<long>(y + k) - static_cast<long>(n / 2), h) * w + x) * c + p];
+                    }
+                    ASSERT_NEAR(image.pixel(x, y)[p], sum, 2) << n << " at " << x << "," << y;
+                }
+            }
+        }
+
+        Image flat(w, h);
+        std::memset(flat.getData(), 77, flat.getStride() * h);
+        gaussian.perform(&flat);
+        for (size_t y = 0; y < h; ++y) {
+            for (uint8_t value : flat.row(y)) {
+                ASSERT_EQ(value, 77);
+            }
+        }
+    }
+}
+
+TEST(ConvolutionTest, backends0)
+{
+    Image source(160, 120);
+    for (size_t y = 0; y < source.getHeight(); ++y) {
+        for (size_t x = 0; x < source.getWidth(); ++x) {
+            auto p = source.pixel(x, y);
+            p[0] = x * 255 / source.getWidth();
+            p[1] = ((x / 16 + y / 16) % 2) * 255;
+            p[2] = (x * x + y * 3) & 0xff;
+        }
+    }
+    for (double sigma : {1.5, 4.0, 12.0}) {
+        augmentorLib::BlurOperation<Image> fir(sigma, augmentorLib::blur_backend::FIR);
+        Image reference = source;
+        fir.perform(&reference);
+        for (auto backend : {augmentorLib::blur_backend::BOX, augmentorLib::blur_backend::IIR}) {
+            augmentorLib::BlurOperation<Image> blur(sigma, backend);
+            Image image = source;
+            blur.perform(&image);
+            double error = 0;
+            for (size_t y = 0; y < image.getHeight(); ++y) {
+                const Image& a = image;
+                for (size_t i = 0; i < image.getWidth() * image.getPixelSize(); ++i) {
+                    error += std::abs(a.getRow(y)[i] - static_cast<const Image&>(reference).getRow(y)[i]);
+                }
+            }
+            error /= image.getWidth() * image.getHeight() * image.getPixelSize();
+            EXPECT_LT(error, 3) << blur.describe();
+        }
+
+        augmentorLib::BlurOperation<Image> iir(sigma, augmentorLib::blur_backend::IIR);
+        Image flat(source.getWidth(), source.getHeight());
+        std::memset(flat.getData(), 77, flat.getStride() * flat.getHeight());
+        iir.perform(&flat);
+        for (size_t y = 0; y < flat.getHeight(); ++y) {
+            for (uint8_t value : flat.row(y)) {
+                ASSERT_EQ(value, 77);
+            }
+        }
+    }
+
+    augmentorLib::BlurOperation<Image> small(1);
+    Image image = source;
+    small.perform(&image);
+    EXPECT_EQ(small.describe(), "blur 1 fir");
+    augmentorLib::BlurOperation<Image> large(20);
+    large.perform(&image);
+    EXPECT_EQ(large.describe(), "blur 20 iir");
+    EXPECT_THROW(augmentorLib::BlurOperation<Image>(0.3, augmentorLib::blur_backend::IIR), std::invalid_argument);
+}
+
+TEST(ConvolutionTest, box0)
+{
+    Image source(83, 61);
+    for (size_t y = 0; y < source.getHeight(); ++y) {
+        for (size_t x = 0; x < source.getWidth(); ++x) {
+            auto p = source.pixel(x, y);
+            p[0] = x * 3 + y;
+            p[1] = (x ^ y) * 5 & 0xff;
+            p[2] = ((x / 4 + y / 4) % 2) * 255;
+        }
+    }
+    const long w = source.getWidth(), h = source.getHeight(), c = source.getPixelSize();
+    // the mean of a box of edge-clamped pixels, rounded
+    auto box = [&](const Image& image, long x, long y, long p, long width, long height) {
+        long sum = 0;
+        for (long v = y - height / 2; v <= y + height / 2; ++v) {
+            for (long u = x - width / 2; u <= x + width / 2; ++u) {
+                sum += image.pixel(std::clamp(u, 0l, w - 1), std::clamp(v, 0l, h - 1))[p];
+            }
+        }
+        long area = width * height;
+        return static_cast<uint8_t>((2 * sum + area) / (2 * area));
+    };
+
+    for (long length : {1, 5, 31, 201}) {
+        Image columns(w, h), expected(w, h);
+        for (long y = 0; y < h; ++y) {
+            for (long x = 0; x < w; ++x) {
+                for (long p = 0; p < c; ++p) {
+                    columns.pixel(x, y)[p] = box(source, x, y, p, 1, length);
+                }
+            }
+        }
+        for (long y = 0; y < h; ++y) {
+            for (long x = 0; x < w; ++x) {
+                for (long p = 0; p < c; ++p) {
+                    expected.pixel(x, y)[p] = box(columns, x, y, p, length, 1);
+                }
+            }
+        }
+        augmentorLib::BoxBlurOperation<Image> blur(length);
+        Image image = source;
+        blur.perform(&image);
+        for (long y = 0; y < h; ++y) {
+            ASSERT_EQ(std::memcmp(static_cast<const Image&>(image).getRow(y),
+                                  static_cast<const Image&>(expected).getRow(y), w * c), 0) << length;
+        }
+    }
+
+    // boxes of up to 63 x 63 and beyond, which divide in double precision
+    for (double sigma : {4.0, 35.0}) {
+        augmentorLib::FastGaussianBlurOperation<Image> integral(sigma, 3, augmentorLib::box_blur_mode::INTEGRAL);
+        Image image = source;
+        integral.perform(&image);
+        Image expected = source;
+        for (auto filter : augmentorLib::box_blur_filter_1D::pseudo_gaussian_filter(sigma, 3)) {
+            Image next(w, h);
+            for (long y = 0; y < h; ++y) {
+                for (long x = 0; x < w; ++x) {
+                    for (long p = 0; p < c; ++p) {
+                        next.pixel(x, y)[p] = box(expected, x, y, p, filter.length, filter.length);
+                    }
+                }
+            }
+            expected = next;
+        }
+        for (long y = 0; y < h; ++y) {
+            ASSERT_EQ(std::memcmp(static_cast<const Image&>(image).getRow(y),
+                                  static_cast<const Image&>(expected).getRow(y), w * c), 0) << sigma;
+        }
+    }
+}
+
+TEST(GeometryTest, rotate0)
+{
+    // an even width puts the centre between two columns
+    Image source(96, 61);
+    for (size_t y = 0; y < source.getHeight(); ++y) {
+        for (size_t x = 0; x < source.getWidth(); ++x) {
+            auto p = source.pixel(x, y);
+            p[0] = x * 5 + y;
+            p[1] = (x ^ y) * 3 & 0xff;
+            p[2] = ((x / 4 + y / 4) % 2) * 255;
+        }
+    }
+    const long w = source.getWidth(), h = source.getHeight(), c = source.getPixelSize();
+    const double cx = (w - 1) / 2.0, cy = (h - 1) / 2.0;
+    auto rotate = [&source](int degree, augmentorLib::interpolation mode) {
+        augmentorLib::RotateOperation<Image> operation({degree, degree}, mode);
+        Image image = source;
+        operation.perform(&image);
+        return image;
+    };
+    auto near_half = [](double v) { return std::abs(v - std::floor(v) - 0.5) < 0.01; };
+
+    // nearest matches rounding the exact source position, but where that is within fixed point error of a tie
+    for (int degree : {17, 90, 180, -33, 251}) {
+        Image image = rotate(degree, augmentorLib::interpolation::NEAREST);
+        double angle = degree * M_PI / 180.0;
+        for (long y = 0; y < h; ++y) {
+            for (long x = 0; x < w; ++x) {
+                double xs = std::cos(angle) * (x - cx) - std::sin(angle) * (y - cy) + cx;
+                double ys = std::sin(angle) * (x - cx) + std::cos(angle) * (y - cy) + cy;
+                if (near_half(xs) || near_half(ys)) {
+                    continue;
+                }
+                long u = std::lround(xs), v = std::lround(ys);
+                for (long p = 0; p < c; ++p) {
+                    uint8_t expected = u >= 0 && u < w && v >= 0 && v < h ? source.pixel(u, v)[p] : 0;
+                    ASSERT_EQ(image.pixel(x, y)[p], expected) << degree << " at " << x << "," << y;
+                }
+            }
+        }
+    }
+
+    // bilinear is within rounding of blending in double precision, with positions off by up to 1/256 of a pixel
+    // along either axis, a level on the 255 step edges; a full turn gives back the source
+    for (int degree : {17, -33}) {
+        Image image = rotate(degree, augmentorLib::interpolation::BILINEAR);
+        double angle = degree * M_PI / 180.0;
+        for (long y = 0; y < h; ++y) {
+            for (long x = 0; x < w; ++x) {
+                double xs = std::cos(angle) * (x - cx) - std::sin(angle) * (y - cy) + cx;
+                double ys = std::sin(angle) * (x - cx) + std::cos(angle) * (y - cy) + cy;
+                if (xs < 0.01 || ys < 0.01 || xs > w - 1.01 || ys > h - 1.01) {
+                    continue;
+                }
+                long u = std::floor(xs), v = std::floor(ys);
+                double fx = xs - u, fy = ys - v;
+                for (long p = 0; p < c; ++p) {
+                    double top = source.pixel(u, v)[p] * (1 - fx) + source.pixel(u + 1, v)[p] * fx;
+                    double bottom = source.pixel(u, v + 1)[p] * (1 - fx) + source.pixel(u + 1, v + 1)[p] * fx;
+                    EXPECT_NEAR(image.pixel(x, y)[p], top * (1 - fy) + bottom * fy, 2.5) << degree << " at " << x << "," << y;
+                }
+            }
+        }
+    }
+    Image turned = rotate(360, augmentorLib::interpolation::BILINEAR);
+    for (long y = 0; y < h; ++y) {
+        ASSERT_EQ(std::memcmp(static_cast<const Image&>(turned).getRow(y), source.getRow(y), w * c), 0);
+    }
+}
+
+TEST(GeometryTest, rotateFixedPoint0)
+{
+    // every sampler, vector or not, gives exactly the 16.16 stepping with 7 bit bilinear weights
+    // a width of 64 leaves RGB rows without padding, so gathers at the very end of the buffer must not run
+    for (auto [c, width] : std::vector<std::pair<size_t, size_t>>{{1, 83}, {3, 83}, {3, 64}, {4, 83}}) {
+        Image source(width, 64, c);
+        for (size_t y = 0; y < source.getHeight(); ++y) {
+            for (size_t x = 0; x < source.getWidth(); ++x) {
+                for (size_t p = 0; p < c; ++p) {
+                    source.pixel(x, y)[p] = static_cast<uint8_t>(x * 7 + y * 13 + p * 61 + (x * y) % 5);
+                }
+            }
+        }
+        const int64_t w = source.getWidth(), h = source.getHeight(), unit = 1 << 16;
+        const double cx = (w - 1) / 2.0, cy = (h - 1) / 2.0;
+        for (int degree : {13, 90, -41, 200}) {
+            for (auto mode : {augmentorLib::interpolation::NEAREST, augmentorLib::interpolation::BILINEAR}) {
+                augmentorLib::RotateOperation<Image> operation({degree, degree}, mode);
+                Image image = source;
+                operation.perform(&image);
+                double angle = degree * M_PI / 180.0, cosine = std::cos(angle), sine = std::sin(angle);
+                int64_t step_x = std::llround(cosine * unit), step_y = std::llround(sine * unit);
+                for (int64_t y = 0; y < h; ++y) {
+                    double yt = y - cy;
+                    int64_t sx = std::llround((cosine * -cx - sine * yt + cx) * unit);
+                    int64_t sy = std::llround((sine * -cx + cosine * yt + cy) * unit);
+                    for (int64_t x = 0; x < w; ++x) {
+                        int64_t u = sx + x * step_x, v = sy + x * step_y;
+                        std::vector<uint8_t> expected(c, 0);
+                        if (mode == augmentorLib::interpolation::NEAREST) {
+                            if (u >= -unit / 2 && u < w * unit - unit / 2 && v >= -unit / 2 && v < h * unit - unit / 2) {
+                                auto p = source.pixel((u + unit / 2) >> 16, (v + unit / 2) >> 16);
+                                expected.assign(p, p + c);
+                            }
+                        } else if (u >= 0 && u <= (w - 1) * unit && v >= 0 && v <= (h - 1) * unit) {
+                            u += 1 << 8;
+                            v += 1 << 8;
+                            int64_t column = u >> 16, row = v >> 16, fx = (u >> 9) & 127, fy = (v >> 9) & 127;
+                            int64_t right = column + 1 < w ? 1 : 0, down = row + 1 < h ? 1 : 0;
+                            for (size_t p = 0; p < c; ++p) {
+                                int64_t upper = source.pixel(column, row)[p] * (128 - fx) +
+                                                source.pixel(column + right, row)[p] * fx;
+                                int64_t lower = source.pixel(column, row + down)[p] * (128 - fx) +
+                                                source.pixel(column + right, row + down)[p] * fx;
+                                expected[p] = static_cast<uint8_t>((upper * (128 - fy) + lower * fy + (1 << 13)) >> 14);
+                            }
+                        }
+                        ASSERT_TRUE(std::equal(expected.begin(), expected.end(), image.pixel(x, y)))
+                                << c << " components, " << operation.describe() << " at " << x << "," << y;
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST(GeometryTest, resize0)
+{
+    Image source(96, 60);
+    for (size_t y = 0; y < source.getHeight(); ++y) {
+        for (size_t x = 0; x < source.getWidth(); ++x) {
+            auto p = source.pixel(x, y);
+            p[0] = x * 2 + y;
+            p[1] = (x ^ y) * 5 & 0xff;
+            p[2] = ((x / 3 + y / 3) % 2) * 255;
+        }
+    }
+    const size_t c = source.getPixelSize();
+    using augmentorLib::resize_filter;
+    auto resized = [&source](size_t height, size_t width, resize_filter filter) {
+        Image image = source;
+        image.resize(height, width, filter);
+        EXPECT_EQ(image.getHeight(), height);
+        EXPECT_EQ(image.getWidth(), width);
+        return image;
+    };
+
+    // nearest picks the pixel at the top left corner of each output pixel
+    for (auto [height, width] : std::vector<std::pair<size_t, size_t>>{{25, 41}, {133, 250}}) {
+        Image image = resized(height, width, resize_filter::NEAREST);
+        for (size_t y = 0; y < height; ++y) {
+            for (size_t x = 0; x < width; ++x) {
+                ASSERT_EQ(std::memcmp(image.pixel(x, y), source.pixel(x * 96 / width, y * 60 / height), c), 0);
+            }
+        }
+    }
+
+    // at the same size the filters weigh only the pixel itself
+    for (auto filter : {resize_filter::BILINEAR, resize_filter::AREA, resize_filter::LANCZOS3}) {
+        Image image = resized(60, 96, filter);
+        for (size_t y = 0; y < 60; ++y) {
+            ASSERT_EQ(std::memcmp(static_cast<const Image&>(image).getRow(y), source.getRow(y), 96 * c), 0);
+        }
+    }
+
+    // area shrinks by whole factors to the mean of each block, rounded once per axis
+    Image area = resized(15, 24, resize_filter::AREA);
+    for (size_t y = 0; y < 15; ++y) {
+        for (size_t x = 0; x < 24; ++x) {
+            for (size_t p = 0; p < c; ++p) {
+                double sum = 0;
+                for (size_t v = 0; v < 4; ++v) {
+                    for (size_t u = 0; u < 4; ++u) {
+                        sum += source.pixel(x * 4 + u, y * 4 + v)[p];
+                    }
+                }
+                EXPECT_NEAR(area.pixel(x, y)[p], sum / 16, 1) << x << "," << y;
+            }
+        }
+    }
+
+    // any filter keeps a flat image flat, and bilinear and lanczos follow a ramp
+    Image flat(37, 23);
+    for (size_t y = 0; y < 23; ++y) {
+        for (size_t x = 0; x < 37; ++x) {
+            auto p = flat.pixel(x, y);
+            p[0] = 200;
+            p[1] = 13;
+            p[2] = x * 6;
+        }
+    }
+    for (auto filter : {resize_filter::BILINEAR, resize_filter::AREA, resize_filter::LANCZOS3}) {
+        for (auto [height, width] : std::vector<std::pair<size_t, size_t>>{{9, 11}, {70, 111}}) {
+            Image image = flat;
+            image.resize(height, width, filter);
+            for (size_t y = 0; y < height; ++y) {
+                for (size_t x = 0; x < width; ++x) {
+                    ASSERT_EQ(image.pixel(x, y)[0], 200);
+                    ASSERT_EQ(image.pixel(x, y)[1], 13);
+                    // the ramp is clamped at the edges, where the filters see a step
+                    double centre = (x + 0.5) * 37 / width - 0.5;
+                    if (filter != resize_filter::AREA && centre > 3 * 37.0 / width + 3 &&
+                        centre < 33 - 3 * 37.0 / width) {
+                        EXPECT_NEAR(image.pixel(x, y)[2], centre * 6, 1.5) << x;
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST(StagedTest, sample0)
+{
+    auto in = make_input_dir("staged_in", 3);
+    auto out = make_output_dir("staged_out");
+    augmentorLib::Augmentor augmentor(in, out);
+    augmentor.stages({2, 2, 2, 2, 4}).invert(1).rotate(10, 20, 0.5).flip(HORIZONTAL, 0.5).sample(40);
+    for (size_t j = 0; j < 40; ++j) {
+        Image image(out + "output_" + std::to_string(j) + ".jpg");
+        EXPECT_EQ(image.getWidth(), 64u);
+    }
+
+    const auto& report = augmentor.stage_report();
+    ASSERT_EQ(report.size(), 4u);
+    EXPECT_EQ(report[0].name, "read");
+    EXPECT_EQ(report[0].items, 40u);
+    EXPECT_EQ(report[3].name, "encode");
+    EXPECT_EQ(report[3].items, 40u);
+    EXPECT_EQ(report[1].items, 40u);
+    EXPECT_EQ(report[0].queue_capacity, 0u);
+    for (size_t i = 1; i < 4; ++i) {
+        EXPECT_EQ(report[i].queue_capacity, 4u);
+        EXPECT_LE(report[i].peak_queue, 4u);
+        EXPECT_GT(report[i].busy_seconds, 0);
+    }
+
+    // untouched samples skip decoding altogether and keep their bytes
+    auto untouched = make_output_dir("staged_untouched");
+    augmentorLib::Augmentor copies(in, untouched);
+    copies.stages({}).invert(0).sample(5);
+    EXPECT_EQ(copies.stage_report()[1].items, 0u);
+    EXPECT_EQ(copies.stage_report()[3].items, 5u);
+    auto bytes = read_file(untouched + "output_4.jpg");
+    EXPECT_TRUE(bytes == read_file(in + "input_0.jpg") || bytes == read_file(in + "input_1.jpg") ||
+                bytes == read_file(in + "input_2.jpg"));
+}
+
+TEST(DirectorySinkTest, fanOut0)
+{
+    auto in = make_input_dir("fan_out_in", 1);
+    auto out = make_output_dir("fan_out_out");
+    augmentorLib::directory_options options;
+    options.fan_out = 16;
+    options.levels = 2;
+    options.sync_every = 4;
+    augmentorLib::Augmentor augmentor(in, out);
+    augmentor.directory(options).invert(1).sample(20);
+
+    augmentorLib::DirectorySink layout(out, options);
+    EXPECT_EQ(layout.path(0), out + "0/0/output_0.jpg");
+    EXPECT_EQ(layout.path(19), out + "3/1/output_19.jpg");
+    size_t files = 0;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(out)) {
+        if (entry.is_regular_file()) {
+            EXPECT_EQ(entry.path().extension(), ".jpg");
+            ++files;
+        }
+    }
+    EXPECT_EQ(files, 20u);
+    Image image(layout.path(19));
+    EXPECT_EQ(image.getWidth(), 64u);
+
+    // 2^48 possible leaves, of which only those written to exist
+    augmentorLib::DirectorySink wide(out, {65536, 3, false, 0});
+    augmentorLib::sample_record record;
+    record.index = 65537;
+    wide.write(record, {0xff, 0xd8, 0xff, 0xd9});
+    EXPECT_EQ(wide.path(65537), out + "0001/0001/0000/output_65537.jpg");
+    EXPECT_TRUE(std::filesystem::exists(wide.path(65537)));
+}
+
+TEST(DirectorySinkTest, batches0)
+{
+    auto out = make_output_dir("sync_batches_out");
+    augmentorLib::directory_options options;
+    options.atomic = true;
+    options.sync_every = 3;
+    augmentorLib::DirectorySink sink(out, options);
+    const std::vector<uint8_t> bytes = {0xff, 0xd8, 0xff, 0xd9};
+    augmentorLib::sample_record record;
+    for (size_t i = 0; i < 4; ++i) {
+        record.index = i;
+        sink.write(record, bytes);
+    }
+    // the first batch is in place, the fourth file waits for the next sync under its temporary name
+    EXPECT_TRUE(std::filesystem::exists(sink.path(2)));
+    EXPECT_FALSE(std::filesystem::exists(sink.path(3)));
+    EXPECT_TRUE(std::filesystem::exists(sink.path(3) + ".tmp"));
+    sink.flush();
+    EXPECT_TRUE(std::filesystem::exists(sink.path(3)));
+    EXPECT_FALSE(std::filesystem::exists(sink.path(3) + ".tmp"));
+}
 
+TEST(ShardSinkTest, roundTrip0)
+{
+    auto in = make_input_dir("shard_in", 2);
+    auto out = make_output_dir("shard_out");
+    auto source_size = std::filesystem::file_size(in + "input_0.jpg");
+
+    augmentorLib::shard_options options;
+    // room for about two records per shard
+    options.max_shard_bytes = source_size * 5 / 2;
+    augmentorLib::Augmentor augmentor(in, make_output_dir("shard_unused"));
+    augmentor.shards(out, options).invert(1).rotate(10, 20, 0.5).sample(7);
+
+    size_t records = 0;
+    for (size_t shard = 0; std::filesystem::exists(out + "shard-0000" + std::to_string(shard) + ".shard"); ++shard) {
+        augmentorLib::ShardReader reader(out + "shard-0000" + std::to_string(shard) + ".shard");
+        EXPECT_GE(reader.size(), 1u);
+        EXPECT_LE(reader.size(), 3u);
+        for (size_t i = 0; i < reader.size(); ++i) {
+            auto metadata = reader.metadata(i);
+            EXPECT_NE(metadata.find("\"index\":" + std::to_string(records)), std::string::npos);
+            EXPECT_NE(metadata.find("\"source\":\"" + in + "input_"), std::string::npos);
+            EXPECT_NE(metadata.find("\"invert\""), std::string::npos);
+            auto bytes = reader.read(i);
+            Image image(bytes.data(), bytes.size());
+            EXPECT_EQ(image.getWidth(), 64u);
+            ++records;
+        }
+    }
+    EXPECT_EQ(records, 7u);
+    EXPECT_TRUE(std::filesystem::is_empty(make_output_dir("shard_unused")));
+}
+
+TEST(ShardSinkTest, passthrough0)
+{
+    auto in = make_input_dir("shard_passthrough_in", 1);
+    auto out = make_output_dir("shard_passthrough_out");
+    augmentorLib::Augmentor augmentor(in, out);
+    augmentor.shards(out).invert(0).sample(2);
 
+    augmentorLib::ShardReader reader(out + "shard-00000.shard");
+    ASSERT_EQ(reader.size(), 2u);
+    auto bytes = reader.read(1);
+    EXPECT_EQ(std::string(bytes.begin(), bytes.end()), read_file(in + "input_0.jpg"));
+    EXPECT_NE(reader.metadata(1).find("\"operations\":[]"), std::string::npos);
+}
+
+TEST(TensorSinkTest, npy0)
+{
+    auto in = make_input_dir("tensor_in", 1);
+    auto out = make_output_dir("tensor_out");
+    augmentorLib::tensor_options options;
+    options.batch_size = 2;
+    options.height = 48;
+    options.width = 64;
+    augmentorLib::Augmentor augmentor(in, out);
+    augmentor.tensors(out, options).invert(0).sample(3);
+
+    // two full batches would be 2 + 1 samples
+    auto first = read_file(out + "batch-00000.npy");
+    auto last = read_file(out + "batch-00001.npy");
+    EXPECT_EQ(first.substr(0, 6), "\x93NUMPY");
+    size_t header = 10 + static_cast<uint8_t>(first[8]) + (static_cast<uint8_t>(first[9]) << 8);
+    EXPECT_EQ(header % 64, 0u);
+    EXPECT_NE(first.find("'descr': '|u1'"), std::string::npos);
+    EXPECT_NE(first.find("'shape': (2, 48, 64, 3)"), std::string::npos);
+    EXPECT_NE(last.find("'shape': (1, 48, 64, 3)"), std::string::npos);
+    ASSERT_EQ(first.size(), header + 2 * 48 * 64 * 3);
+
+    const Image source(in + "input_0.jpg");
+    for (size_t y = 0; y < 48; ++y) {
+        EXPECT_EQ(first.compare(header + y * 64 * 3, 64 * 3,
+                                reinterpret_cast<const char*>(source.getRow(y)), 64 * 3), 0);
+    }
+    auto json = read_file(out + "batch-00001.json");
+    EXPECT_NE(json.find("\"shape\":[1,48,64,3]"), std::string::npos);
+    EXPECT_NE(json.find("\"index\":2"), std::string::npos);
+    EXPECT_FALSE(std::filesystem::exists(out + "output_0.jpg"));
+}
+
+TEST(TensorSinkTest, normalise0)
+{
+    auto in = make_input_dir("tensor_normalise_in", 1);
+    auto out = make_output_dir("tensor_normalise_out");
+    augmentorLib::tensor_options options;
+    options.height = 48;
+    options.width = 64;
+    options.layout = augmentorLib::tensor_layout::NCHW;
+    options.dtype = augmentorLib::tensor_dtype::FLOAT32;
+    options.format = augmentorLib::tensor_format::RAW;
+    options.mean = {0.5f, 0.25f, 0, 0};
+    options.std = {0.5f, 2, 1, 1};
+    {
+        augmentorLib::TensorSink sink(out, options);
+        const Image source(in + "input_0.jpg");
+        sink.write_image(augmentorLib::sample_record{0, in + "input_0.jpg", {}}, source, encode_options{});
+        sink.flush();
+        ASSERT_EQ(sink.batches().size(), 1u);
+
+        auto raw = read_file(out + "batch-00000.raw");
+        ASSERT_EQ(raw.size(), 3 * 48 * 64 * sizeof(float));
+        const auto* values = reinterpret_cast<const float*>(raw.data());
+        for (size_t c = 0; c < 3; ++c) {
+            for (size_t y = 0; y < 48; y += 7) {
+                for (size_t x = 0; x < 64; x += 5) {
+                    float expected = (source.pixelUnchecked(x, y)[c] / 255.0f - options.mean[c]) / options.std[c];
+                    EXPECT_NEAR(values[(c * 48 + y) * 64 + x], expected, 1e-5);
+                }
+            }
+        }
+
+        Image wrong(32, 32);
+        EXPECT_THROW(sink.write_image(augmentorLib::sample_record{}, wrong, encode_options{}), std::invalid_argument);
+    }
+    EXPECT_NE(read_file(out + "batch-00000.json").find("\"layout\":\"NCHW\""), std::string::npos);
+}
 
 int main(int argc, char **argv) { ::testing::InitGoogleTest(&argc, argv); return RUN_ALL_TESTS(); }
 